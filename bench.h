@@ -0,0 +1,177 @@
+// A small harness for the bench_*.c microbenchmarks.
+// Each benchmark is a function that carries out n operations and returns how many bytes they went through.
+// It's run with n doubling until one call takes BENCH_MIN_NS, then timed BENCH_RUNS more times, and the fastest run is kept.
+// Results can be saved as a baseline (-o) and compared against one (-b), in which case anything more than
+//  the threshold (-t, in percent) slower than its baseline is reported as a regression and the exit code is 1.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef unsigned long long u64;
+
+#define BENCH_MIN_NS 20000000ULL // 20 ms
+#define BENCH_RUNS   5
+#define MAX_BENCHES  64
+#define DEFAULT_BENCH_THRESHOLD 10.0
+
+typedef u64 (*Bench_Func)(void *arg, u64 n);
+
+// benchmarks put their results here, so that the calls being timed can't be optimised away
+static volatile u64 bench_sink;
+
+typedef struct {
+	char name[64];
+	double ns_per_op;
+	double bytes_per_sec;
+} Bench_Timing;
+
+typedef struct {
+	Bench_Timing results[MAX_BENCHES];
+	int n_results;
+
+	const char *filter;
+	const char *baseline;
+	const char *save;
+	double threshold;
+	FILE *out; // where results go, since some benchmarks write to stdout
+} Bench_Suite;
+
+static inline u64 bench_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns 0 if the options make sense, after printing the usage if they don't
+static inline int bench_init(Bench_Suite *b, int argc, char **argv) {
+	memset(b, 0, sizeof(Bench_Suite));
+	b->threshold = DEFAULT_BENCH_THRESHOLD;
+	b->out = stdout;
+
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+			char *arg = argv[++i];
+			switch (argv[i-1][1]) {
+				case 'f': b->filter = arg; continue;
+				case 'b': b->baseline = arg; continue;
+				case 'o': b->save = arg; continue;
+				case 't': b->threshold = atof(arg); continue;
+			}
+		}
+
+		printf(
+			"Usage: %s [-f <name filter>] [-b <baseline file>] [-o <baseline file to write>] [-t <threshold %%>]\n"
+			" Runs every benchmark whose name contains the filter. With -b, anything more than the threshold\n"
+			" (default %.0f%%) slower than the baseline counts as a regression\n",
+			argv[0], DEFAULT_BENCH_THRESHOLD
+		);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Sends stdout to /dev/null from now on, for benchmarks of functions that print. Results still go to the real stdout.
+static inline void bench_silence_stdout(Bench_Suite *b) {
+	fflush(stdout);
+	b->out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+}
+
+static inline void bench_run(Bench_Suite *b, const char *name, Bench_Func func, void *arg) {
+	if ((b->filter && !strstr(name, b->filter)) || b->n_results >= MAX_BENCHES)
+		return;
+
+	u64 n = 1;
+	while (1) {
+		u64 t = bench_time_ns();
+		func(arg, n);
+		if (bench_time_ns() - t >= BENCH_MIN_NS || n >= (1ULL << 40))
+			break;
+		n *= 2;
+	}
+
+	double best = 0, bytes_per_sec = 0;
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		u64 t = bench_time_ns();
+		u64 bytes = func(arg, n);
+		double ns = (double)(bench_time_ns() - t);
+
+		if (i == 0 || ns < best) {
+			best = ns;
+			bytes_per_sec = bytes / (ns / 1e9);
+		}
+	}
+
+	Bench_Timing *r = &b->results[b->n_results++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->ns_per_op = best / n;
+	r->bytes_per_sec = bytes_per_sec;
+
+	fprintf(b->out, "%-32s %12.1f ns/op", r->name, r->ns_per_op);
+	if (bytes_per_sec > 0)
+		fprintf(b->out, " %10.1f MB/s", bytes_per_sec / 1e6);
+	fprintf(b->out, "\n");
+	fflush(b->out);
+}
+
+/*
+ * Compares the results against the baseline and/or saves them, as lines of "<name> <ns per op>".
+ * Benchmarks missing from the baseline are left out of the comparison.
+ * Returns the number of regressions.
+ */
+static inline int bench_finish(Bench_Suite *b) {
+	int n_regressions = 0;
+
+	if (b->baseline) {
+		FILE *f = fopen(b->baseline, "r");
+		if (!f) {
+			fprintf(b->out, "Could not open %s\n", b->baseline);
+		}
+		else {
+			fprintf(b->out, "\nCompared with %s:\n", b->baseline);
+
+			char name[64];
+			double ns;
+			while (fscanf(f, "%63s %lf", name, &ns) == 2) {
+				for (int i = 0; i < b->n_results; i++) {
+					Bench_Timing *r = &b->results[i];
+					if (strcmp(r->name, name) || ns <= 0)
+						continue;
+
+					double change = (r->ns_per_op - ns) / ns * 100;
+					int regressed = change > b->threshold;
+					n_regressions += regressed;
+
+					fprintf(b->out, "%-32s %12.1f -> %12.1f ns/op %+7.1f%%%s\n", name, ns, r->ns_per_op, change, regressed ? "  REGRESSION" : "");
+				}
+			}
+			fclose(f);
+		}
+	}
+
+	if (b->save) {
+		FILE *f = fopen(b->save, "w");
+		if (f) {
+			for (int i = 0; i < b->n_results; i++)
+				fprintf(f, "%s %.3f\n", b->results[i].name, b->results[i].ns_per_op);
+			fclose(f);
+		}
+		else {
+			fprintf(b->out, "Could not write %s\n", b->save);
+		}
+	}
+
+	if (n_regressions)
+		fprintf(b->out, "%d regression(s)\n", n_regressions);
+
+	return n_regressions;
+}
+
+#endif
@@ -0,0 +1,169 @@
+// Microbenchmarks for analyse: USBPcap parsing and each of the views, over a synthetic capture held in memory.
+// analyse.c is built in with its main() renamed, so that the functions measured are exactly the ones it uses.
+
+#define main analyse_main
+#include "analyse.c"
+#undef main
+
+#include "bench.h"
+
+#define N_CTRL_PAIRS 100000
+#define ISOC_EVERY   16 // one isochronous transfer per this many control transfers
+#define ISOC_PKTS    8
+#define ISOC_PKT_SZ  3072
+
+typedef struct {
+	u8 *buf;
+	int size;
+	int *offsets; // of each record's USBPcap header
+	struct Packet *pkts;
+	int n_records;
+} Capture;
+
+typedef struct {
+	Capture *cap;
+	void (*view)(struct Packet*, u8*, int, int);
+} View_Arg;
+
+u8 *put_record(u8 *p, Usbpcap_Header *hdr, void *extra, int extra_len, u8 *payload) {
+	Pcap_Record rec = {0, 0, hdr->hdr_sz + hdr->data_len, hdr->hdr_sz + hdr->data_len};
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, hdr, sizeof(Usbpcap_Header));
+	p += sizeof(Usbpcap_Header);
+	memcpy(p, extra, extra_len);
+	p += extra_len;
+	if (hdr->data_len)
+		memcpy(p, payload, hdr->data_len);
+	return p + hdr->data_len;
+}
+
+// Register writes and reads as request/response pairs, with an isochronous read now and then, like a capture of a card being set up
+void build_capture(Capture *cap) {
+	int n_isoc = N_CTRL_PAIRS / ISOC_EVERY;
+	int isoc_hdr = sizeof(Usbpcap_Header) + sizeof(Usbpcap_Isoc) + ISOC_PKTS * sizeof(Usbpcap_Iso_Packet);
+	int max_size = PCAP_FIRST_PACKET + N_CTRL_PAIRS * 2 * 64 + n_isoc * 2 * (32 + isoc_hdr + ISOC_PKTS * ISOC_PKT_SZ);
+
+	cap->buf = calloc(max_size, 1);
+	u8 *p = cap->buf + sizeof(Pcap_Header);
+	Pcap_Header ph = {PCAP_MAGIC, 2, 4, 0, 0, PCAP_SNAPLEN, LINKTYPE_USBPCAP};
+	memcpy(cap->buf, &ph, sizeof(ph));
+
+	u8 *isoc_data = malloc(ISOC_PKTS * ISOC_PKT_SZ);
+	memset(isoc_data, 0x80, ISOC_PKTS * ISOC_PKT_SZ);
+
+	for (int i = 0; i < N_CTRL_PAIRS; i++) {
+		int in = i & 1;
+		u8 reg = em28xx_regs[i % N_REGS].index;
+		u8 value = i * 7;
+
+		Usbpcap_Header hdr = {sizeof(Usbpcap_Header) + 1, i + 1, 0, URB_FUNCTION_CONTROL_TRANSFER, 0, 1, 1, in ? 0x80 : 0, URB_CTRL, 8};
+		u8 setup[9] = {in ? 0xc0 : 0x40, 0, 0, 0, reg, 0, 1, 0, value};
+		if (!in)
+			hdr.data_len = 9;
+
+		u8 stage = USBPCAP_STAGE_SETUP;
+		p = put_record(p, &hdr, &stage, 1, setup);
+
+		hdr.info = USBPCAP_INFO_RESPONSE;
+		hdr.data_len = in;
+		stage = USBPCAP_STAGE_COMPLETE;
+		p = put_record(p, &hdr, &stage, 1, &value);
+
+		if (i % ISOC_EVERY == 0) {
+			u8 extra[sizeof(Usbpcap_Isoc) + ISOC_PKTS * sizeof(Usbpcap_Iso_Packet)];
+			Usbpcap_Isoc isoc = {i, ISOC_PKTS, 0};
+			memcpy(extra, &isoc, sizeof(isoc));
+			for (int j = 0; j < ISOC_PKTS; j++) {
+				Usbpcap_Iso_Packet pk = {j * ISOC_PKT_SZ, ISOC_PKT_SZ, 0};
+				memcpy(extra + sizeof(isoc) + j * sizeof(pk), &pk, sizeof(pk));
+			}
+
+			Usbpcap_Header ih = {isoc_hdr, i + 1, 0, URB_FUNCTION_ISOCH_TRANSFER, 0, 1, 1, 0x82, URB_ISOC, 0};
+			p = put_record(p, &ih, extra, sizeof(extra), NULL);
+
+			ih.info = USBPCAP_INFO_RESPONSE;
+			ih.data_len = ISOC_PKTS * ISOC_PKT_SZ;
+			p = put_record(p, &ih, extra, sizeof(extra), isoc_data);
+		}
+	}
+
+	cap->size = p - cap->buf;
+	free(isoc_data);
+
+	// parse it once up front, for the views
+	int n = 0;
+	for (u32 idx = PCAP_FIRST_PACKET; idx < cap->size; ) {
+		struct Packet pkt;
+		idx += get_next_packet(&pkt, cap->buf, idx);
+		n++;
+	}
+
+	cap->n_records = n;
+	cap->offsets = malloc(n * sizeof(int));
+	cap->pkts = malloc(n * sizeof(struct Packet));
+
+	u32 idx = PCAP_FIRST_PACKET;
+	for (int i = 0; i < n; i++) {
+		cap->offsets[i] = idx;
+		idx += get_next_packet(&cap->pkts[i], cap->buf, idx);
+	}
+}
+
+u64 bench_get_next_packet(void *arg, u64 n) {
+	Capture *cap = arg;
+	struct Packet pkt;
+	u64 bytes = 0;
+	u32 idx = PCAP_FIRST_PACKET;
+
+	for (u64 i = 0; i < n; i++) {
+		if (idx >= cap->size)
+			idx = PCAP_FIRST_PACKET;
+
+		int len = get_next_packet(&pkt, cap->buf, idx);
+		idx += len;
+		bytes += len;
+		bench_sink += pkt.ts_us;
+	}
+
+	return bytes;
+}
+
+u64 bench_view(void *arg, u64 n) {
+	View_Arg *va = arg;
+	Capture *cap = va->cap;
+	u64 bytes = 0;
+
+	for (u64 i = 0; i < n; i++) {
+		int r = i % cap->n_records;
+		struct Packet *pkt = &cap->pkts[r];
+		va->view(pkt, cap->buf + cap->offsets[r], r + 1, 1);
+		bytes += pkt->hdr_sz + pkt->pkt_sz;
+	}
+
+	return bytes;
+}
+
+int main(int argc, char **argv) {
+	Bench_Suite suite;
+	if (bench_init(&suite, argc, argv) < 0)
+		return 2;
+
+	Capture cap;
+	build_capture(&cap);
+	fprintf(suite.out, "Synthetic capture: %d records, %d bytes\n", cap.n_records, cap.size);
+
+	bench_silence_stdout(&suite);
+
+	bench_run(&suite, "get_next_packet", bench_get_next_packet, &cap);
+
+	View_Arg views[] = {
+		{&cap, view_any}, {&cap, view_ctrl_packet}, {&cap, view_reg_packet}, {&cap, view_command}
+	};
+	const char *names[] = {"view_any", "view_ctrl_packet", "view_reg_packet", "view_command"};
+
+	for (int i = 0; i < 4; i++)
+		bench_run(&suite, names[i], bench_view, &views[i]);
+
+	return bench_finish(&suite) ? 1 : 0;
+}
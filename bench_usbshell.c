@@ -0,0 +1,185 @@
+// Microbenchmarks for usbshell's hot paths: the transfer log allocator, hex parsing, filters over a large log,
+//  and the aggregation of isochronous transfers in isoc_cb().
+// usbshell.c is built in with its main() renamed, so that the functions measured are exactly the ones it uses.
+
+#define main usbshell_main
+#include "usbshell.c"
+#undef main
+
+#include "bench.h"
+
+#define LOG_SIZE      1000000
+#define HEX_BYTES     4096
+#define ALLOC_SIZE    64
+#define BENCH_PKTS    64
+#define BENCH_PKT_SZ  3072
+#define LOG_ISOC_SIZE 1024
+
+// allocations are never freed one by one, so the buckets are thrown away every so often to keep memory in check
+#define ALLOC_FLUSH   0x10000
+#define ISOC_FLUSH    256
+
+typedef struct {
+	char *args[2];
+	int len;
+} Hex_Arg;
+
+typedef struct {
+	Filter filters[N_VARS];
+	int n_flts;
+} Filter_Arg;
+
+u64 bench_allocate(void *arg, u64 n) {
+	for (u64 i = 0; i < n; i++) {
+		if (i % ALLOC_FLUSH == 0)
+			destroy_buckets();
+		bench_sink = (u64)allocate(ALLOC_SIZE);
+	}
+
+	destroy_buckets();
+	return n * ALLOC_SIZE;
+}
+
+u64 bench_parse_byte_array(void *arg, u64 n) {
+	Hex_Arg *ha = arg;
+	u64 bytes = 0;
+
+	for (u64 i = 0; i < n; i++) {
+		u8 *data = NULL;
+		int sz = parse_byte_array(2, ha->args, 1, &data, 0, malloc_ator);
+		free(data);
+		bytes += sz > 0 ? ha->len : 0;
+	}
+
+	return bytes;
+}
+
+u64 bench_parse_filter(void *arg, u64 n) {
+	static const char *strs[] = {"index>=0x10<0x30", "type=ctrl", "size>4", "res<0", "ep=0x82"};
+	char buf[32];
+
+	for (u64 i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%s", strs[i % 5]);
+		bench_sink = parse_filter(buf).var;
+	}
+
+	return 0;
+}
+
+u64 bench_test_filters(void *arg, u64 n) {
+	Filter_Arg *fa = arg;
+	u64 matches = 0;
+
+	for (u64 i = 0; i < n; i++)
+		matches += test_filters(get_transfer(i % LOG_SIZE), fa->filters, fa->n_flts);
+
+	bench_sink = matches;
+	return n * sizeof(Xfer_Entry);
+}
+
+// A transfer log like the one a long session of register polling and streaming leaves behind
+void build_log(void) {
+	u8 payload[LOG_ISOC_SIZE] = {0};
+
+	for (int i = 0; i < LOG_SIZE; i++) {
+		int type = i % 16 == 15 ? TYPE_ISOC : TYPE_CTRL;
+		Xfer_Entry *xfer = new_transfer(type);
+
+		if (type == TYPE_CTRL) {
+			xfer->req_type = i & 1 ? 0xc0 : 0x40;
+			xfer->index = em28xx_regs[i % N_REGS].index;
+			xfer->size = 1;
+		}
+		else {
+			xfer->endpoint = 0x82;
+			xfer->n_pkts = 1;
+			xfer->pkt_sz = LOG_ISOC_SIZE;
+			xfer->size = LOG_ISOC_SIZE;
+			xfer->n_errors = i % 7 == 0;
+		}
+
+		index_transfer(xfer);
+		xfer->data = allocate(xfer->size);
+		if (xfer->data)
+			memcpy(xfer->data, payload, xfer->size);
+		xfer->res = xfer->size;
+	}
+}
+
+u64 bench_isoc_cb(void *arg, u64 n) {
+	struct libusb_transfer *usb_xfer = arg;
+	Isoc_Ring *slot = usb_xfer->user_data;
+	u64 bytes = 0;
+
+	for (u64 i = 0; i < n; i++) {
+		if (i % ISOC_FLUSH == 0)
+			destroy_buckets();
+
+		isoc_stream.in_flight = 1;
+		isoc_cb(usb_xfer);
+		bytes += slot->xfer->size;
+	}
+
+	destroy_buckets();
+	return bytes;
+}
+
+int main(int argc, char **argv) {
+	Bench_Suite suite;
+	if (bench_init(&suite, argc, argv) < 0)
+		return 2;
+
+	// usbshell prints the odd message (eg. about bad hex), which would only get in the way here
+	bench_silence_stdout(&suite);
+
+	bench_run(&suite, "allocate", bench_allocate, NULL);
+	destroy_buckets();
+
+	Hex_Arg ha;
+	ha.len = HEX_BYTES * 3;
+	ha.args[0] = "bench";
+	ha.args[1] = malloc(ha.len + 1);
+	for (int i = 0; i < HEX_BYTES; i++)
+		sprintf(ha.args[1] + i * 3, "%02x ", (i * 37) & 0xff);
+
+	bench_run(&suite, "parse_byte_array", bench_parse_byte_array, &ha);
+	free(ha.args[1]);
+
+	bench_run(&suite, "parse_filter", bench_parse_filter, NULL);
+
+	// isoc_cb() on a full-size IN transfer, without resubmitting it (the stream's count is 0)
+	Isoc_Ring slot = {0};
+	struct libusb_transfer *usb_xfer = libusb_alloc_transfer(BENCH_PKTS);
+	u8 *buf = calloc(BENCH_PKTS, BENCH_PKT_SZ);
+
+	slot.usb = usb_xfer;
+	slot.xfer = new_transfer(TYPE_ISOC);
+	slot.xfer->endpoint = 0x82;
+	slot.xfer->n_pkts = BENCH_PKTS;
+	slot.xfer->pkt_sz = BENCH_PKT_SZ;
+
+	libusb_fill_iso_transfer(usb_xfer, NULL, 0x82, buf, BENCH_PKTS * BENCH_PKT_SZ, BENCH_PKTS, isoc_cb, &slot, 0);
+	usb_xfer->status = LIBUSB_TRANSFER_COMPLETED;
+	for (int i = 0; i < BENCH_PKTS; i++) {
+		// packets are rarely full, and the odd one fails
+		usb_xfer->iso_packet_desc[i].length = BENCH_PKT_SZ;
+		usb_xfer->iso_packet_desc[i].actual_length = BENCH_PKT_SZ - (i % 4) * 256;
+		usb_xfer->iso_packet_desc[i].status = i % 29 == 28 ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+	}
+
+	bench_run(&suite, "isoc_cb", bench_isoc_cb, usb_xfer);
+
+	libusb_free_transfer(usb_xfer);
+	free(buf);
+
+	build_log();
+	fprintf(suite.out, "Synthetic transfer log: %d transfers\n", n_xfers);
+
+	char f1[] = "type=ctrl", f2[] = "index>=0x10<0x30", f3[] = "size>0";
+	char *flt_strs[] = {f1, f2, f3};
+	Filter_Arg fa;
+	fa.n_flts = parse_filters(3, flt_strs, fa.filters);
+	bench_run(&suite, "test_filters", bench_test_filters, &fa);
+
+	return bench_finish(&suite) ? 1 : 0;
+}
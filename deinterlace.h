@@ -0,0 +1,219 @@
+// Deinterlacing of frames whose two fields have been woven together (top field on even lines, bottom field on odd ones).
+//  - weave leaves the frame as it is, which combs wherever something moved between the fields
+//  - bob replaces the bottom field with the average of the top field lines around it
+//  - motion does the same, but only for bytes that changed by more than a threshold since the last frame's bottom field
+// Frames are changed in place. Averaging bytes is only meaningful for the YUV formats, so RGB565 frames can only be woven.
+
+#ifndef DEINTERLACE_H
+#define DEINTERLACE_H
+
+#include <stdlib.h>
+#include <time.h>
+#include "yuv.h"
+
+#define DEINT_WEAVE  0
+#define DEINT_BOB    1
+#define DEINT_MOTION 2
+#define N_DEINT_MODES 3
+
+#define DEFAULT_MOTION_THRESHOLD 12
+
+static const char *deint_names[N_DEINT_MODES] = {"weave", "bob", "motion"};
+
+typedef struct {
+	int mode;
+	int line_size;
+	int height;
+	int threshold;
+	u8 *prev; // motion: the bottom field of the last frame, as it was before being deinterlaced
+	int have_prev;
+
+	u64 n_frames;
+	u64 total_ns;
+	u64 max_ns;
+} Deinterlacer;
+
+static inline int get_deinterlace_mode(const char *name) {
+	for (int i = 0; i < N_DEINT_MODES; i++) {
+		if (!strcmp(name, deint_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+// Returns -1 if the threshold isn't 0-255 (the SIMD kernels compare bytes) or the motion buffer can't be allocated
+static inline int init_deinterlacer(Deinterlacer *d, int mode, int line_size, int height, int threshold) {
+	memset(d, 0, sizeof(Deinterlacer));
+	if (threshold < 0 || threshold > 255)
+		return -1;
+
+	d->mode = mode;
+	d->line_size = line_size;
+	d->height = height;
+	d->threshold = threshold;
+
+	if (mode == DEINT_MOTION) {
+		d->prev = malloc(line_size * (height / 2));
+		if (!d->prev)
+			return -1;
+	}
+	return 0;
+}
+
+static inline void free_deinterlacer(Deinterlacer *d) {
+	free(d->prev);
+	d->prev = NULL;
+}
+
+static inline void bob_line_scalar(u8 *dst, const u8 *above, const u8 *below, int n) {
+	for (int i = 0; i < n; i++)
+		dst[i] = (above[i] + below[i] + 1) >> 1;
+}
+
+static inline void motion_line_scalar(u8 *dst, u8 *prev, const u8 *above, const u8 *below, int n, int threshold) {
+	for (int i = 0; i < n; i++) {
+		int cur = dst[i];
+		int diff = cur > prev[i] ? cur - prev[i] : prev[i] - cur;
+		prev[i] = cur;
+		if (diff > threshold)
+			dst[i] = (above[i] + below[i] + 1) >> 1;
+	}
+}
+
+#ifdef YUV_X86
+
+static inline void bob_line_sse2(u8 *dst, const u8 *above, const u8 *below, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(above + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(below + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(a, b));
+	}
+	bob_line_scalar(dst + i, above + i, below + i, n - i);
+}
+
+static inline void motion_line_sse2(u8 *dst, u8 *prev, const u8 *above, const u8 *below, int n, int threshold) {
+	const __m128i thresh = _mm_set1_epi8((char)threshold);
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i cur = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i old = _mm_loadu_si128((const __m128i*)(prev + i));
+		_mm_storeu_si128((__m128i*)(prev + i), cur);
+
+		// |cur - old| > threshold, without leaving unsigned bytes
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(cur, old), _mm_subs_epu8(old, cur));
+		__m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(diff, thresh), zero);
+
+		__m128i a = _mm_loadu_si128((const __m128i*)(above + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(below + i));
+		__m128i out = _mm_or_si128(_mm_and_si128(still, cur), _mm_andnot_si128(still, _mm_avg_epu8(a, b)));
+		_mm_storeu_si128((__m128i*)(dst + i), out);
+	}
+	motion_line_scalar(dst + i, prev + i, above + i, below + i, n - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static inline void bob_line_avx2(u8 *dst, const u8 *above, const u8 *below, int n) {
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(above + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(below + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_avg_epu8(a, b));
+	}
+	bob_line_scalar(dst + i, above + i, below + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void motion_line_avx2(u8 *dst, u8 *prev, const u8 *above, const u8 *below, int n, int threshold) {
+	const __m256i thresh = _mm256_set1_epi8((char)threshold);
+	const __m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i cur = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i old = _mm256_loadu_si256((const __m256i*)(prev + i));
+		_mm256_storeu_si256((__m256i*)(prev + i), cur);
+
+		__m256i diff = _mm256_or_si256(_mm256_subs_epu8(cur, old), _mm256_subs_epu8(old, cur));
+		__m256i still = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, thresh), zero);
+
+		__m256i a = _mm256_loadu_si256((const __m256i*)(above + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(below + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(_mm256_avg_epu8(a, b), cur, still));
+	}
+	motion_line_scalar(dst + i, prev + i, above + i, below + i, n - i, threshold);
+}
+
+#endif
+
+static inline void bob_line(u8 *dst, const u8 *above, const u8 *below, int n) {
+#ifdef YUV_X86
+	int level = get_simd_level();
+	if (level >= SIMD_AVX2) {
+		bob_line_avx2(dst, above, below, n);
+		return;
+	}
+	if (level >= SIMD_SSE2) {
+		bob_line_sse2(dst, above, below, n);
+		return;
+	}
+#endif
+	bob_line_scalar(dst, above, below, n);
+}
+
+static inline void motion_line(u8 *dst, u8 *prev, const u8 *above, const u8 *below, int n, int threshold) {
+#ifdef YUV_X86
+	int level = get_simd_level();
+	if (level >= SIMD_AVX2) {
+		motion_line_avx2(dst, prev, above, below, n, threshold);
+		return;
+	}
+	if (level >= SIMD_SSE2) {
+		motion_line_sse2(dst, prev, above, below, n, threshold);
+		return;
+	}
+#endif
+	motion_line_scalar(dst, prev, above, below, n, threshold);
+}
+
+// Deinterlaces a frame in place, and adds the time it took to the totals
+static inline void deinterlace(Deinterlacer *d, u8 *frame) {
+	if (d->mode == DEINT_WEAVE)
+		return;
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	int n = d->line_size;
+	int n_lines = d->height / 2;
+
+	// the first frame has nothing to compare against, so it counts as still
+	if (d->mode == DEINT_MOTION && !d->have_prev) {
+		for (int i = 0; i < n_lines; i++)
+			memcpy(d->prev + i * n, frame + (2 * i + 1) * n, n);
+		d->have_prev = 1;
+	}
+
+	for (int i = 0; i < n_lines; i++) {
+		u8 *dst = frame + (2 * i + 1) * n;
+		u8 *above = dst - n;
+		u8 *below = i < n_lines - 1 ? dst + n : above; // the last line has nothing below it
+
+		if (d->mode == DEINT_BOB)
+			bob_line(dst, above, below, n);
+		else
+			motion_line(dst, d->prev + i * n, above, below, n, d->threshold);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	u64 ns = (u64)(t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+
+	d->n_frames++;
+	d->total_ns += ns;
+	if (ns > d->max_ns)
+		d->max_ns = ns;
+}
+
+#endif
@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
+#include "em28xx_emu.h"
+#include "eeprom.h"
+#include "i2c.h"
 
 #define TIMEOUT 100
 
@@ -10,49 +14,188 @@
 
 #define SIZE 0x1000
 
-typedef unsigned char u8;
-typedef unsigned short u16;
+#define EEPROM_ADDR 0xa0
 
-struct libusb_device_handle *dev;
+typedef unsigned long long u64;
 
-u16 get_0xa0(u16 index) {
-	u8 temp = 0;
-	u8 clk = 0x40;
-	u16 n = (index << 8) | (index >> 8);
-	u16 res = 0;
+struct libusb_device_handle *dev;
+const Transport *io = &libusb_transport;
+I2c_Bus bus;
 
-	libusb_control_transfer(dev, 0x40, 0, 0, 6, &clk, 1, TIMEOUT);
-	libusb_control_transfer(dev, 0x40, 3, 0, 0xa0, (u8*)&n, 2, TIMEOUT);
+u64 get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	libusb_control_transfer(dev, 0xc0, 0, 0, 5, &temp, 1, TIMEOUT);
-	libusb_control_transfer(dev, 0xc0, 2, 0, 0xa0, (u8*)&res, 2, TIMEOUT);
-	libusb_control_transfer(dev, 0xc0, 0, 0, 5, &temp, 1, TIMEOUT);
+// Points the EEPROM's address counter at <offset>. Every read afterwards carries on from where the last one stopped.
+int set_eeprom_address(u16 offset) {
+	u8 addr[2] = {offset >> 8, offset & 0xff};
+	int res = i2c_write(&bus, EEPROM_ADDR, addr, 2, 0);
+	if (res < 0)
+		printf("Writing the EEPROM address failed: %s (%d)\n", i2c_strerror(res), res);
 
 	return res;
 }
 
+/*
+ * Reads the whole EEPROM as one sequential read, split into chunks as big as the I2C engine allows.
+ * If the device turns down a chunk of a given size, the address is set again and the chunk size is halved.
+ * Returns the chunk size that was used, or a negative value on failure.
+ */
+int read_eeprom(u8 *buf, int size) {
+	int res = i2c_set_clock(&bus, I2C_WAIT_ENABLE | I2C_FREQ_100_KHZ);
+	if (res < 0) {
+		printf("Setting I2C_CLK failed: %s (%d)\n", libusb_strerror(res), res);
+		return -1;
+	}
+
+	if (set_eeprom_address(0) < 0)
+		return -2;
+
+	int chunk = I2C_MAX_LEN;
+	int pos = 0;
+	while (pos < size) {
+		int len = size - pos < chunk ? size - pos : chunk;
+		res = i2c_read(&bus, EEPROM_ADDR, buf + pos, len);
+
+		// the device turning down the request is worth another try with less, but a failed I2C transaction isn't
+		if (res < 0) {
+			if (res == I2C_ERROR_NO_ACK || res == I2C_ERROR_STATUS || chunk == 1) {
+				printf("Reading the EEPROM at %#x failed: %s (%d)\n", pos, i2c_strerror(res), res);
+				return -3;
+			}
+
+			chunk /= 2;
+			if (set_eeprom_address(pos) < 0)
+				return -4;
+			continue;
+		}
+
+		pos += len;
+	}
+
+	return chunk;
+}
+
+// Gets the EEPROM's contents from the cache, or from the card if they aren't there (or belong to another card, or don't match their checksum)
+int fetch_eeprom(u8 *buf, const char *cache_name, const char *card, int refresh) {
+	if (!refresh && load_eeprom_cache(cache_name, card, buf, SIZE) == 0) {
+		printf("Using the copy in %s\n", cache_name);
+		return 0;
+	}
+
+	u64 start = get_time_ns();
+	int chunk = read_eeprom(buf, SIZE);
+	double secs = (double)(get_time_ns() - start) / 1e9;
+
+	if (chunk < 0)
+		return chunk;
+
+	printf(
+		"Read %d bytes in %.3f ms (%.1f KB/s), %d requests with %d-byte chunks\n",
+		SIZE, secs * 1000, SIZE / secs / 1000, bus.n_requests, chunk
+	);
+
+	if (save_eeprom_cache(cache_name, card, buf, SIZE) < 0)
+		printf("Could not write %s\n", cache_name);
+
+	return 0;
+}
+
+// Writes the bus number and port path of a device, eg. "1-1.4", and its serial number (or an empty string)
+void get_device_key(char *path, int path_size, char *serial, int serial_size) {
+	libusb_device *udev = libusb_get_device(dev);
+	struct libusb_device_descriptor desc;
+
+	u8 ports[8];
+	int n_ports = libusb_get_port_numbers(udev, ports, 8);
+	int len = snprintf(path, path_size, "%d-", libusb_get_bus_number(udev));
+	for (int i = 0; i < n_ports && len < path_size; i++)
+		len += snprintf(path + len, path_size - len, i ? ".%d" : "%d", ports[i]);
+
+	serial[0] = 0;
+	if (libusb_get_device_descriptor(udev, &desc) == 0 && desc.iSerialNumber)
+		libusb_get_string_descriptor_ascii(dev, desc.iSerialNumber, (u8*)serial, serial_size);
+}
+
 int main(int argc, char **argv) {
+	int emu = 0, refresh = 0;
+	const char *out_name = "dump.bin", *cache_dir = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-e"))
+			emu = 1;
+		else if (!strcmp(argv[i], "-r"))
+			refresh = 1;
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			cache_dir = argv[++i];
+		else if (argv[i][0] == '-') {
+			printf(
+				"Usage: %s [-e] [-r] [-c <cache dir>] [output file]\n"
+				"Dumps the EEPROM to dump.bin (or the given file) and decodes its board configuration.\n"
+				"A copy is kept in a cache (by default in ~/.cache/em28286), which is used instead of the card from then on\n"
+				" -e  Read from an emulated device\n"
+				" -r  Read the card even if it's in the cache\n",
+				argv[0]
+			);
+			return 1;
+		}
+		else
+			out_name = argv[i];
+	}
+
 	if (libusb_init(NULL) < 0) {
 		printf("libusb_init() failed\n");
 		return 1;
 	}
 
-	dev = libusb_open_device_with_vid_pid(NULL, VENDOR, PRODUCT);
-	if (!dev) {
-		printf("Could not open USB with ID %04x:%04x\n", VENDOR, PRODUCT);
-		return 2;
+	char path[32] = "emu", serial[64] = "";
+	if (emu) {
+		io = &emu_transport;
+		dev = emu_open(0);
 	}
+	else {
+		dev = libusb_open_device_with_vid_pid(NULL, VENDOR, PRODUCT);
+		if (!dev) {
+			printf("Could not open USB with ID %04x:%04x\n", VENDOR, PRODUCT);
+			return 2;
+		}
+		get_device_key(path, sizeof(path), serial, sizeof(serial));
+	}
+
+	init_i2c_bus(&bus, dev, io, TIMEOUT);
 
-	u16 *buf = malloc(SIZE);
-	u16 *p = buf;
+	u8 *buf = malloc(SIZE);
+	int ret = 0;
 
-	for (int i = 0; i < SIZE; i += 2)
-		*p++ = get_0xa0(i);
+	char cache_name[1024], card[80];
+	eeprom_cache_name(cache_dir, serial, path, cache_name, sizeof(cache_name));
+	snprintf(card, sizeof(card), "%04x:%04x %s", VENDOR, PRODUCT, serial);
 
-	FILE *f = fopen("dump.bin", "wb");
-	fwrite(buf, 1, SIZE, f);
-	fclose(f);
+	if (fetch_eeprom(buf, cache_name, card, refresh) < 0) {
+		ret = 3;
+	}
+	else {
+		Eeprom_Info info;
+		if (decode_eeprom(buf, SIZE, &info) == 0)
+			print_eeprom_info(&info);
+		else
+			printf("No hardware config dataset found\n");
+
+		FILE *f = fopen(out_name, "wb");
+		if (f) {
+			fwrite(buf, 1, SIZE, f);
+			fclose(f);
+		}
+		else {
+			printf("Could not open %s\n", out_name);
+			ret = 4;
+		}
+	}
 
 	free(buf);
-	return 0;
+	io->close(dev);
+	libusb_exit(NULL);
+	return ret;
 }
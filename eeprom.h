@@ -0,0 +1,204 @@
+// Decoding of the board configuration that em28xx cards keep in their I2C EEPROM, and a local cache of EEPROM images
+//  (one file per card, named after its serial number and bus path), so that tools can get at it without any I2C traffic.
+// The layout is the one the Linux driver reads (drivers/media/usb/em28xx/em28xx-i2c.c):
+//  - 8-bit addressed EEPROMs (em2820 and the like) start with the hardware config dataset
+//  - 16-bit addressed ones (em2874 and later) start with 26 xx 00 00, then microcode whose 47th word points to the dataset
+// Each dataset starts with 1a eb 67 95, followed by the USB ids, chip and board config and the offsets of three string descriptors.
+
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+
+#define EEPROM_CACHE_MAGIC   0x43504545 // "EEPC"
+#define EEPROM_CACHE_VERSION 2
+
+#define EEPROM_8BIT  1
+#define EEPROM_16BIT 2
+
+typedef struct {
+	int format;
+	int hwconf; // offset of the hardware config dataset
+	u16 vendor_id;
+	u16 product_id;
+	u16 chip_conf;
+	u16 board_conf;
+	u16 string_offsets[3];
+	u8 string_idx_table;
+	char strings[3][64]; // manufacturer, product, serial number
+} Eeprom_Info;
+
+// Header of a cache file, which is followed by the EEPROM image
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 size;
+	u32 crc; // of the image
+	char card[80]; // USB IDs and serial number of the card the image was read from
+} Eeprom_Cache_Header;
+
+static inline u32 eeprom_crc32(const u8 *data, int size) {
+	u32 crc = 0xffffffff;
+	for (int i = 0; i < size; i++) {
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static inline u16 eeprom_u16(const u8 *p) {
+	return p[0] | (p[1] << 8);
+}
+
+// Copies a USB string descriptor (UTF-16LE) as ASCII, replacing anything else with '?'
+static inline void eeprom_string(const u8 *data, int size, int offset, char *buf, int buf_size) {
+	buf[0] = 0;
+	if (offset <= 0 || offset + 2 > size || data[offset + 1] != 3)
+		return;
+
+	int len = (data[offset] - 2) / 2;
+	if (offset + 2 + len * 2 > size)
+		len = (size - offset - 2) / 2;
+	if (len > buf_size - 1)
+		len = buf_size - 1;
+
+	for (int i = 0; i < len; i++) {
+		const u8 *c = &data[offset + 2 + i*2];
+		buf[i] = c[1] == 0 && c[0] >= 0x20 && c[0] < 0x7f ? c[0] : '?';
+	}
+	buf[len < 0 ? 0 : len] = 0;
+}
+
+// Returns 0 if the image holds a hardware config dataset, or a negative value if it doesn't
+static inline int decode_eeprom(const u8 *data, int size, Eeprom_Info *info) {
+	static const u8 dataset_id[4] = {0x1a, 0xeb, 0x67, 0x95};
+	memset(info, 0, sizeof(Eeprom_Info));
+
+	if (size >= 4 && !memcmp(data, dataset_id, 4)) {
+		info->format = EEPROM_8BIT;
+		info->hwconf = 0;
+	}
+	else if (size >= 4 && data[0] == 0x26 && data[3] == 0x00) {
+		int mc_start = (data[1] << 8) + 4;
+		if (mc_start + 48 > size)
+			return -1;
+
+		info->format = EEPROM_16BIT;
+		info->hwconf = mc_start + eeprom_u16(&data[mc_start + 46]);
+	}
+	else {
+		return -2;
+	}
+
+	const u8 *h = &data[info->hwconf];
+	if (info->hwconf + 19 > size || memcmp(h, dataset_id, 4))
+		return -3;
+
+	info->vendor_id = eeprom_u16(&h[4]);
+	info->product_id = eeprom_u16(&h[6]);
+	info->chip_conf = eeprom_u16(&h[8]);
+	info->board_conf = eeprom_u16(&h[10]);
+	info->string_idx_table = h[18];
+
+	// string offsets are relative to the start of the dataset
+	for (int i = 0; i < 3; i++) {
+		info->string_offsets[i] = eeprom_u16(&h[12 + i*2]);
+		int offset = info->string_offsets[i] ? info->hwconf + info->string_offsets[i] : 0;
+		eeprom_string(data, size, offset, info->strings[i], sizeof(info->strings[i]));
+	}
+
+	return 0;
+}
+
+static inline void print_eeprom_info(Eeprom_Info *info) {
+	static const char *audio[4] = {"no audio", "AC97 audio", "I2S audio", "I2S audio (3 sample rates)"};
+	static const int max_power[4] = {500, 400, 300, 200};
+
+	printf(
+		"%s-bit addressed EEPROM, hardware config at %#x\n"
+		"  USB id:       %04x:%04x\n"
+		"  Manufacturer: %s\n"
+		"  Product:      %s\n"
+		"  Serial:       %s\n"
+		"  Chip config:  0x%04x (%s, %d mA max%s%s)\n"
+		"  Board config: 0x%04x\n"
+		"  String table: 0x%02x, strings at 0x%04x, 0x%04x, 0x%04x\n",
+		info->format == EEPROM_16BIT ? "16" : "8", info->hwconf,
+		info->vendor_id, info->product_id,
+		info->strings[0], info->strings[1], info->strings[2],
+		info->chip_conf, audio[(info->chip_conf >> 4) & 3], max_power[info->chip_conf & 3],
+		info->chip_conf & 8 ? ", remote wakeup" : "", info->chip_conf & 4 ? ", self powered" : "",
+		info->board_conf,
+		info->string_idx_table, info->string_offsets[0], info->string_offsets[1], info->string_offsets[2]
+	);
+}
+
+// Writes the name of a card's cache file. <dir> defaults to $XDG_CACHE_HOME/em28286 (or ~/.cache/em28286), which is created if needed.
+static inline void eeprom_cache_name(const char *dir, const char *serial, const char *path, char *buf, int size) {
+	char def[512];
+	if (!dir) {
+		const char *xdg = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+		if (xdg && xdg[0])
+			snprintf(def, sizeof(def), "%s", xdg);
+		else
+			snprintf(def, sizeof(def), "%s/.cache", home ? home : ".");
+
+		mkdir(def, 0755);
+		snprintf(def + strlen(def), sizeof(def) - strlen(def), "/em28286");
+		dir = def;
+	}
+	mkdir(dir, 0755);
+
+	int len = snprintf(buf, size, "%s/%s_%s.eeprom", dir, serial[0] ? serial : "noserial", path);
+
+	// the path's dashes and dots are fine in a file name, but a serial number could hold anything
+	for (int i = strlen(dir) + 1; i < len && i < size; i++) {
+		if (buf[i] == '/' || buf[i] == ' ')
+			buf[i] = '_';
+	}
+}
+
+// Returns 0 if the cache file holds an intact image of <size> bytes that was read from <card>
+static inline int load_eeprom_cache(const char *name, const char *card, u8 *data, int size) {
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return -1;
+
+	Eeprom_Cache_Header hdr;
+	int ok = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+		hdr.magic == EEPROM_CACHE_MAGIC && hdr.version == EEPROM_CACHE_VERSION && hdr.size == (u32)size &&
+		!strncmp(hdr.card, card, sizeof(hdr.card)) && fread(data, 1, size, f) == (size_t)size;
+
+	fclose(f);
+
+	if (!ok)
+		return -2;
+	if (eeprom_crc32(data, size) != hdr.crc)
+		return -3;
+
+	return 0;
+}
+
+static inline int save_eeprom_cache(const char *name, const char *card, const u8 *data, int size) {
+	FILE *f = fopen(name, "wb");
+	if (!f)
+		return -1;
+
+	Eeprom_Cache_Header hdr = {EEPROM_CACHE_MAGIC, EEPROM_CACHE_VERSION, size, eeprom_crc32(data, size)};
+	strncpy(hdr.card, card, sizeof(hdr.card) - 1);
+	int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(data, 1, size, f) == (size_t)size;
+	fclose(f);
+
+	return ok ? 0 : -2;
+}
+
+#endif
@@ -0,0 +1,616 @@
+// In-process emulation of an em28xx-based capture card, for running the tools without hardware.
+// Models:
+//  - the 256-byte register file, read and written with vendor request 0
+//  - the I2C engine behind vendor requests 2 (read / write with stop) and 3 (write without stop),
+//     with its status in register 5, a 4 KB EEPROM (16-bit addressing) at 0xa0
+//     and a simple 8-bit addressed register device (standing in for the video decoder) at 0xb8
+//  - an isochronous video source on endpoint 0x82, producing 720x576 YUYV colour bars
+//     (with a moving box, so that there is motion between fields) at a set packet rate
+// The handle returned by emu_open() is only ever passed back to the emu_transport functions.
+
+#ifndef EM28XX_EMU_H
+#define EM28XX_EMU_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "transport.h"
+
+#define EMU_CHIP_ID       0x5a // placeholder; the id reported by a real em28286 is not known here
+#define EMU_VENDOR        0x1b80
+#define EMU_PRODUCT       0xe600
+
+#define EMU_EEPROM_SIZE   0x1000
+#define EMU_EEPROM_ADDR   0xa0
+#define EMU_DECODER_ADDR  0xb8
+#define EMU_I2C_MAX_READ  64
+
+#define EMU_REG_I2C_CLK    0x06
+#define EMU_REG_I2C_STATUS 0x05
+#define EMU_REG_CHIP_ID    0x0a
+
+#define EMU_I2C_NO_ACK    0x10
+
+#define EMU_VIDEO_EP      0x82
+#define EMU_WIDTH         720
+#define EMU_HEIGHT        576
+#define EMU_LINE_SIZE     (EMU_WIDTH * 2)
+#define EMU_FIELD_SIZE    (EMU_LINE_SIZE * EMU_HEIGHT / 2)
+#define EMU_BOX_SIZE      64
+
+#define EMU_PKT_RATE      8000 // one packet per high-speed microframe
+#define EMU_N_ALTS        7
+
+// wMaxPacketSize of the video endpoint for each alt setting of interface 0.
+// A plausible layout for a high-bandwidth isoc device, not one read from a real card.
+static const u16 emu_alt_max_packet[EMU_N_ALTS] = {
+	0x0000, 0x0200, 0x0400, 0x0a00, 0x0b00, 0x1300, 0x1400
+};
+
+typedef struct {
+	struct libusb_transfer *xfer;
+	unsigned long long due;
+	int cancelled;
+} Emu_Pending;
+
+typedef struct {
+	u8 regs[256];
+
+	u8 eeprom[EMU_EEPROM_SIZE];
+	int eeprom_ptr;
+
+	u8 decoder[256];
+	int decoder_ptr;
+
+	int claimed;
+	int alt;
+
+	// video source
+	int pkt_rate;       // packets per second, or 0 for as fast as they are asked for
+	int error_interval; // every nth packet fails, or 0 for never
+	unsigned long long isoc_due;
+	unsigned long long n_pkts;
+	int field;          // 0 = top, 1 = bottom
+	int field_pos;      // bytes of the current field sent so far
+	int frame;
+	int line_field;     // the field (frame * 2 + field) that line_box was drawn for
+	u8 line_bars[EMU_LINE_SIZE];
+	u8 line_box[EMU_LINE_SIZE];
+
+	// asynchronous transfers waiting to complete, in submission order
+	Emu_Pending *queue;
+	int n_queued;
+	int queue_cap;
+	Emu_Pending *ready;
+	int ready_cap;
+} Emu_Device;
+
+static unsigned long long emu_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int emu_alt_packet_bytes(int alt) {
+	if (alt < 0 || alt >= EMU_N_ALTS)
+		return 0;
+
+	int mps = emu_alt_max_packet[alt];
+	return (mps & 0x7ff) * (1 + ((mps >> 11) & 3));
+}
+
+static void emu_put_string(u8 *dst, const char *str) {
+	int len = strlen(str);
+	dst[0] = 2 + len * 2;
+	dst[1] = 3; // string descriptor
+
+	for (int i = 0; i < len; i++) {
+		dst[2 + i*2] = str[i];
+		dst[3 + i*2] = 0;
+	}
+}
+
+static void emu_build_eeprom(Emu_Device *emu) {
+	u8 *e = emu->eeprom;
+	memset(e, 0xff, EMU_EEPROM_SIZE);
+
+	// 16-bit addressed format (em2874 and later): id, then the microcode area, which points to the hardware config
+	const int mc_start = 4;
+	const int hwconf = 0x100;
+
+	e[0] = 0x26;
+	e[1] = (mc_start - 4) >> 8;
+	e[2] = 0x00; // boot configuration
+	e[3] = 0x00;
+	e[mc_start + 46] = (hwconf - mc_start) & 0xff;
+	e[mc_start + 47] = (hwconf - mc_start) >> 8;
+
+	// Hardware config dataset. String offsets are relative to the start of the dataset.
+	u8 *h = &e[hwconf];
+	h[0] = 0x1a; h[1] = 0xeb; h[2] = 0x67; h[3] = 0x95;
+	h[4] = EMU_VENDOR & 0xff;  h[5] = EMU_VENDOR >> 8;
+	h[6] = EMU_PRODUCT & 0xff; h[7] = EMU_PRODUCT >> 8;
+	h[8] = 0x20; h[9] = 0x00;  // chip_conf: I2S audio, 500 mA
+	h[10] = 0x00; h[11] = 0x00; // board_conf
+	h[12] = 0x20; h[13] = 0x00; // string1 (manufacturer)
+	h[14] = 0x40; h[15] = 0x00; // string2 (product)
+	h[16] = 0x80; h[17] = 0x00; // string3 (serial)
+	h[18] = 0x00;               // string_idx_table
+
+	emu_put_string(&h[0x20], "Empia");
+	emu_put_string(&h[0x40], "EM28286 Emulated Capture");
+	emu_put_string(&h[0x80], "EMU00001");
+}
+
+static void emu_build_lines(Emu_Device *emu) {
+	// 75% colour bars: white, yellow, cyan, green, magenta, red, blue, black (Y, U, V)
+	static const u8 bars[8][3] = {
+		{180, 128, 128}, {162,  44, 142}, {131, 156,  44}, {112,  72,  58},
+		{ 84, 184, 198}, { 65, 100, 212}, { 35, 212, 114}, { 16, 128, 128}
+	};
+
+	for (int x = 0; x < EMU_WIDTH; x += 2) {
+		const u8 *c = bars[x * 8 / EMU_WIDTH];
+		u8 *p = &emu->line_bars[x * 2];
+		p[0] = c[0];
+		p[1] = c[1];
+		p[2] = c[0];
+		p[3] = c[2];
+	}
+
+	memcpy(emu->line_box, emu->line_bars, EMU_LINE_SIZE);
+
+	// the box moves between the two fields of a frame as well as between frames
+	int phase = emu->frame * 2 + emu->field;
+	int box_x = (phase * 8) % (EMU_WIDTH - EMU_BOX_SIZE) & ~1;
+	for (int x = box_x; x < box_x + EMU_BOX_SIZE; x += 2) {
+		u8 *p = &emu->line_box[x * 2];
+		p[0] = 235;
+		p[1] = 128;
+		p[2] = 235;
+		p[3] = 128;
+	}
+
+	emu->line_field = phase;
+}
+
+// Produces the next packet of the video stream. A field always begins at the start of a packet,
+//  with the same 4-byte header (22 5a <field> 00) that the em28xx uses.
+static int emu_fill_packet(Emu_Device *emu, u8 *dst, int len) {
+	int n = 0;
+
+	if (emu->field_pos == 0) {
+		if (len < 4)
+			return 0;
+
+		dst[0] = 0x22;
+		dst[1] = 0x5a;
+		dst[2] = emu->field;
+		dst[3] = 0x00;
+		n = 4;
+	}
+
+	if (emu->line_field != emu->frame * 2 + emu->field)
+		emu_build_lines(emu);
+
+	const int box_top = (EMU_HEIGHT - EMU_BOX_SIZE) / 2;
+
+	while (n < len) {
+		int y = 2 * (emu->field_pos / EMU_LINE_SIZE) + emu->field;
+		int x = emu->field_pos % EMU_LINE_SIZE;
+		int chunk = EMU_LINE_SIZE - x;
+		if (chunk > len - n)
+			chunk = len - n;
+
+		u8 *line = y >= box_top && y < box_top + EMU_BOX_SIZE ? emu->line_box : emu->line_bars;
+		memcpy(dst + n, line + x, chunk);
+
+		n += chunk;
+		emu->field_pos += chunk;
+
+		if (emu->field_pos >= EMU_FIELD_SIZE) {
+			emu->field_pos = 0;
+			if (emu->field)
+				emu->frame++;
+
+			emu->field ^= 1;
+			break;
+		}
+	}
+
+	return n;
+}
+
+static u8 emu_read_reg(Emu_Device *emu, int reg) {
+	return emu->regs[reg & 0xff];
+}
+
+static void emu_write_reg(Emu_Device *emu, int reg, u8 value) {
+	reg &= 0xff;
+	if (reg == EMU_REG_CHIP_ID || reg == EMU_REG_I2C_STATUS)
+		return;
+
+	emu->regs[reg] = value;
+}
+
+static int emu_i2c_read(Emu_Device *emu, int addr, u8 *data, int len) {
+	if (len > EMU_I2C_MAX_READ)
+		return LIBUSB_ERROR_PIPE;
+
+	emu->regs[EMU_REG_I2C_STATUS] = 0;
+
+	for (int i = 0; i < len; i++) {
+		if ((addr & 0xfe) == EMU_EEPROM_ADDR) {
+			data[i] = emu->eeprom[emu->eeprom_ptr];
+			emu->eeprom_ptr = (emu->eeprom_ptr + 1) % EMU_EEPROM_SIZE;
+		}
+		else if ((addr & 0xfe) == EMU_DECODER_ADDR) {
+			data[i] = emu->decoder[emu->decoder_ptr];
+			emu->decoder_ptr = (emu->decoder_ptr + 1) & 0xff;
+		}
+		else {
+			data[i] = 0xff;
+			emu->regs[EMU_REG_I2C_STATUS] = EMU_I2C_NO_ACK;
+		}
+	}
+
+	if (len == 0 && (addr & 0xfe) != EMU_EEPROM_ADDR && (addr & 0xfe) != EMU_DECODER_ADDR)
+		emu->regs[EMU_REG_I2C_STATUS] = EMU_I2C_NO_ACK;
+
+	return len;
+}
+
+static int emu_i2c_write(Emu_Device *emu, int addr, u8 *data, int len) {
+	emu->regs[EMU_REG_I2C_STATUS] = 0;
+
+	if ((addr & 0xfe) == EMU_EEPROM_ADDR) {
+		// only the address pointer can be set, the EEPROM itself is treated as write-protected
+		if (len >= 2)
+			emu->eeprom_ptr = ((data[0] << 8) | data[1]) % EMU_EEPROM_SIZE;
+	}
+	else if ((addr & 0xfe) == EMU_DECODER_ADDR) {
+		if (len >= 1)
+			emu->decoder_ptr = data[0];
+
+		for (int i = 1; i < len; i++) {
+			emu->decoder[emu->decoder_ptr] = data[i];
+			emu->decoder_ptr = (emu->decoder_ptr + 1) & 0xff;
+		}
+	}
+	else
+		emu->regs[EMU_REG_I2C_STATUS] = EMU_I2C_NO_ACK;
+
+	return len;
+}
+
+static int emu_set_alt_setting(struct libusb_device_handle *dev, int iface, int alt) {
+	Emu_Device *emu = (Emu_Device*)dev;
+	if (iface != 0 || !emu->claimed || alt < 0 || alt >= EMU_N_ALTS)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	emu->alt = alt;
+	return 0;
+}
+
+static int emu_control(struct libusb_device_handle *dev, u8 req_type, u8 req, u16 value, u16 index, u8 *data, u16 len, u32 timeout) {
+	Emu_Device *emu = (Emu_Device*)dev;
+	int in = req_type & 0x80;
+
+	// standard requests: only SET_INTERFACE is understood
+	if ((req_type & 0x60) == 0) {
+		if (req_type == 0x01 && req == 0x0b)
+			return emu_set_alt_setting(dev, index, value) == 0 ? 0 : LIBUSB_ERROR_PIPE;
+
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if ((req_type & 0x60) != 0x40)
+		return LIBUSB_ERROR_PIPE;
+
+	switch (req) {
+		case 0:
+			for (int i = 0; i < len; i++) {
+				if (in)
+					data[i] = emu_read_reg(emu, index + i);
+				else
+					emu_write_reg(emu, index + i, data[i]);
+			}
+			return len;
+		case 2:
+			return in ? emu_i2c_read(emu, index, data, len) : emu_i2c_write(emu, index, data, len);
+		case 3:
+			return in ? LIBUSB_ERROR_PIPE : emu_i2c_write(emu, index, data, len);
+	}
+
+	return LIBUSB_ERROR_PIPE;
+}
+
+static int emu_bulk(struct libusb_device_handle *dev, u8 endpoint, u8 *data, int len, int *actual, u32 timeout) {
+	Emu_Device *emu = (Emu_Device*)dev;
+
+	if (endpoint & 0x80) {
+		int n = 0;
+		while (n < len)
+			n += emu_fill_packet(emu, data + n, len - n);
+	}
+
+	if (actual)
+		*actual = len;
+
+	return 0;
+}
+
+static int emu_interrupt(struct libusb_device_handle *dev, u8 endpoint, u8 *data, int len, int *actual, u32 timeout) {
+	if (actual)
+		*actual = 0;
+
+	// there is never anything to report (eg. IR), so reads give up straight away
+	if (endpoint & 0x80)
+		return LIBUSB_ERROR_TIMEOUT;
+
+	if (actual)
+		*actual = len;
+
+	return 0;
+}
+
+static int emu_submit(struct libusb_transfer *xfer) {
+	Emu_Device *emu = (Emu_Device*)xfer->dev_handle;
+	unsigned long long due = emu_time_ns();
+
+	if (xfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		if (xfer->endpoint != EMU_VIDEO_EP || emu_alt_packet_bytes(emu->alt) == 0)
+			return LIBUSB_ERROR_IO;
+
+		// the endpoint delivers one packet at a time, so transfers queue up behind each other
+		if (emu->isoc_due > due)
+			due = emu->isoc_due;
+		if (emu->pkt_rate > 0)
+			due += (unsigned long long)xfer->num_iso_packets * 1000000000ULL / emu->pkt_rate;
+
+		emu->isoc_due = due;
+	}
+
+	if (emu->n_queued >= emu->queue_cap) {
+		emu->queue_cap = emu->queue_cap ? emu->queue_cap * 2 : 64;
+		emu->queue = realloc(emu->queue, emu->queue_cap * sizeof(Emu_Pending));
+	}
+
+	Emu_Pending *p = &emu->queue[emu->n_queued++];
+	p->xfer = xfer;
+	p->due = due;
+	p->cancelled = 0;
+	return 0;
+}
+
+static int emu_cancel(struct libusb_transfer *xfer) {
+	Emu_Device *emu = (Emu_Device*)xfer->dev_handle;
+
+	for (int i = 0; i < emu->n_queued; i++) {
+		if (emu->queue[i].xfer == xfer) {
+			emu->queue[i].cancelled = 1;
+			emu->queue[i].due = 0;
+			return 0;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void emu_complete(Emu_Device *emu, Emu_Pending *p) {
+	struct libusb_transfer *xfer = p->xfer;
+	xfer->status = LIBUSB_TRANSFER_COMPLETED;
+	xfer->actual_length = 0;
+
+	if (p->cancelled) {
+		xfer->status = LIBUSB_TRANSFER_CANCELLED;
+		return;
+	}
+
+	int res = 0;
+	switch (xfer->type) {
+		case LIBUSB_TRANSFER_TYPE_CONTROL:
+		{
+			struct libusb_control_setup *setup = (struct libusb_control_setup*)xfer->buffer;
+			res = emu_control(
+				xfer->dev_handle, setup->bmRequestType, setup->bRequest, setup->wValue, setup->wIndex,
+				xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, setup->wLength, xfer->timeout
+			);
+			if (res >= 0)
+				xfer->actual_length = res;
+			break;
+		}
+		case LIBUSB_TRANSFER_TYPE_BULK:
+			res = emu_bulk(xfer->dev_handle, xfer->endpoint, xfer->buffer, xfer->length, &xfer->actual_length, xfer->timeout);
+			break;
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+			res = emu_interrupt(xfer->dev_handle, xfer->endpoint, xfer->buffer, xfer->length, &xfer->actual_length, xfer->timeout);
+			break;
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		{
+			int max = emu_alt_packet_bytes(emu->alt);
+			u8 *buf = xfer->buffer;
+
+			for (int i = 0; i < xfer->num_iso_packets; i++) {
+				struct libusb_iso_packet_descriptor *pk = &xfer->iso_packet_desc[i];
+				pk->status = LIBUSB_TRANSFER_COMPLETED;
+				pk->actual_length = 0;
+
+				emu->n_pkts++;
+				if (emu->error_interval > 0 && emu->n_pkts % emu->error_interval == 0)
+					pk->status = LIBUSB_TRANSFER_ERROR;
+				else
+					pk->actual_length = emu_fill_packet(emu, buf, pk->length < max ? pk->length : max);
+
+				buf += pk->length;
+			}
+			break;
+		}
+	}
+
+	if (res == LIBUSB_ERROR_PIPE)
+		xfer->status = LIBUSB_TRANSFER_STALL;
+	else if (res == LIBUSB_ERROR_TIMEOUT)
+		xfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+	else if (res < 0)
+		xfer->status = LIBUSB_TRANSFER_ERROR;
+}
+
+// Completes every transfer that is due, first waiting for the earliest one if none are,
+//  but for no longer than tv (if given)
+static int emu_handle_events_timeout(struct libusb_device_handle *dev, struct timeval *tv) {
+	Emu_Device *emu = (Emu_Device*)dev;
+	unsigned long long now = emu_time_ns();
+	unsigned long long limit = tv ? now + tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL : ~0ULL;
+
+	if (emu->n_queued == 0) {
+		if (tv) {
+			struct timespec ts = {tv->tv_sec, tv->tv_usec * 1000};
+			nanosleep(&ts, NULL);
+		}
+		return 0;
+	}
+
+	unsigned long long first = emu->queue[0].due;
+	for (int i = 1; i < emu->n_queued; i++) {
+		if (emu->queue[i].due < first)
+			first = emu->queue[i].due;
+	}
+	if (first > limit)
+		first = limit;
+
+	if (first > now) {
+		struct timespec ts = {(first - now) / 1000000000ULL, (first - now) % 1000000000ULL};
+		nanosleep(&ts, NULL);
+		now = emu_time_ns();
+	}
+
+	if (emu->ready_cap < emu->n_queued) {
+		emu->ready_cap = emu->queue_cap;
+		emu->ready = realloc(emu->ready, emu->ready_cap * sizeof(Emu_Pending));
+	}
+
+	// Callbacks may submit more transfers, so take the due ones off the queue before running any of them
+	int n_ready = 0, n_left = 0;
+	for (int i = 0; i < emu->n_queued; i++) {
+		if (emu->queue[i].due <= now)
+			emu->ready[n_ready++] = emu->queue[i];
+		else
+			emu->queue[n_left++] = emu->queue[i];
+	}
+	emu->n_queued = n_left;
+
+	for (int i = 0; i < n_ready; i++) {
+		emu_complete(emu, &emu->ready[i]);
+		emu->ready[i].xfer->callback(emu->ready[i].xfer);
+	}
+
+	return 0;
+}
+
+static int emu_handle_events(struct libusb_device_handle *dev) {
+	return emu_handle_events_timeout(dev, NULL);
+}
+
+static int emu_claim_interface(struct libusb_device_handle *dev, int iface) {
+	if (iface != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	((Emu_Device*)dev)->claimed = 1;
+	return 0;
+}
+
+static int emu_release_interface(struct libusb_device_handle *dev, int iface) {
+	Emu_Device *emu = (Emu_Device*)dev;
+	if (iface != 0 || !emu->claimed)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	emu->claimed = 0;
+	emu->alt = 0;
+	return 0;
+}
+
+// One configuration with one interface, whose alt settings each have the video endpoint at a different wMaxPacketSize.
+// Everything is in a single allocation.
+static int emu_get_config_descriptor(struct libusb_device_handle *dev, struct libusb_config_descriptor **config) {
+	struct {
+		struct libusb_config_descriptor config;
+		struct libusb_interface iface;
+		struct libusb_interface_descriptor alts[EMU_N_ALTS];
+		struct libusb_endpoint_descriptor eps[EMU_N_ALTS];
+	} *desc = calloc(1, sizeof(*desc));
+
+	if (!desc)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (int i = 0; i < EMU_N_ALTS; i++) {
+		desc->eps[i].bLength = LIBUSB_DT_ENDPOINT_SIZE;
+		desc->eps[i].bDescriptorType = LIBUSB_DT_ENDPOINT;
+		desc->eps[i].bEndpointAddress = EMU_VIDEO_EP;
+		desc->eps[i].bmAttributes = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+		desc->eps[i].wMaxPacketSize = emu_alt_max_packet[i];
+		desc->eps[i].bInterval = 1;
+
+		desc->alts[i].bLength = LIBUSB_DT_INTERFACE_SIZE;
+		desc->alts[i].bDescriptorType = LIBUSB_DT_INTERFACE;
+		desc->alts[i].bAlternateSetting = i;
+		desc->alts[i].bNumEndpoints = 1;
+		desc->alts[i].bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC;
+		desc->alts[i].endpoint = &desc->eps[i];
+	}
+
+	desc->iface.altsetting = desc->alts;
+	desc->iface.num_altsetting = EMU_N_ALTS;
+
+	desc->config.bLength = LIBUSB_DT_CONFIG_SIZE;
+	desc->config.bDescriptorType = LIBUSB_DT_CONFIG;
+	desc->config.bNumInterfaces = 1;
+	desc->config.bConfigurationValue = 1;
+	desc->config.interface = &desc->iface;
+
+	*config = &desc->config;
+	return 0;
+}
+
+static void emu_free_config_descriptor(struct libusb_config_descriptor *config) {
+	free(config);
+}
+
+static void emu_close(struct libusb_device_handle *dev) {
+	Emu_Device *emu = (Emu_Device*)dev;
+	free(emu->queue);
+	free(emu->ready);
+	free(emu);
+}
+
+// pkt_rate is the number of isochronous packets produced per second, or 0 for no limit
+static struct libusb_device_handle *emu_open(int pkt_rate) {
+	Emu_Device *emu = calloc(1, sizeof(Emu_Device));
+	emu->pkt_rate = pkt_rate;
+	emu->line_field = -1;
+
+	emu->regs[EMU_REG_CHIP_ID] = EMU_CHIP_ID;
+	emu->regs[EMU_REG_I2C_CLK] = 0x40;
+	emu_build_eeprom(emu);
+
+	return (struct libusb_device_handle*)emu;
+}
+
+static const Transport emu_transport = {
+	"emulated em28xx",
+	emu_control,
+	emu_bulk,
+	emu_interrupt,
+	emu_submit,
+	emu_cancel,
+	emu_handle_events,
+	emu_handle_events_timeout,
+	emu_claim_interface,
+	emu_release_interface,
+	emu_set_alt_setting,
+	emu_get_config_descriptor,
+	emu_free_config_descriptor,
+	emu_close
+};
+
+#endif
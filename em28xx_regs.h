@@ -0,0 +1,226 @@
+// em28xx register names and values, shared by analyse and usbshell
+// All register info is straight from the Linux source (drivers/media/usb/em28xx/em28xx-reg.h)
+
+#ifndef EM28XX_REGS_H
+#define EM28XX_REGS_H
+
+#include <stdio.h>
+#include <strings.h>
+
+// The register can change by itself, or writing to it does something beyond storing the value,
+//  so it can never be answered from (or skipped because of) a copy of its last value
+#define REG_VOLATILE 1
+// Writes to the register are ignored
+#define REG_READ_ONLY 2
+
+struct Register {
+	int index;
+	const char *str;
+	int flags;
+};
+
+static const struct Register em28xx_regs[] = {
+	{  0, "CHIP_CFG", REG_READ_ONLY},
+	{  1, "CHIP_CFG2"},
+	{  4, "GPOUT"},
+	{  5, "I2C_STATUS", REG_VOLATILE},
+	{  6, "I2C_CLK"},
+	{  8, "AUDIO_SRC/GPIO_CTRL"},
+	{  9, "GPIO_STATE", REG_VOLATILE},
+	{ 10, "CHIP_ID", REG_READ_ONLY},
+	{ 12, "USB_SUSP", REG_VOLATILE},
+	{ 14, "AUDIO_SRC"},
+	{ 15, "X_CLK"},
+	{ 16, "V_IN_MODE"},
+	{ 17, "V_IN_CTRL"},
+	{ 18, "V_IN_ENABLE"},
+	{ 20, "GAMMA"},
+	{ 21, "R_GAIN"},
+	{ 22, "G_GAIN"},
+	{ 23, "B_GAIN"},
+	{ 24, "R_OFFSET"},
+	{ 25, "G_OFFSET"},
+	{ 26, "B_OFFSET"},
+	{ 27, "OVERFLOW", REG_VOLATILE},
+	{ 28, "HORI_START"},
+	{ 29, "VERT_START"},
+	{ 30, "C_WIDTH"},
+	{ 31, "C_HEIGHT"},
+	{ 32, "CONTRAST"}, // Y Gain
+	{ 33, "BRIGHTNESS"}, // Y Offset
+	{ 34, "SATURATION"}, // UV Gain
+	{ 35, "B_BALANCE"}, // U Offset
+	{ 36, "R_BALANCE"}, // V Offset
+	{ 37, "SHARPNESS"},
+	{ 38, "COMPRESSION"},
+	{ 39, "OUT_FORMAT"},
+	{ 40, "X_MIN"},
+	{ 41, "X_MAX"},
+	{ 42, "Y_MIN"},
+	{ 43, "Y_MAX"},
+	{ 48, "H_SCALE_LOW"},
+	{ 49, "H_SCALE_HIGH"},
+	{ 50, "V_SCALE_LOW"},
+	{ 51, "V_SCALE_HIGH"},
+	{ 52, "VBI_START_H"},
+	{ 53, "VBI_START_V"},
+	{ 54, "VBI_WIDTH"},
+	{ 55, "VBI_HEIGHT"},
+	{ 62, "EXT_MODEM_CTRL"},
+	{ 64, "AC97_LSB", REG_VOLATILE},
+	{ 65, "AC97_MSB", REG_VOLATILE},
+	{ 66, "AC97_ADDR", REG_VOLATILE},
+	{ 67, "AC97_BUSY", REG_VOLATILE},
+	{ 69, "IR", REG_VOLATILE},
+	{ 76, "GPIO_CONFIG"},
+	{ 78, "GPIO_POLARITY"},
+	{ 80, "IR_CFG/GPIO_STICKY"},
+	{ 81, "IR_81", REG_VOLATILE},
+	{ 82, "GPIO_MASK"},
+	{ 84, "GPIO_STATUS", REG_VOLATILE},
+	{ 93, "TS1_PKT_SIZE"},
+	{ 94, "TS2_PKT_SIZE"},
+	{ 95, "TS_ENABLE"},
+	{106, "SPDIF_OUT_SEL"},
+	{114, "ANTIPOP"},
+	{116, "EAPD_GPIO_ACCESS"},
+	{128, "GPIO_P0_CTRL"},
+	{129, "GPIO_P1_CTRL"},
+	{130, "GPIO_P2_CTRL"},
+	{131, "GPIO_P3_CTRL"},
+	{132, "GPIO_P0_STATE", REG_VOLATILE},
+	{133, "GPIO_P1_STATE", REG_VOLATILE},
+	{134, "GPIO_P2_STATE", REG_VOLATILE},
+	{135, "GPIO_P3_STATE", REG_VOLATILE}
+};
+static const int N_REGS = sizeof(em28xx_regs) / sizeof(struct Register);
+
+struct Reg_Value {
+	int reg;
+	int mask;
+	int value;
+	const char *str;
+};
+
+static const struct Reg_Value em28xx_reg_values[] = {
+	{ 0, 0x80, 0x80, "VENDOR_AUDIO"},
+	{ 0, 0x40, 0x40, "I2S_VOL_CAPABLE"},
+	{ 0, 0x30, 0x30, "I2S_3/5_SAMP_RATES"},
+	{ 0, 0x30, 0x20, "I2S_1/3_SAMP_RATES"},
+	{ 0, 0x30, 0x10, "AC97"},
+	{ 1, 0x10, 0x10, "TS_PRESENT"},
+	{ 1, 0x0c, 0x00, "TS_REQ_INTERVAL_1MF"},
+	{ 1, 0x0c, 0x04, "TS_REQ_INTERVAL_2MF"},
+	{ 1, 0x0c, 0x08, "TS_REQ_INTERVAL_4MF"},
+	{ 1, 0x0c, 0x0c, "TS_REQ_INTERVAL_8MF"},
+	{ 1, 0x03, 0x00, "TS_PKT_SIZE_188"},
+	{ 1, 0x03, 0x01, "TS_PKT_SIZE_376"},
+	{ 1, 0x03, 0x02, "TS_PKT_SIZE_564"},
+	{ 1, 0x03, 0x03, "TS_PKT_SIZE_752"},
+	{ 6, 0x80, 0x80, "ACK_LAST_READ"},
+	{ 6, 0x40, 0x40, "WAIT_ENABLE"},
+	{ 6, 0x08, 0x08, "EEPROM_ON_BOARD"},
+	{ 6, 0x04, 0x04, "EEPROM_KEY_VALID/BUS_SELECT"},
+	{ 6, 0x03, 0x00, "FREQ_100_KHZ"},
+	{ 6, 0x03, 0x01, "FREQ_400_KHZ"},
+	{ 6, 0x03, 0x02, "FREQ_25_KHZ"},
+	{ 6, 0x03, 0x03, "FREQ_1.5_MHZ"},
+	{12, 0x20, 0x20, "SNAPSHOT_RESET"},
+	{14, 0xff, 0x80, "LINE"},
+	{14, 0xff, 0xc0, "TUNER"},
+	{15, 0x80, 0x80, "AUDIO_UNMUTE"},
+	{15, 0x40, 0x40, "I2S_MSB_TIMING"},
+	{15, 0x20, 0x20, "IR_RC5_MODE"},
+	{15, 0x10, 0x10, "IR_NEC_CHK_PAR"},
+	{15, 0x0f, 0x00, "FREQ_30_MHZ"},
+	{15, 0x0f, 0x01, "FREQ_15_MHZ"},
+	{15, 0x0f, 0x02, "FREQ_10_MHZ"},
+	{15, 0x0f, 0x03, "FREQ_7.5_MHZ"},
+	{15, 0x0f, 0x04, "FREQ_6_MHZ"},
+	{15, 0x0f, 0x05, "FREQ_5_MHZ"},
+	{15, 0x0f, 0x06, "FREQ_4.3_MHZ"},
+	{15, 0x0f, 0x07, "FREQ_12_MHZ"},
+	{15, 0x0f, 0x08, "FREQ_20_MHZ"},
+	{15, 0x0f, 0x09, "FREQ_20_MHZ_2"},
+	{15, 0x0f, 0x0a, "FREQ_48_MHZ"},
+	{15, 0x0f, 0x0b, "FREQ_24_MHZ"},
+	{16, 0xff, 0x08, "YUV422_YUYV"},
+	{16, 0xff, 0x09, "YUV422_YVYU"},
+	{16, 0xff, 0x0a, "YUV422_UYVY"},
+	{16, 0xff, 0x0b, "YUV422_VYUY"},
+	{16, 0xff, 0x0c, "RGB8_BGGR"},
+	{16, 0xff, 0x0d, "RGB8_GRBG"},
+	{16, 0xff, 0x0e, "RGB8_GBRG"},
+	{16, 0xff, 0x0f, "RGB8_RGGB"},
+	{16, 0xff, 0x10, "YUV422_CbYCrY"},
+	{17, 0x80, 0x80, "VBI_SLICED"},
+	{17, 0x40, 0x40, "VBI_RAW"},
+	{17, 0x20, 0x20, "VOUT_MODE_IN"},
+	{17, 0x10, 0x10, "CCIR656_ENABLE"},
+	{17, 0x08, 0x08, "VBI_16BIT"},
+	{17, 0x04, 0x04, "FID_ON_HREF"},
+	{17, 0x02, 0x02, "DUAL_EDGE_STROBE"},
+	{17, 0x01, 0x01, "INTERLACED"},
+	{39, 0xff, 0x00, "RGB8_RGRG"},
+	{39, 0xff, 0x01, "RGB8_GRGR"},
+	{39, 0xff, 0x02, "RGB8_GBGB"},
+	{39, 0xff, 0x03, "RGB8_BGBG"},
+	{39, 0xff, 0x04, "RGB16_656"},
+	{39, 0xff, 0x08, "RGB8_BAYER"},
+	{39, 0xff, 0x10, "YUV211"},
+	{39, 0xff, 0x14, "YUV422_Y0UY1V"},
+	{39, 0xff, 0x15, "YUV422_Y1UY0V"},
+	{39, 0xff, 0x18, "YUV411"},
+	{80, 0xff, 0x00, "NEC"},
+	{80, 0xff, 0x01, "NEC_NO_PARITY"},
+	{80, 0xff, 0x04, "RC5"},
+	{80, 0xff, 0x08, "RC6_MODE_0"},
+	{80, 0xff, 0x0b, "RC6_MODE_6A"},
+	{95, 0x01, 0x01, "TS1_CAPTURE"},
+	{95, 0x02, 0x02, "TS1_FILTER"},
+	{95, 0x04, 0x04, "TS1_NULL_DISCARD"},
+	{95, 0x10, 0x10, "TS2_CAPTURE"},
+	{95, 0x20, 0x20, "TS2_FILTER"},
+	{95, 0x40, 0x40, "TS2_NULL_DISCARD"}
+};
+static const int N_REG_VALS = sizeof(em28xx_reg_values) / sizeof(struct Reg_Value);
+
+static inline const struct Register *get_register(int index) {
+	for (int i = 0; i < N_REGS; i++) {
+		if (em28xx_regs[i].index == index)
+			return &em28xx_regs[i];
+	}
+	return NULL;
+}
+
+// Looks a register up by name, ignoring case
+static inline const struct Register *find_register(const char *name) {
+	for (int i = 0; i < N_REGS; i++) {
+		if (!strcasecmp(em28xx_regs[i].str, name))
+			return &em28xx_regs[i];
+	}
+	return NULL;
+}
+
+// Writes a register value as the names of the values it matches, followed by any bits left over, eg. "INTERLACED | 0x10"
+static inline void format_reg_value(int reg, int n, char *buf, int size) {
+	int i = 0;
+	while (i < N_REG_VALS && em28xx_reg_values[i].reg != reg)
+		i++;
+
+	int len = 0;
+	int first = 1;
+	for (; i < N_REG_VALS && em28xx_reg_values[i].reg == reg; i++) {
+		const struct Reg_Value *value = &em28xx_reg_values[i];
+		if ((n & value->mask) == value->value) {
+			len += snprintf(buf + len, len < size ? size - len : 0, "%s%s", first ? "" : " | ", value->str);
+			n &= ~value->mask;
+			first = 0;
+		}
+	}
+
+	if (n || first)
+		snprintf(buf + len, len < size ? size - len : 0, "%s0x%02x", first ? "" : " | ", n);
+}
+
+#endif
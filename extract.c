@@ -0,0 +1,199 @@
+// Converts frames saved by usbshell's frames command into RGB, as one raw file and/or a series of PPM images
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "deinterlace.h"
+
+#define FRAME_RATE 25
+
+u64 get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf(
+			"Converts frames saved by usbshell's frames command into RGB\n"
+			"Usage: %s <frame file> [options]\n"
+			"Options:\n"
+			" -s <width>x<height>\n"
+			"   Frame size (default 720x576)\n"
+			" -f <yuyv / yvyu / uyvy / vyuy / yuv411 / rgb565>\n"
+			"   Format of the frames (default yuyv)\n"
+			" -o <file>\n"
+			"   Write every frame as packed 24-bit RGB to a file\n"
+			" -p <file prefix>\n"
+			"   Write frames as PPM images, named <prefix><frame>.ppm\n"
+			" -n <n>\n"
+			"   With -p, only write every nth frame\n"
+			" -d <weave / bob / motion>\n"
+			"   Deinterlace each frame first (default weave, ie. leave it as it is)\n"
+			" -t <threshold>\n"
+			"   With -d motion, how much a byte must change between frames to count as motion (0-255, default %d)\n"
+			" -k <scalar / sse2 / avx2>\n"
+			"   Use a particular set of kernels instead of the fastest one available\n",
+			argv[0], DEFAULT_MOTION_THRESHOLD
+		);
+		return 1;
+	}
+
+	int width = 720, height = 576, format = FMT_YUYV, every = 1, kernel = -1;
+	int deint = DEINT_WEAVE, threshold = DEFAULT_MOTION_THRESHOLD;
+	const char *out_name = NULL, *ppm_prefix = NULL;
+
+	for (int i = 2; i < argc; i++) {
+		if (argv[i][0] != '-' || i + 1 >= argc) {
+			fprintf(stderr, "Unrecognised option \"%s\"\n", argv[i]);
+			return 2;
+		}
+
+		char *arg = argv[++i];
+		switch (argv[i-1][1]) {
+			case 's':
+				if (sscanf(arg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0 || width % 4) {
+					fprintf(stderr, "Invalid frame size \"%s\"\n", arg);
+					return 2;
+				}
+				break;
+			case 'f':
+				format = get_video_format(arg);
+				if (format < 0) {
+					fprintf(stderr, "Unrecognised format \"%s\"\n", arg);
+					return 2;
+				}
+				break;
+			case 'o':
+				out_name = arg;
+				break;
+			case 'p':
+				ppm_prefix = arg;
+				break;
+			case 'n':
+				every = atoi(arg);
+				if (every <= 0)
+					every = 1;
+				break;
+			case 'd':
+				deint = get_deinterlace_mode(arg);
+				if (deint < 0) {
+					fprintf(stderr, "Unrecognised deinterlacing mode \"%s\"\n", arg);
+					return 2;
+				}
+				break;
+			case 't':
+				threshold = atoi(arg);
+				if (threshold < 0 || threshold > 255) {
+					fprintf(stderr, "The motion threshold must be between 0 and 255\n");
+					return 2;
+				}
+				break;
+			case 'k':
+				if (!strcmp(arg, "scalar"))
+					kernel = SIMD_SCALAR;
+				else if (!strcmp(arg, "sse2"))
+					kernel = SIMD_SSE2;
+				else if (!strcmp(arg, "avx2"))
+					kernel = SIMD_AVX2;
+				else {
+					fprintf(stderr, "Unrecognised kernel \"%s\"\n", arg);
+					return 2;
+				}
+				break;
+			default:
+				fprintf(stderr, "Unrecognised option \"%s\"\n", argv[i-1]);
+				return 2;
+		}
+	}
+
+	if (kernel > get_simd_level()) {
+		fprintf(stderr, "This CPU can't run the %s kernel\n", simd_names[kernel]);
+		return 2;
+	}
+	if (kernel >= 0)
+		yuv_simd = kernel;
+
+	if (format == FMT_RGB565 && deint != DEINT_WEAVE) {
+		fprintf(stderr, "RGB565 frames can only be woven\n");
+		return 2;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "Could not open \"%s\"\n", argv[1]);
+		return 3;
+	}
+
+	FILE *out = NULL;
+	if (out_name) {
+		out = fopen(out_name, "wb");
+		if (!out) {
+			fprintf(stderr, "Could not open \"%s\"\n", out_name);
+			fclose(in);
+			return 3;
+		}
+	}
+
+	int n_pixels = width * height;
+	int frame_size = video_line_size(format, width) * height;
+	u8 *frame = malloc(frame_size);
+	u8 *rgb = malloc(n_pixels * 3);
+
+	Deinterlacer d;
+	if (init_deinterlacer(&d, deint, video_line_size(format, width), height, threshold) < 0) {
+		fprintf(stderr, "Could not set up deinterlacing\n");
+		return 3;
+	}
+
+	int n_frames = 0;
+	u64 convert_ns = 0;
+
+	while (fread(frame, 1, frame_size, in) == frame_size) {
+		deinterlace(&d, frame);
+
+		u64 t = get_time_ns();
+		convert_to_rgb(format, frame, rgb, n_pixels);
+		convert_ns += get_time_ns() - t;
+
+		if (out)
+			fwrite(rgb, 3, n_pixels, out);
+
+		if (ppm_prefix && n_frames % every == 0) {
+			char name[1024];
+			snprintf(name, sizeof(name), "%s%06d.ppm", ppm_prefix, n_frames);
+			if (write_ppm(name, rgb, width, height, 1) < 0)
+				fprintf(stderr, "Could not write \"%s\"\n", name);
+		}
+
+		n_frames++;
+	}
+
+	if (n_frames > 0) {
+		double per_frame = (double)convert_ns / n_frames / 1e6;
+		printf(
+			"%d %dx%d %s frame(s) converted using %s: %.3f ms per frame (%.1f streams at %d fps per core)\n",
+			n_frames, width, height, video_formats[format].name, simd_names[get_simd_level()],
+			per_frame, 1000.0 / (per_frame * FRAME_RATE), FRAME_RATE
+		);
+		if (d.n_frames) {
+			printf(
+				"Deinterlacing (%s): avg = %.3f ms, max = %.3f ms per frame\n",
+				deint_names[deint], (double)d.total_ns / d.n_frames / 1e6, (double)d.max_ns / 1e6
+			);
+		}
+	}
+	else {
+		printf("\"%s\" holds less than one %dx%d %s frame\n", argv[1], width, height, video_formats[format].name);
+	}
+
+	free_deinterlacer(&d);
+	free(frame);
+	free(rgb);
+	if (out)
+		fclose(out);
+	fclose(in);
+	return 0;
+}
@@ -0,0 +1,320 @@
+// The em28xx I2C engine, driven through vendor control requests:
+//  - request 2 reads from, or writes to (ending with a stop), the device whose 8-bit address is in wIndex
+//  - request 3 writes without a stop, so that a read can follow with a repeated start
+//  - register 5 (I2C_STATUS) says whether the last transaction was acknowledged, and register 6 (I2C_CLK) sets the bus speed
+// A transaction is at most 64 bytes long. Every one is followed by a read of I2C_STATUS, since the control request
+//  itself succeeds whether or not anything answered.
+// i2c_batch() pipelines a whole list of transactions with asynchronous control transfers. Control requests are carried out
+//  in order, so this behaves the same as doing them one by one, except that it's limited by the bus instead of the round-trips.
+
+#ifndef I2C_H
+#define I2C_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+
+#define I2C_MAX_LEN 64
+
+#define I2C_REG_STATUS 5
+#define I2C_REG_CLK    6
+
+#define I2C_STATUS_NO_ACK 0x10
+
+// I2C_CLK values
+#define I2C_WAIT_ENABLE 0x40
+#define I2C_FREQ_100_KHZ 0
+#define I2C_FREQ_400_KHZ 1
+#define I2C_FREQ_25_KHZ  2
+#define I2C_FREQ_1_5_MHZ 3
+
+// errors, alongside libusb's
+#define I2C_ERROR_NO_ACK -100 // nothing acknowledged the address
+#define I2C_ERROR_STATUS -101 // I2C_STATUS reported some other failure
+#define I2C_ERROR_LENGTH -102 // more than I2C_MAX_LEN bytes
+
+#define I2C_OP_WRITE      1 // write, then stop
+#define I2C_OP_READ       2
+#define I2C_OP_WRITE_READ 3 // write without a stop, then read (eg. a register address, then its value)
+
+#define I2C_MAX_WINDOW 64
+#define I2C_MAX_DRAIN_ERRORS 100 // event handling failures to put up with while waiting for cancelled transfers
+
+typedef struct {
+	struct libusb_device_handle *dev;
+	const Transport *io;
+	unsigned int timeout;
+	int window; // control transfers in flight during i2c_batch()
+
+	int n_requests;
+	u8 status; // from the last I2C_STATUS read
+} I2c_Bus;
+
+typedef struct {
+	int type;
+	u8 addr; // 8-bit, ie. the 7-bit address shifted left
+	u8 *wdata;
+	int wlen;
+	u8 *rdata;
+	int rlen;
+	int res; // 0 once done, or the first error
+} I2c_Op;
+
+static inline void init_i2c_bus(I2c_Bus *bus, struct libusb_device_handle *dev, const Transport *io, unsigned int timeout) {
+	memset(bus, 0, sizeof(I2c_Bus));
+	bus->dev = dev;
+	bus->io = io;
+	bus->timeout = timeout;
+	bus->window = 16;
+}
+
+static inline int i2c_status_error(u8 status) {
+	if (status == 0)
+		return 0;
+	return status == I2C_STATUS_NO_ACK ? I2C_ERROR_NO_ACK : I2C_ERROR_STATUS;
+}
+
+static inline const char *i2c_strerror(int res) {
+	switch (res) {
+		case I2C_ERROR_NO_ACK: return "no acknowledgement";
+		case I2C_ERROR_STATUS: return "I2C error";
+		case I2C_ERROR_LENGTH: return "too long for one transaction";
+	}
+	return libusb_strerror(res);
+}
+
+static inline int i2c_control(I2c_Bus *bus, u8 req_type, u8 req, u16 index, u8 *data, u16 len) {
+	bus->n_requests++;
+	int res = bus->io->control(bus->dev, req_type, req, 0, index, data, len, bus->timeout);
+	return res < 0 ? res : (res == len ? 0 : LIBUSB_ERROR_IO);
+}
+
+static inline int i2c_set_clock(I2c_Bus *bus, u8 clk) {
+	return i2c_control(bus, 0x40, 0, I2C_REG_CLK, &clk, 1);
+}
+
+// Returns 0 if the last transaction went through
+static inline int i2c_check_status(I2c_Bus *bus) {
+	int res = i2c_control(bus, 0xc0, 0, I2C_REG_STATUS, &bus->status, 1);
+	return res < 0 ? res : i2c_status_error(bus->status);
+}
+
+static inline int i2c_write(I2c_Bus *bus, u8 addr, u8 *data, int len, int stop) {
+	if (len > I2C_MAX_LEN)
+		return I2C_ERROR_LENGTH;
+
+	int res = i2c_control(bus, 0x40, stop ? 2 : 3, addr, data, len);
+	return res < 0 ? res : i2c_check_status(bus);
+}
+
+static inline int i2c_read(I2c_Bus *bus, u8 addr, u8 *data, int len) {
+	if (len > I2C_MAX_LEN)
+		return I2C_ERROR_LENGTH;
+
+	int res = i2c_control(bus, 0xc0, 2, addr, data, len);
+	return res < 0 ? res : i2c_check_status(bus);
+}
+
+static inline int i2c_write_read(I2c_Bus *bus, u8 addr, u8 *wdata, int wlen, u8 *rdata, int rlen) {
+	int res = i2c_write(bus, addr, wdata, wlen, 0);
+	return res < 0 ? res : i2c_read(bus, addr, rdata, rlen);
+}
+
+// Returns 0 if a device answers at <addr>. Like the Linux driver, this tries to read a byte from it.
+static inline int i2c_probe(I2c_Bus *bus, u8 addr) {
+	u8 b;
+	return i2c_read(bus, addr, &b, 1);
+}
+
+/*
+ * Batches
+ * Each transaction becomes a data request followed by a status read (two of each for I2C_OP_WRITE_READ).
+ * Steps are submitted as long as there's room in the window, and each result goes to the transaction it belongs to.
+ */
+#define I2C_STEP_WRITE  1
+#define I2C_STEP_READ   2
+#define I2C_STEP_STATUS 3
+
+typedef struct {
+	int kind;
+	int stop;
+	I2c_Op *op;
+} I2c_Step;
+
+typedef struct {
+	struct libusb_transfer *usb;
+	u8 buf[LIBUSB_CONTROL_SETUP_SIZE + I2C_MAX_LEN];
+	I2c_Step *step;
+	int *in_flight;
+} I2c_Slot;
+
+static inline void i2c_batch_cb(struct libusb_transfer *usb_xfer) {
+	I2c_Slot *slot = usb_xfer->user_data;
+	I2c_Step *step = slot->step;
+	I2c_Op *op = step->op;
+
+	slot->step = NULL;
+	(*slot->in_flight)--;
+
+	int res;
+	switch (usb_xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			res = usb_xfer->actual_length == usb_xfer->length - LIBUSB_CONTROL_SETUP_SIZE ? 0 : LIBUSB_ERROR_IO;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			res = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			res = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			res = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			res = LIBUSB_ERROR_INTERRUPTED;
+			break;
+		default:
+			res = LIBUSB_ERROR_IO;
+	}
+
+	u8 *data = libusb_control_transfer_get_data(usb_xfer);
+	if (res == 0 && step->kind == I2C_STEP_STATUS)
+		res = i2c_status_error(data[0]);
+	if (res == 0 && step->kind == I2C_STEP_READ)
+		memcpy(op->rdata, data, op->rlen);
+
+	// the first failure is the one that counts: a status read after a failed request says nothing new
+	if (res < 0 && op->res == 0)
+		op->res = res;
+}
+
+static inline int i2c_submit_step(I2c_Bus *bus, I2c_Slot *slot, I2c_Step *step) {
+	I2c_Op *op = step->op;
+	if (!slot->usb)
+		slot->usb = libusb_alloc_transfer(0);
+
+	switch (step->kind) {
+		case I2C_STEP_WRITE:
+			libusb_fill_control_setup(slot->buf, 0x40, step->stop ? 2 : 3, 0, op->addr, op->wlen);
+			memcpy(slot->buf + LIBUSB_CONTROL_SETUP_SIZE, op->wdata, op->wlen);
+			break;
+		case I2C_STEP_READ:
+			libusb_fill_control_setup(slot->buf, 0xc0, 2, 0, op->addr, op->rlen);
+			break;
+		default:
+			libusb_fill_control_setup(slot->buf, 0xc0, 0, 0, I2C_REG_STATUS, 1);
+	}
+
+	libusb_fill_control_transfer(slot->usb, bus->dev, slot->buf, i2c_batch_cb, slot, bus->timeout);
+	slot->step = step;
+
+	bus->n_requests++;
+	int res = bus->io->submit(slot->usb);
+	if (res < 0) {
+		slot->step = NULL;
+		return res;
+	}
+
+	(*slot->in_flight)++;
+	return 0;
+}
+
+/*
+ * Carries out every transaction in <ops>, in order, with up to bus->window requests in flight.
+ * Each op's res says how it went. Returns a negative value if the batch itself couldn't be carried out
+ *  (eg. a transfer couldn't be submitted), in which case the ops that weren't reached are left with LIBUSB_ERROR_INTERRUPTED.
+ */
+static inline int i2c_batch(I2c_Bus *bus, I2c_Op *ops, int n_ops) {
+	I2c_Step *steps = malloc(n_ops * 4 * sizeof(I2c_Step));
+	if (!steps)
+		return LIBUSB_ERROR_NO_MEM;
+
+	int n_steps = 0;
+	for (int i = 0; i < n_ops; i++) {
+		I2c_Op *op = &ops[i];
+		op->res = 0;
+
+		int write = op->type == I2C_OP_WRITE || op->type == I2C_OP_WRITE_READ;
+		int read = op->type == I2C_OP_READ || op->type == I2C_OP_WRITE_READ;
+		if ((write && op->wlen > I2C_MAX_LEN) || (read && op->rlen > I2C_MAX_LEN)) {
+			op->res = I2C_ERROR_LENGTH;
+			continue;
+		}
+
+		if (write) {
+			steps[n_steps++] = (I2c_Step){I2C_STEP_WRITE, op->type == I2C_OP_WRITE, op};
+			steps[n_steps++] = (I2c_Step){I2C_STEP_STATUS, 0, op};
+		}
+		if (read) {
+			steps[n_steps++] = (I2c_Step){I2C_STEP_READ, 0, op};
+			steps[n_steps++] = (I2c_Step){I2C_STEP_STATUS, 0, op};
+		}
+	}
+
+	int window = bus->window < 1 ? 1 : (bus->window > I2C_MAX_WINDOW ? I2C_MAX_WINDOW : bus->window);
+	I2c_Slot *slots = calloc(window, sizeof(I2c_Slot));
+	if (!slots) {
+		free(steps);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	int in_flight = 0;
+	int res = 0;
+	int next = 0;
+
+	for (int i = 0; i < window; i++)
+		slots[i].in_flight = &in_flight;
+
+	while (next < n_steps || in_flight > 0) {
+		// requests complete in order, so the slots free up in the order they were used in
+		while (res == 0 && next < n_steps && in_flight < window) {
+			res = i2c_submit_step(bus, &slots[next % window], &steps[next]);
+			if (res == 0)
+				next++;
+		}
+
+		if (res < 0 && in_flight == 0)
+			break;
+
+		int ev = bus->io->handle_events(bus->dev);
+		if (ev < 0 && ev != LIBUSB_ERROR_INTERRUPTED) {
+			res = ev;
+			break;
+		}
+	}
+
+	// transfers still in flight can only be freed once their callbacks have run
+	if (in_flight > 0) {
+		for (int i = 0; i < window; i++) {
+			if (slots[i].step)
+				bus->io->cancel(slots[i].usb);
+		}
+
+		int n_errors = 0;
+		while (in_flight > 0 && n_errors < I2C_MAX_DRAIN_ERRORS) {
+			int ev = bus->io->handle_events(bus->dev);
+			if (ev < 0 && ev != LIBUSB_ERROR_INTERRUPTED)
+				n_errors++;
+		}
+	}
+
+	for (int i = next; i < n_steps; i++) {
+		if (steps[i].op->res == 0)
+			steps[i].op->res = LIBUSB_ERROR_INTERRUPTED;
+	}
+
+	// if some never came back, leaking them (and what they point to) is better than freeing them from under libusb
+	if (in_flight > 0)
+		return res;
+
+	for (int i = 0; i < window; i++) {
+		if (slots[i].usb)
+			libusb_free_transfer(slots[i].usb);
+	}
+
+	free(slots);
+	free(steps);
+	return res;
+}
+
+#endif
@@ -0,0 +1,143 @@
+// Probes every 7-bit address on the em28xx's I2C bus, at each of the speeds I2C_CLK can be set to
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+#include "em28xx_emu.h"
+#include "i2c.h"
+
+#define TIMEOUT 100
+
+#define VENDOR  0x1b80
+#define PRODUCT 0xe600
+
+#define N_ADDRS 128
+
+typedef unsigned long long u64;
+
+static const struct {
+	u8 freq;
+	const char *name;
+} speeds[] = {
+	{I2C_FREQ_25_KHZ,  "25 kHz"},
+	{I2C_FREQ_100_KHZ, "100 kHz"},
+	{I2C_FREQ_400_KHZ, "400 kHz"},
+	{I2C_FREQ_1_5_MHZ, "1.5 MHz"}
+};
+
+u64 get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	int emu = 0, window = 16, sync = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-e"))
+			emu = 1;
+		else if (!strcmp(argv[i], "-s"))
+			sync = 1;
+		else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+			window = atoi(argv[++i]);
+		else {
+			printf(
+				"Probes every 7-bit I2C address at each bus speed\n"
+				"Usage: %s [-e] [-s] [-w <window>]\n"
+				" -e  Scan an emulated device\n"
+				" -s  Probe one address at a time, instead of pipelining the probes\n"
+				" -w  Control transfers in flight while pipelining (default 16, at most %d)\n",
+				argv[0], I2C_MAX_WINDOW
+			);
+			return 1;
+		}
+	}
+
+	if (libusb_init(NULL) < 0) {
+		printf("libusb_init() failed\n");
+		return 1;
+	}
+
+	struct libusb_device_handle *dev;
+	const Transport *io;
+	if (emu) {
+		io = &emu_transport;
+		dev = emu_open(0);
+	}
+	else {
+		io = &libusb_transport;
+		dev = libusb_open_device_with_vid_pid(NULL, VENDOR, PRODUCT);
+		if (!dev) {
+			printf("Could not open USB with ID %04x:%04x\n", VENDOR, PRODUCT);
+			return 2;
+		}
+	}
+
+	I2c_Bus bus;
+	init_i2c_bus(&bus, dev, io, TIMEOUT);
+	bus.window = window;
+
+	I2c_Op ops[N_ADDRS];
+	u8 bytes[N_ADDRS];
+	int ret = 0;
+
+	// the bus is put back to its own speed afterwards
+	u8 old_clk = I2C_WAIT_ENABLE;
+	io->control(dev, 0xc0, 0, 0, I2C_REG_CLK, &old_clk, 1, TIMEOUT);
+
+	for (int s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+		int res = i2c_set_clock(&bus, I2C_WAIT_ENABLE | speeds[s].freq);
+		if (res < 0) {
+			printf("Setting I2C_CLK failed: %s (%d)\n", libusb_strerror(res), res);
+			ret = 3;
+			break;
+		}
+
+		for (int a = 0; a < N_ADDRS; a++)
+			ops[a] = (I2c_Op){.type = I2C_OP_READ, .addr = a << 1, .rdata = &bytes[a], .rlen = 1};
+
+		bus.n_requests = 0;
+		u64 start = get_time_ns();
+
+		if (sync) {
+			for (int a = 0; a < N_ADDRS; a++)
+				ops[a].res = i2c_probe(&bus, ops[a].addr);
+		}
+		else {
+			res = i2c_batch(&bus, ops, N_ADDRS);
+		}
+
+		double ms = (double)(get_time_ns() - start) / 1e6;
+
+		printf("%-8s:", speeds[s].name);
+		int n_found = 0, n_errors = 0;
+		for (int a = 0; a < N_ADDRS; a++) {
+			if (ops[a].res == 0) {
+				printf(" %#04x", a);
+				n_found++;
+			}
+			else if (ops[a].res != I2C_ERROR_NO_ACK) {
+				n_errors++;
+			}
+		}
+
+		printf(
+			"%s  (%d found, %d error(s), %d requests in %.3f ms)\n",
+			n_found ? "" : " nothing", n_found, n_errors, bus.n_requests, ms
+		);
+
+		if (res < 0) {
+			printf("The scan stopped early: %s (%d)\n", i2c_strerror(res), res);
+			ret = 4;
+			break;
+		}
+	}
+
+	i2c_set_clock(&bus, old_clk);
+	io->close(dev);
+	libusb_exit(NULL);
+	return ret;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "shm_ring.h"
+
+// how long to wait between checks once every message has been read
+#define POLL_US 500
+
+u64 get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf(
+			"Reads frames or isochronous payloads that usbshell publishes into a shared-memory ring\n"
+			"Usage: %s <ring name> [seconds] [output file]\n"
+			" eg. after \"publish video frames\" in usbshell, %s video 10 frames.yuv\n",
+			argv[0], argv[0]
+		);
+		return 1;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s%s", argv[1][0] == '/' ? "" : "/", argv[1]);
+
+	Shm_Ring ring;
+	int res = shm_ring_open(&ring, name);
+	if (res < 0) {
+		printf("Could not open shared-memory ring %s (%d)\n", name, res);
+		return 2;
+	}
+
+	double secs = argc > 2 ? atof(argv[2]) : 0;
+	FILE *out = NULL;
+	if (argc > 3) {
+		out = fopen(argv[3], "wb");
+		if (!out) {
+			printf("Could not open %s\n", argv[3]);
+			shm_ring_close(&ring);
+			return 3;
+		}
+	}
+
+	Shm_Ring_Header *hdr = ring.hdr;
+	if (hdr->kind == SHM_RING_FRAMES)
+		printf("%s: %dx%d frames, %d slots\n", name, hdr->width, hdr->height, hdr->n_slots);
+	else
+		printf("%s: isochronous payloads of up to %d bytes, %d slots\n", name, hdr->slot_size, hdr->n_slots);
+
+	u8 *copy = out ? malloc(hdr->slot_size) : NULL;
+
+	u64 start = get_time_ns();
+	u64 stop = secs > 0 ? start + (u64)(secs * 1e9) : 0;
+	u64 n_msgs = 0, n_torn = 0, n_bytes = 0, latency_total = 0, latency_max = 0;
+	u32 checksum = 0;
+
+	while (!stop || get_time_ns() < stop) {
+		Shm_Ring_View view;
+		if (!shm_ring_next(&ring, &view)) {
+			usleep(POLL_US);
+			continue;
+		}
+
+		u64 latency = get_time_ns() - view.t_ns;
+
+		// the data is read straight out of the ring. Whatever is done with it has to be thrown away
+		//  if the writer got to the slot in the meantime, so anything going to a file is copied out first
+		u32 sum = 0;
+		for (u32 i = 0; i < view.length; i += 64)
+			sum += view.data[i];
+
+		if (out)
+			memcpy(copy, view.data, view.length);
+
+		if (!shm_ring_valid(&view)) {
+			n_torn++;
+			continue;
+		}
+
+		if (out)
+			fwrite(copy, 1, view.length, out);
+
+		checksum += sum;
+		n_msgs++;
+		n_bytes += view.length;
+		latency_total += latency;
+		if (latency > latency_max)
+			latency_max = latency;
+	}
+
+	double elapsed = (double)(get_time_ns() - start) / 1e9;
+	printf(
+		"%llu message(s), %llu bytes in %.3f s (%.3f MB/s), %llu overwritten before being read, %llu overwritten while being read\n"
+		"Latency from capture: avg = %.3f ms, max = %.3f ms. Checksum: %08x\n",
+		n_msgs, n_bytes, elapsed, (double)n_bytes / elapsed / 1e6, ring.lapped, n_torn,
+		n_msgs ? (double)latency_total / n_msgs / 1e6 : 0.0, (double)latency_max / 1e6, checksum
+	);
+
+	if (out) {
+		fclose(out);
+		free(copy);
+	}
+
+	shm_ring_close(&ring);
+	return 0;
+}
@@ -0,0 +1,257 @@
+// A ring of fixed-size slots in POSIX shared memory, written by one process (usbshell's publish command)
+//  and read by any number of others without locks.
+// Each slot has a sequence number which is odd while the slot is being written, and 2n+2 once it holds message n.
+// Readers look at a message in place, then check the sequence number again to make sure it wasn't overwritten
+//  in the meantime. A reader that falls behind by more than the number of slots skips ahead, and never holds up the writer.
+// Link with -lrt on older versions of glibc.
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define SHM_RING_MAGIC   0x47524d45 // "EMRG"
+#define SHM_RING_VERSION 1
+
+// what each message holds
+#define SHM_RING_FRAMES 1 // a whole YUV 4:2:2 frame, <width> by <height>
+#define SHM_RING_RAW    2 // the payload of one isochronous IN transfer
+
+// message flags
+#define SHM_RING_TRUNCATED 1
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 kind;
+	u32 n_slots;
+	u32 slot_size;   // the most data a slot can hold
+	u32 slot_stride; // distance between slots, including their headers
+	u32 width;
+	u32 height;
+	u8 pad[32];
+
+	u64 head; // the number of messages published so far (on its own cache line)
+	u8 pad2[56];
+} Shm_Ring_Header;
+
+typedef struct {
+	u64 seq;
+	u64 t_ns; // when the data was captured, in CLOCK_MONOTONIC nanoseconds
+	u32 length;
+	u32 flags;
+	u8 pad[40];
+} Shm_Ring_Slot;
+
+typedef struct {
+	int fd;
+	int owner;
+	u8 *map;
+	u64 map_size;
+	Shm_Ring_Header *hdr;
+	char name[64];
+
+	u64 next;   // writer: the next message to publish. reader: the next message to look at
+	u64 lapped; // reader: messages that were overwritten before they could be read
+} Shm_Ring;
+
+// A message as seen by a reader, valid until shm_ring_valid() says otherwise
+typedef struct {
+	u8 *data;
+	u32 length;
+	u32 flags;
+	u64 t_ns;
+	u64 msg;
+	u64 seq;
+	Shm_Ring_Slot *slot;
+} Shm_Ring_View;
+
+static inline Shm_Ring_Slot *shm_ring_slot(Shm_Ring *ring, u64 msg) {
+	return (Shm_Ring_Slot*)(ring->map + sizeof(Shm_Ring_Header) + (msg % ring->hdr->n_slots) * ring->hdr->slot_stride);
+}
+
+static inline int shm_ring_create(Shm_Ring *ring, const char *name, int kind, int n_slots, int slot_size, int width, int height) {
+	memset(ring, 0, sizeof(Shm_Ring));
+	if (n_slots < 2 || slot_size <= 0)
+		return -1;
+
+	u32 stride = (sizeof(Shm_Ring_Slot) + slot_size + 63) & ~63;
+	ring->map_size = sizeof(Shm_Ring_Header) + (u64)n_slots * stride;
+
+	ring->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ring->fd < 0)
+		return -2;
+
+	if (ftruncate(ring->fd, ring->map_size) < 0) {
+		close(ring->fd);
+		shm_unlink(name);
+		return -3;
+	}
+
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		close(ring->fd);
+		shm_unlink(name);
+		return -4;
+	}
+
+	ring->hdr = (Shm_Ring_Header*)ring->map;
+	ring->hdr->version = SHM_RING_VERSION;
+	ring->hdr->kind = kind;
+	ring->hdr->n_slots = n_slots;
+	ring->hdr->slot_size = slot_size;
+	ring->hdr->slot_stride = stride;
+	ring->hdr->width = width;
+	ring->hdr->height = height;
+	__atomic_store_n(&ring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->owner = 1;
+	return 0;
+}
+
+static inline int shm_ring_open(Shm_Ring *ring, const char *name) {
+	memset(ring, 0, sizeof(Shm_Ring));
+
+	ring->fd = shm_open(name, O_RDONLY, 0);
+	if (ring->fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(ring->fd, &st) < 0 || st.st_size < (off_t)sizeof(Shm_Ring_Header)) {
+		close(ring->fd);
+		return -2;
+	}
+
+	ring->map_size = st.st_size;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ, MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		close(ring->fd);
+		return -3;
+	}
+
+	ring->hdr = (Shm_Ring_Header*)ring->map;
+	Shm_Ring_Header *hdr = ring->hdr;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION ||
+		sizeof(Shm_Ring_Header) + (u64)hdr->n_slots * hdr->slot_stride > ring->map_size
+	) {
+		munmap(ring->map, ring->map_size);
+		close(ring->fd);
+		return -4;
+	}
+
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+
+	// start with the newest message
+	u64 head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	ring->next = head > 0 ? head - 1 : 0;
+	return 0;
+}
+
+static inline void shm_ring_close(Shm_Ring *ring) {
+	if (!ring->map)
+		return;
+
+	munmap(ring->map, ring->map_size);
+	close(ring->fd);
+	if (ring->owner)
+		shm_unlink(ring->name);
+
+	memset(ring, 0, sizeof(Shm_Ring));
+}
+
+// Writer: returns the data area of the next slot, which readers will ignore until shm_ring_commit()
+static inline u8 *shm_ring_begin(Shm_Ring *ring) {
+	Shm_Ring_Slot *slot = shm_ring_slot(ring, ring->next);
+	__atomic_store_n(&slot->seq, 2 * ring->next + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return (u8*)(slot + 1);
+}
+
+static inline void shm_ring_commit(Shm_Ring *ring, u32 length, u32 flags, u64 t_ns) {
+	Shm_Ring_Slot *slot = shm_ring_slot(ring, ring->next);
+	slot->length = length;
+	slot->flags = flags;
+	slot->t_ns = t_ns;
+	__atomic_store_n(&slot->seq, 2 * ring->next + 2, __ATOMIC_RELEASE);
+
+	ring->next++;
+	__atomic_store_n(&ring->hdr->head, ring->next, __ATOMIC_RELEASE);
+}
+
+// Writer: copies a message into the ring, truncating it if it doesn't fit in a slot
+static inline void shm_ring_publish(Shm_Ring *ring, u8 *data, u32 length, u64 t_ns) {
+	u32 flags = 0;
+	if (length > ring->hdr->slot_size) {
+		length = ring->hdr->slot_size;
+		flags |= SHM_RING_TRUNCATED;
+	}
+
+	memcpy(shm_ring_begin(ring), data, length);
+	shm_ring_commit(ring, length, flags, t_ns);
+}
+
+// Reader: returns 1 if a message was left intact while it was being read
+static inline int shm_ring_valid(Shm_Ring_View *view) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&view->slot->seq, __ATOMIC_RELAXED) == view->seq;
+}
+
+/*
+ * Reader: finds the next message that hasn't been overwritten yet.
+ * Returns 1 if there is one, or 0 if the reader has caught up with the writer.
+ * The message is read in place, so check shm_ring_valid() once done with it.
+ */
+static inline int shm_ring_next(Shm_Ring *ring, Shm_Ring_View *view) {
+	u64 n_slots = ring->hdr->n_slots;
+
+	while (1) {
+		u64 head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+		if (ring->next >= head)
+			return 0;
+
+		// the oldest slot might be being written over right now
+		if (head - ring->next >= n_slots) {
+			ring->lapped += head - n_slots + 1 - ring->next;
+			ring->next = head - n_slots + 1;
+		}
+
+		Shm_Ring_Slot *slot = shm_ring_slot(ring, ring->next);
+		u64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != 2 * ring->next + 2) {
+			ring->lapped++;
+			ring->next++;
+			continue;
+		}
+
+		view->data = (u8*)(slot + 1);
+		view->length = slot->length;
+		view->flags = slot->flags;
+		view->t_ns = slot->t_ns;
+		view->msg = ring->next;
+		view->seq = seq;
+		view->slot = slot;
+
+		// a length or timestamp read from a slot that's being rewritten can't be trusted either
+		if (view->length > ring->hdr->slot_size || !shm_ring_valid(view)) {
+			ring->lapped++;
+			ring->next++;
+			continue;
+		}
+
+		ring->next++;
+		return 1;
+	}
+}
+
+#endif
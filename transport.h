@@ -0,0 +1,109 @@
+// Pluggable USB transport, so that the tools can run against either a real device (through libusb)
+//  or an emulated one (see em28xx_emu.h).
+// Every function has the same meaning and return values as its libusb counterpart.
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <libusb-1.0/libusb.h>
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+
+typedef struct {
+	const char *name;
+
+	int (*control)(struct libusb_device_handle*, u8, u8, u16, u16, u8*, u16, u32);
+	int (*bulk)(struct libusb_device_handle*, u8, u8*, int, int*, u32);
+	int (*interrupt)(struct libusb_device_handle*, u8, u8*, int, int*, u32);
+
+	int (*submit)(struct libusb_transfer*);
+	int (*cancel)(struct libusb_transfer*);
+	int (*handle_events)(struct libusb_device_handle*);
+	int (*handle_events_timeout)(struct libusb_device_handle*, struct timeval*);
+
+	int (*claim_interface)(struct libusb_device_handle*, int);
+	int (*release_interface)(struct libusb_device_handle*, int);
+	int (*set_alt_setting)(struct libusb_device_handle*, int, int);
+
+	// the descriptor of the active configuration, freed with free_config_descriptor()
+	int (*get_config_descriptor)(struct libusb_device_handle*, struct libusb_config_descriptor**);
+	void (*free_config_descriptor)(struct libusb_config_descriptor*);
+
+	void (*close)(struct libusb_device_handle*);
+} Transport;
+
+#define MAX_TRANSPORT_CONTEXTS 16
+
+// libusb has no way of finding the context that a handle was opened in,
+//  so handles opened outside of the default context are registered here (before any events get handled)
+static struct {
+	struct libusb_device_handle *dev;
+	libusb_context *ctx;
+} transport_contexts[MAX_TRANSPORT_CONTEXTS];
+
+static int n_transport_contexts = 0;
+
+static inline void set_transport_context(struct libusb_device_handle *dev, libusb_context *ctx) {
+	if (n_transport_contexts < MAX_TRANSPORT_CONTEXTS) {
+		transport_contexts[n_transport_contexts].dev = dev;
+		transport_contexts[n_transport_contexts].ctx = ctx;
+		n_transport_contexts++;
+	}
+}
+
+// Handles are reused after being closed, so their entries have to go with them
+static inline void remove_transport_context(struct libusb_device_handle *dev) {
+	for (int i = 0; i < n_transport_contexts; i++) {
+		if (transport_contexts[i].dev == dev) {
+			transport_contexts[i] = transport_contexts[--n_transport_contexts];
+			return;
+		}
+	}
+}
+
+static inline libusb_context *get_transport_context(struct libusb_device_handle *dev) {
+	for (int i = 0; i < n_transport_contexts; i++) {
+		if (transport_contexts[i].dev == dev)
+			return transport_contexts[i].ctx;
+	}
+
+	return NULL;
+}
+
+static int libusb_handle_device_events(struct libusb_device_handle *dev) {
+	return libusb_handle_events(get_transport_context(dev));
+}
+
+static int libusb_handle_device_events_timeout(struct libusb_device_handle *dev, struct timeval *tv) {
+	return libusb_handle_events_timeout(get_transport_context(dev), tv);
+}
+
+static void libusb_close_device(struct libusb_device_handle *dev) {
+	remove_transport_context(dev);
+	libusb_close(dev);
+}
+
+static int libusb_get_handle_config_descriptor(struct libusb_device_handle *dev, struct libusb_config_descriptor **config) {
+	return libusb_get_active_config_descriptor(libusb_get_device(dev), config);
+}
+
+static const Transport libusb_transport = {
+	"libusb",
+	libusb_control_transfer,
+	libusb_bulk_transfer,
+	libusb_interrupt_transfer,
+	libusb_submit_transfer,
+	libusb_cancel_transfer,
+	libusb_handle_device_events,
+	libusb_handle_device_events_timeout,
+	libusb_claim_interface,
+	libusb_release_interface,
+	libusb_set_interface_alt_setting,
+	libusb_get_handle_config_descriptor,
+	libusb_free_config_descriptor,
+	libusb_close_device
+};
+
+#endif
@@ -0,0 +1,176 @@
+// Parsing of the USBPcap capture format (https://desowin.org/usbpcap/captureformat.html)
+// A capture is a pcap global header, followed by records which each have a 16-byte pcap header,
+//  then a USBPcap packet header (whose size depends on the transfer type), then the payload.
+
+#ifndef USBPCAP_H
+#define USBPCAP_H
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define URB_ISOC 0
+#define URB_INTR 1
+#define URB_CTRL 2
+#define URB_BULK 3
+
+#define SET_INTERFACE 0xb
+
+// offset of the first USBPcap header in a capture
+#define PCAP_FIRST_PACKET 0x28
+
+// minimum size of a capture with at least one record in it
+#define PCAP_MIN_SIZE 68
+
+#define PCAP_MAGIC       0xa1b2c3d4
+#define PCAP_SNAPLEN     0xffff
+#define LINKTYPE_USBPCAP 249
+
+// info flags
+#define USBPCAP_INFO_RESPONSE 1
+
+// control stages
+#define USBPCAP_STAGE_SETUP    0
+#define USBPCAP_STAGE_COMPLETE 3
+
+#define URB_FUNCTION_CONTROL_TRANSFER           0x08
+#define URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER 0x09
+#define URB_FUNCTION_ISOCH_TRANSFER             0x0a
+
+#define USBD_STATUS_STALL_PID          0xc0000004
+#define USBD_STATUS_DEV_NOT_RESPONDING 0xc0000005
+#define USBD_STATUS_CANCELED           0xc0010000
+
+typedef struct {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	int thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 network;
+} Pcap_Header;
+
+typedef struct {
+	u32 ts_sec;
+	u32 ts_usec;
+	u32 incl_len;
+	u32 orig_len;
+} Pcap_Record;
+
+// The part of the USBPcap header common to every transfer type. Control transfers follow it with a stage byte,
+//  isochronous transfers with Usbpcap_Isoc and then a Usbpcap_Iso_Packet for each packet
+typedef struct __attribute__((packed)) {
+	u16 hdr_sz;
+	u64 irp_id;
+	u32 status;
+	u16 func;
+	u8 info;
+	u16 bus;
+	u16 device;
+	u8 endpoint;
+	u8 type;
+	u32 data_len;
+} Usbpcap_Header;
+
+typedef struct {
+	u32 start;
+	u32 n_pkts;
+	u32 n_errors;
+} Usbpcap_Isoc;
+
+typedef struct {
+	u32 offset;
+	u32 length;
+	u32 status;
+} Usbpcap_Iso_Packet;
+
+struct Packet {
+	u16 hdr_sz;
+	u64 id;
+	int status;
+	int func;
+	int dir;
+	int bus;
+	int port;
+	int endpoint;
+	int type;
+	u32 pkt_sz;
+
+	int len;
+	u8 *data;
+
+	// the whole payload following the USBPcap header (pkt_sz bytes)
+	u8 *payload;
+
+	// capture time, in microseconds
+	u64 ts_us;
+
+// URB_ISOC specific
+	u32 start;
+	u32 packs;
+	u32 per_pack;
+	u32 errors;
+
+// URB_CTRL specific
+	int stage;
+	int req_type;
+	int req;
+	int value;
+	int index;
+};
+
+// idx is the offset of the USBPcap header, returns the distance to the next one
+static int get_next_packet(struct Packet *pkt, u8 *buf, int idx) {
+	pkt->hdr_sz   = *(u16*)&buf[idx];
+	pkt->id       = *(u64*)&buf[idx+2];
+	pkt->status   = *(int*)&buf[idx+10];
+	pkt->func     = *(short*)&buf[idx+14];
+	pkt->dir      = buf[idx+16];
+	pkt->bus      = *(short*)&buf[idx+17];
+	pkt->port     = *(short*)&buf[idx+19];
+	pkt->endpoint = buf[idx+21];
+	pkt->type     = buf[idx+22];
+	pkt->pkt_sz   = *(u32*)&buf[idx+23];
+
+	pkt->payload = &buf[idx + pkt->hdr_sz];
+	pkt->ts_us   = (u64)*(u32*)&buf[idx-16] * 1000000ULL + *(u32*)&buf[idx-12];
+
+	if (pkt->type == URB_ISOC) {
+		pkt->start  = *(u32*)&buf[idx+27];
+		pkt->packs  = *(u32*)&buf[idx+31];
+		pkt->errors = *(u32*)&buf[idx+35];
+
+		if (pkt->packs > 1)
+			pkt->per_pack = *(u32*)&buf[idx+51]; // offset of the second packet
+		else
+			pkt->per_pack = 0;
+
+		if ((pkt->endpoint & 0x80) == 0) {
+			pkt->len = pkt->pkt_sz;
+			pkt->data = &buf[idx + pkt->hdr_sz];
+		}
+	}
+	else if (pkt->type == URB_CTRL && pkt->pkt_sz >= 8) {
+		pkt->stage    = buf[idx+27];
+		pkt->req_type = buf[idx+28];
+		pkt->req      = buf[idx+29];
+		pkt->value    = *(u16*)&buf[idx+30];
+		pkt->index    = *(u16*)&buf[idx+32];
+		pkt->len      = *(u16*)&buf[idx+34];
+		pkt->data     = &buf[idx+36];
+	}
+	else if (pkt->type == URB_INTR || pkt->type == URB_BULK) {
+		pkt->len  = pkt->pkt_sz;
+		pkt->data = &buf[idx+27];
+	}
+
+	int size = pkt->hdr_sz + pkt->pkt_sz;
+	size = size < 0xffff ? size : 0xffff;
+
+	const int metadata_len = 0x10;
+	return size + metadata_len;
+}
+
+#endif
@@ -1,7 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <libusb-1.0/libusb.h>
+#include "em28xx_emu.h"
+#include "usbpcap.h"
+#include "shm_ring.h"
+#include "deinterlace.h"
+#include "em28xx_regs.h"
 
 #define TYPE_CTRL 1
 #define TYPE_INT  2
@@ -20,27 +34,100 @@
 #define VAR_INDEX 4
 #define VAR_EP    5
 #define VAR_ERRS  6
-#define N_VARS    6
+#define VAR_RES   7
+#define VAR_DATA  8
+#define N_VARS    8
 
 #define XFER_TIMEOUT 1000
 
 #define BUCKET_SIZE 0x30000
 
-#define ISOC_RING_LEN 10
+#define DEDUP_MAX_SIZE    256
+#define DEDUP_MIN_SLOTS   1024
+#define DEDUP_MAX_PAYLOADS (1 << 20) // distinct payloads kept track of
 
-#define CMD_BUF_SIZE 1024
+#define XFER_PAGE_BITS 12
+#define XFER_PAGE_SIZE (1 << XFER_PAGE_BITS)
+
+#define N_EP_KEYS 0x20
+
+#define ISOC_RING_LEN 32
+#define MAX_DRAIN_ERRORS 100 // event handling failures to put up with while waiting for cancelled transfers
+
+#define MAX_DEVICES 16
+
+#define N_FRAME_BUFS 8
+#define DEFAULT_PUBLISH_SLOTS 8
+#define DEFAULT_THUMB_INTERVAL 25
+#define DEFAULT_THUMB_STEP 4
+
+#define DEFAULT_CTRL_WINDOW 16
+#define MAX_CTRL_WINDOW     256
+
+#define MAX_REPLAY_WINDOW 64
+
+#define REG_READ_SIZE 64
+#define REG_READ_RETRIES 3 // timeouts in a row before a register read is given up on
+#define MAX_SNAPSHOTS 32
+
+#define MICROFRAMES_PER_SEC 8000
+#define MAX_ALT_CANDIDATES  64
+#define AUTOSELECT_PKTS     32
+#define AUTOSELECT_DEPTH    8
+#define DEFAULT_AUTOSELECT_COUNT 50
+
+#define MAX_WATCH_REGS 16
+#define WATCH_WINDOW   32
+#define WATCH_RING_LEN (1 << 20) // samples kept, must be a power of 2
+
+#define SESSION_MAGIC   0x53425355 // "USBS"
+#define RECORD_MAGIC    0x43455258 // "XREC"
+#define SESSION_VERSION 3
+#define SESSION_GROW    0x4000000
+
+#define PCAP_RING_SIZE 0x1000000
+#define PCAP_UNLOGGED_IRP (1ULL << 63) // irp_ids of requests that aren't in the transfer log count up from here
+
+#define CMD_BUF_SIZE 1024 // initial size; lines can be any length
 #define MAX_ARGS       32
 
+#define MAX_SCRIPT_VARS  64
+#define MAX_BLOCK_DEPTH  32
+#define SCRIPT_NAME_LEN  32
+
+#define OP_CMD    1
+#define OP_SET    2
+#define OP_REPEAT 3
+#define OP_WHILE  4
+#define OP_IF     5
+#define OP_END    6
+#define OP_BREAK  7
+#define OP_EXIT   8
+
+#define OPND_CONST 0
+#define OPND_VAR   1
+#define OPND_XFER  2
+
 #define EXIT 1
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 typedef int (*Data_Xfer)(struct libusb_device_handle*, u8, u8*, int, int*, u32);
 typedef void* (*Allocator)(int);
 
+// The result of one packet of an isochronous transfer
+typedef struct {
+	u16 length;
+	u16 status; // libusb_transfer_status
+} Iso_Packet;
+
+void isoc_cb(struct libusb_transfer *usb_xfer);
+
 static struct libusb_device_handle *dev;
+static const Transport *io = &libusb_transport;
 
 struct xfer_entry_t {
 	int id;
@@ -63,7 +150,12 @@ struct xfer_entry_t {
 	int size;
 	u8 *data;
 
-	struct xfer_entry_t *next;
+	// isochronous only: n_pkts entries. IN data holds just the bytes received, one packet after another
+	Iso_Packet *pkts;
+
+	// CLOCK_MONOTONIC, in nanoseconds
+	u64 t_submit;
+	u64 t_complete;
 };
 typedef struct xfer_entry_t Xfer_Entry;
 
@@ -73,9 +165,315 @@ typedef struct {
 	int max;
 } Filter;
 
+// A sorted list of transfer ids, used as a secondary index into the transfer log
+typedef struct {
+	int *ids;
+	int len;
+	int cap;
+} Id_List;
+
+// returns 0 to carry on, or a negative value to stop the query
+typedef int (*Xfer_Visitor)(Xfer_Entry*, void*);
+
+/*
+ * Session file layout:
+ *  Session_Header, followed by records, each of which is a Session_Record, then (for isochronous transfers)
+ *   an Iso_Packet for each packet, then the payload, then padding up to the next multiple of 8 bytes.
+ * header.end only moves forward once a record has been completely written,
+ *  so anything past it is a torn record and gets ignored when the session is loaded.
+ */
+typedef struct {
+	u32 magic;
+	u32 version;
+	u64 end;
+	u32 n_records;
+	u32 reserved;
+} Session_Header;
+
+typedef struct {
+	u32 magic;
+	u32 length;
+
+	u8 type;
+	u8 endpoint;
+	u8 req_type;
+	u8 req;
+
+	u16 value;
+	u16 index;
+
+	int pkt_sz;
+	int n_pkts;
+	int frame;
+	int n_errors;
+
+	int res;
+	int size;
+
+	u64 t_submit;
+	u64 t_complete;
+} Session_Record;
+
+typedef struct {
+	int fd;
+	u8 *map;
+	u64 map_size;
+	char *name;
+} Session;
+
+// Bytes in the ring run from tail (written to the file) to head (complete records), then up to fill (the record being added)
+typedef struct {
+	FILE *f;
+	char *name;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t data_ready;
+	pthread_cond_t space_free;
+
+	u8 *ring;
+	u64 head;
+	u64 fill;
+	u64 tail;
+	int stop;
+
+	u64 wall_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC, in nanoseconds
+	u64 n_unlogged;
+	u64 n_records;
+	u64 n_stalls;
+} Pcap_Writer;
+
+typedef struct {
+	struct libusb_transfer *usb;
+	u8 *buf;
+	int buf_size;
+	Xfer_Entry *xfer;
+	u64 shadow_seq;
+} Batch_Slot;
+
+// A window of asynchronous control transfers. Requests are submitted in order and,
+//  since they all go through endpoint 0, they also complete in order.
+typedef struct {
+	Batch_Slot slots[MAX_CTRL_WINDOW];
+	int window;
+	int next_slot;
+	int in_flight;
+	Xfer_Entry *failed;
+} Ctrl_Batch;
+
+// A request from a USBPcap capture, paired with the capture's response to it
+typedef struct {
+	int n;    // record number, counting from 1 like analyse does
+	int req;  // offset of the request's USBPcap header
+	int resp; // offset of the response's USBPcap header, or -1 if there wasn't one
+	u64 irp_id;
+} Replay_Pair;
+
+typedef struct {
+	struct libusb_transfer *usb;
+	int n_iso;
+	u8 *buf;
+	int buf_size;
+	Xfer_Entry *xfer;
+	Replay_Pair *pair;
+} Replay_Slot;
+
+// Unlike a control batch, a replay spans several endpoints, so transfers may complete out of order
+typedef struct {
+	Replay_Slot slots[MAX_REPLAY_WINDOW];
+	int window;
+	int in_flight;
+	u8 *capture;
+	int n_mismatches;
+} Replay;
+
+typedef struct {
+	u8 endpoint;
+	int n_pkts;
+	int pkt_sz;
+
+	int count;
+	int n_submitted;
+	int in_flight;
+	int error;
+
+	u8 *out_data;
+} Isoc_Stream;
+
+// The last known value of each em28xx register (see the shadow command)
+typedef struct {
+	int enabled;
+	u8 known[256];
+	u8 values[256];
+	u64 written[256]; // seq of the last write to each register
+	u64 seq;
+
+	u64 n_reads;
+	u64 n_writes;
+	u64 reads_saved;  // reads answered from the shadow
+	u64 writes_saved; // writes skipped because they wouldn't have changed anything
+} Reg_Shadow;
+
+// The whole register space as it was read at one point (see the regdump command)
+typedef struct {
+	char name[32];
+	u8 values[256];
+	time_t t_taken;
+} Reg_Snapshot;
+
+// One value of one register, as read by watch
+typedef struct {
+	u32 t_us; // since the watch started
+	u8 reg;
+	u8 value;
+} Watch_Sample;
+
+typedef struct {
+	struct libusb_transfer *usb;
+	u8 buf[LIBUSB_CONTROL_SETUP_SIZE + MAX_WATCH_REGS];
+	int run;
+	u64 t_submit;
+} Watch_Slot;
+
+typedef struct {
+	u8 run_start[MAX_WATCH_REGS]; // runs of consecutive registers, each read with one request
+	u8 run_len[MAX_WATCH_REGS];
+	int n_runs;
+
+	Watch_Slot slots[WATCH_WINDOW];
+	int next_slot;
+	int in_flight;
+
+	Watch_Sample *samples; // ring of the last WATCH_RING_LEN samples
+	u64 n_samples;
+	u8 last[256];
+	u8 known[256];
+	u64 t_start;
+
+	u64 n_rounds;
+	u64 n_missed; // timer ticks where no round could be sent, because the window was full or the tick came too late
+	u64 n_polls;
+	u64 n_errors;
+	u64 n_changes;
+	u64 latency_total;
+	u64 latency_max;
+	int last_error;
+} Watch;
+
+typedef struct {
+	struct libusb_device_handle *handle;
+	const Transport *io;
+	libusb_context *ctx;
+	char path[32]; // "<bus>-<port>.<port>...", or "emu<n>"
+	char serial[64];
+	int iface;
+	Reg_Shadow shadow;
+	int reg_read_size; // registers per read request (see read_reg_space())
+
+	// capture state, only touched by the device's capture thread while it runs
+	pthread_t thread;
+	struct libusb_transfer *ring[ISOC_RING_LEN];
+	u8 *ring_buf;
+	FILE *sink;
+
+	u8 endpoint;
+	int n_pkts;
+	int pkt_sz;
+	int depth;
+	int in_flight; // if still > 0 once the thread has finished, the ring is leaked rather than freed
+	int error;
+
+	u64 t_start;
+	u64 t_stop;
+	u64 t_end;
+
+	u64 n_xfers;
+	u64 bytes;
+	u64 n_pkt_errors;
+	u64 n_xfer_errors;
+} Device;
+
+typedef struct {
+	u8 *data;
+	u64 t_done; // when the last packet of the frame was processed
+	int seq;
+} Frame;
+
+typedef struct {
+	int width;
+	int height;
+	int format; // one of the FMT_ values in yuv.h
+	int line_size;
+	int field_size;
+	int frame_size;
+
+	// assembly state, only touched from the isoc completion path
+	Frame *cur;
+	int field;    // the field being filled in (0 = top, 1 = bottom), or -1 while waiting for a top field
+	int field_pos;
+	int damaged;  // part of the current frame is missing
+	int vbi_size; // bytes of VBI before the video of a field that starts with 33 95, or -1 if unknown
+	int vbi_left; // VBI bytes of the current field still to skip
+	u64 n_pkts;
+
+	// shared with the sink thread
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t frame_ready;
+	Frame frames[N_FRAME_BUFS];
+	Frame *free_list[N_FRAME_BUFS];
+	int n_free;
+	Frame *ready[N_FRAME_BUFS];
+	u64 ready_head;
+	u64 ready_tail;
+	int stop;
+
+	int running;
+	FILE *sink; // NULL if frames are only published or counted
+	int is_pipe;
+	u8 *rgb;    // if set, frames are converted to RGB before going to the sink
+	u64 convert_ns;
+	Deinterlacer deint;
+
+	u64 n_frames;
+	u64 n_delivered;
+	u64 n_dropped;
+	u64 n_incomplete;
+	u64 latency_total;
+	u64 latency_max;
+} Frame_Assembler;
+
+typedef struct {
+	char prefix[256];
+	int every;
+	int step;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int busy;
+	int stop;
+
+	// a copy of the frame to write, so that the frame can go back to the assembler straight away
+	int format;
+	int width;
+	int height;
+	int seq;
+	u8 *frame;
+	int frame_cap;
+	u8 *rgb;
+	int rgb_cap;
+
+	u64 n_written;
+	u64 n_skipped;
+} Thumb_Writer;
+
 struct isoc_ring_t {
 	struct libusb_transfer *usb;
 	struct isoc_ring_t *next;
+	Xfer_Entry *xfer;
+	u8 *buf; // IN transfers are read into here, then packed into the transfer log
+	int buf_size;
 };
 typedef struct isoc_ring_t Isoc_Ring;
 
@@ -113,7 +511,145 @@ void *allocate(int size) {
 	return ptr;
 }
 
+// Gives back <ptr> if it was the last thing allocated. Returns 1 if it was.
+int release_allocation(void *ptr, int size) {
+	if (!head || !ptr || ptr != (void*)(&head[1]) + head->used - size)
+		return 0;
+
+	head->used -= size;
+	return 1;
+}
+
+/*
+ * Payload store
+ * Polling and replayed scripts log the same small payloads over and over (status reads, the same register writes).
+ * Once a transfer is complete, a payload of up to DEDUP_MAX_SIZE bytes is looked up by content, and if an earlier transfer
+ *  had the same bytes, the transfer points at that copy instead. Its own copy goes back to the buckets if nothing was allocated since,
+ *  which is the case for synchronous transfers and the asynchronous control reads (whose payloads are only allocated on arrival).
+ * Payloads stay in the buckets where they were first allocated, and are never written to again, so the table only says where they are.
+ */
+typedef struct {
+	u8 *blob;
+	u32 tag; // the upper half of the hash
+	int size;
+} Payload_Slot;
+
+typedef struct {
+	int on;
+	Payload_Slot *slots;
+	int cap; // a power of 2
+	int n_unique;
+
+	u64 n_payloads; // that went through the store
+	u64 n_dups;
+	u64 bytes;
+	u64 dup_bytes;
+	u64 freed_bytes; // of the duplicates, the ones given back to the buckets
+} Payload_Store;
+
+Payload_Store payload_store = {1};
+
+// Multiply-xorshift, 8 bytes at a time
+u64 hash_payload(const u8 *data, int size) {
+	const u64 k = 0x9e3779b97f4a7c15ULL;
+	u64 h = size * k;
+	u64 w;
+
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+
+	w = 0;
+	memcpy(&w, data + i, size - i);
+	h = (h ^ w) * k;
+	return h ^ (h >> 32);
+}
+
+void grow_payload_store(Payload_Store *ps) {
+	int old_cap = ps->cap;
+	Payload_Slot *old = ps->slots;
+
+	ps->cap = old_cap ? old_cap * 2 : DEDUP_MIN_SLOTS;
+	ps->slots = calloc(ps->cap, sizeof(Payload_Slot));
+
+	for (int i = 0; i < old_cap; i++) {
+		if (!old[i].blob)
+			continue;
+
+		u32 idx = hash_payload(old[i].blob, old[i].size) & (ps->cap - 1);
+		while (ps->slots[idx].blob)
+			idx = (idx + 1) & (ps->cap - 1);
+
+		ps->slots[idx] = old[i];
+	}
+
+	free(old);
+}
+
+// Returns the first copy of these bytes (<data> itself if they're new, in which case *added is set), or NULL if they're new and the store is full
+u8 *find_payload(Payload_Store *ps, u8 *data, int size, int *added) {
+	*added = 0;
+	if (ps->n_unique * 2 >= ps->cap && ps->n_unique < DEDUP_MAX_PAYLOADS)
+		grow_payload_store(ps);
+
+	u64 hash = hash_payload(data, size);
+	u32 tag = hash >> 32;
+	u32 idx = hash & (ps->cap - 1);
+
+	for (; ps->slots[idx].blob; idx = (idx + 1) & (ps->cap - 1)) {
+		Payload_Slot *slot = &ps->slots[idx];
+		if (slot->tag == tag && slot->size == size && (slot->blob == data || !memcmp(slot->blob, data, size)))
+			return slot->blob;
+	}
+
+	if (ps->n_unique >= DEDUP_MAX_PAYLOADS)
+		return NULL;
+
+	ps->slots[idx] = (Payload_Slot){data, tag, size};
+	ps->n_unique++;
+	*added = 1;
+	return data;
+}
+
+void dedup_transfer(Xfer_Entry *xfer) {
+	Payload_Store *ps = &payload_store;
+	if (!ps->on || xfer->type == TYPE_ISOC || !xfer->data || xfer->size <= 0 || xfer->size > DEDUP_MAX_SIZE)
+		return;
+
+	int added;
+	u8 *blob = find_payload(ps, xfer->data, xfer->size, &added);
+	if (added) {
+		ps->n_payloads++;
+		ps->bytes += xfer->size;
+	}
+
+	// a transfer can come through twice (batched writes are looked up as soon as they're made), but only counts once
+	if (!blob || blob == xfer->data)
+		return;
+
+	ps->n_payloads++;
+	ps->n_dups++;
+	ps->bytes += xfer->size;
+	ps->dup_bytes += xfer->size;
+
+	if (release_allocation(xfer->data, xfer->size))
+		ps->freed_bytes += xfer->size;
+
+	xfer->data = blob;
+}
+
+void reset_payload_store(void) {
+	free(payload_store.slots);
+	payload_store = (Payload_Store){payload_store.on};
+}
+
 void destroy_buckets(void) {
+	// the payloads it knows about are in the buckets
+	reset_payload_store();
+
 	head = first_bucket;
 	if (!head)
 		return;
@@ -127,180 +663,700 @@ void destroy_buckets(void) {
 	first_bucket = head = NULL;
 }
 
-Xfer_Entry *first_xfer = NULL;
-Xfer_Entry *head_xfer = NULL;
+u64 get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+u64 time_origin = 0; // timestamps are shown relative to this (the start of the session)
+
+// The transfer log is a table of fixed-size pages, so that entries never move once created
+//  and any transfer can be found directly from its id
+Xfer_Entry **xfer_pages = NULL;
+int n_xfer_pages = 0;
+int n_xfers = 0;
 
-Xfer_Entry *new_transfer(void) {
-	int id = -1;
-	Xfer_Entry **neck = &head_xfer;
+// Secondary indices, filled in by index_transfer()
+Id_List type_index[TYPE_ISOC + 1];
+Id_List ep_index[N_EP_KEYS];
+Id_List *ctrl_index[0x100]; // two-level table keyed by the high then low byte of the control index
+
+Xfer_Entry *get_transfer(int id) {
+	if (id < 0 || id >= n_xfers)
+		return NULL;
+
+	return &xfer_pages[id >> XFER_PAGE_BITS][id & (XFER_PAGE_SIZE - 1)];
+}
 
-	if (head_xfer) {
-		id = head_xfer->id;
-		neck = &head_xfer->next;
+Xfer_Entry *new_transfer(int type) {
+	int page = n_xfers >> XFER_PAGE_BITS;
+	if (page >= n_xfer_pages) {
+		xfer_pages = realloc(xfer_pages, (n_xfer_pages + 1) * sizeof(Xfer_Entry*));
+		xfer_pages[n_xfer_pages++] = malloc(XFER_PAGE_SIZE * sizeof(Xfer_Entry));
 	}
 
-	*neck = allocate(sizeof(Xfer_Entry));
-	head_xfer = *neck;
-	memset(head_xfer, 0, sizeof(Xfer_Entry));
+	Xfer_Entry *xfer = &xfer_pages[page][n_xfers & (XFER_PAGE_SIZE - 1)];
+	memset(xfer, 0, sizeof(Xfer_Entry));
 
-	if (!first_xfer)
-		first_xfer = head_xfer;
+	xfer->id = n_xfers++;
+	xfer->type = type;
+	return xfer;
+}
+
+void add_id(Id_List *list, int id) {
+	if (list->len >= list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		list->ids = realloc(list->ids, list->cap * sizeof(int));
+	}
 
-	head_xfer->id = id + 1;
-	return head_xfer;
+	list->ids[list->len++] = id;
 }
 
-int read_file(char *name, u8 **ptr, int max_size, Allocator ator) {
-	FILE *f = fopen(name, "rb");
-	if (!f)
-		return -1;
+int get_ep_key(Xfer_Entry *xfer) {
+	return (xfer->endpoint | xfer->req_type) & 0x1f;
+}
 
-	fseek(f, 0, SEEK_END);
-	int sz = ftell(f);
-	rewind(f);
+Id_List *get_ctrl_list(int index, int create) {
+	Id_List *table = ctrl_index[(index >> 8) & 0xff];
+	if (!table) {
+		if (!create)
+			return NULL;
 
-	if (max_size > 0 && sz > max_size)
-		sz = max_size;
+		table = calloc(0x100, sizeof(Id_List));
+		ctrl_index[(index >> 8) & 0xff] = table;
+	}
 
-	if (ator)
-		*ptr = ator(sz);
+	return &table[index & 0xff];
+}
 
-	fread(*ptr, 1, sz, f);
-	fclose(f);
+// Must be called once per transfer, after its type, endpoint/req type and index have been set.
+// Since ids are handed out in order, every index list stays sorted.
+void index_transfer(Xfer_Entry *xfer) {
+	if (xfer->type > 0 && xfer->type <= TYPE_ISOC)
+		add_id(&type_index[xfer->type], xfer->id);
 
-	return sz;
+	add_id(&ep_index[get_ep_key(xfer)], xfer->id);
+
+	if (xfer->type == TYPE_CTRL)
+		add_id(get_ctrl_list(xfer->index, 1), xfer->id);
 }
 
-int parse_byte_array(int n_args, char **args, int arg_idx, u8 **ptr, int max_size, Allocator ator) {
-	char buf[1024] = {0};
-	char *p = &buf[0];
+void destroy_transfers(void) {
+	for (int i = 0; i < n_xfer_pages; i++)
+		free(xfer_pages[i]);
 
-	for (int i = arg_idx; i < n_args && p - buf < 1024; i++) {
-		*p++ = '0';
-		int n_digits = 0;
+	free(xfer_pages);
+	xfer_pages = NULL;
+	n_xfer_pages = n_xfers = 0;
 
-		for (int j = 0; j < strlen(args[i]) && p - buf < 1024; j++) {
-			char c = args[i][j];
-			if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f')) {
-				*p++ = c;
-				n_digits++;
-			}
-		}
+	for (int i = 0; i <= TYPE_ISOC; i++)
+		free(type_index[i].ids);
+	for (int i = 0; i < N_EP_KEYS; i++)
+		free(ep_index[i].ids);
 
-		if (n_digits % 2 == 0) {
-			memmove(p - (n_digits + 1), p - n_digits, n_digits);
-			p--;
-			*p = 0;
-		}
+	for (int i = 0; i < 0x100; i++) {
+		if (!ctrl_index[i])
+			continue;
+
+		for (int j = 0; j < 0x100; j++)
+			free(ctrl_index[i][j].ids);
+
+		free(ctrl_index[i]);
 	}
 
-	int sz = strlen(buf) / 2;
-	if (max_size > 0 && sz > max_size)
-		sz = max_size;
+	memset(type_index, 0, sizeof(type_index));
+	memset(ep_index, 0, sizeof(ep_index));
+	memset(ctrl_index, 0, sizeof(ctrl_index));
+}
 
-	if (ator)
-		*ptr = ator(sz);
+Session rec_session = {-1};  // session currently being recorded to
+Session load_session = {-1}; // session currently loaded into the transfer log
 
-	p = &buf[0];
-	for (int i = 0; i < sz; i++) {
-		int digit = 0;
-		for (int j = 0; j < 2; j++) {
-			digit <<= 4;
-			if (*p >= '0' && *p <= '9')
-				digit |= *p - '0';
-			else if (*p >= 'A' && *p <= 'F')
-				digit |= *p - 'A' + 0xa;
-			else if (*p >= 'a' && *p <= 'f')
-				digit |= *p - 'a' + 0xa;
+void unmap_session(Session *ses) {
+	if (ses->map)
+		munmap(ses->map, ses->map_size);
+	if (ses->fd >= 0)
+		close(ses->fd);
 
-			p++;
-		}
+	free(ses->name);
+	memset(ses, 0, sizeof(Session));
+	ses->fd = -1;
+}
+
+int map_session(Session *ses, u64 size) {
+	if (ses->map)
+		munmap(ses->map, ses->map_size);
+
+	if (ftruncate(ses->fd, size) < 0) {
+		ses->map = NULL;
+		return -1;
+	}
 
-		(*ptr)[i] = (u8)digit;
+	ses->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ses->fd, 0);
+	if (ses->map == MAP_FAILED) {
+		ses->map = NULL;
+		return -2;
 	}
 
-	return sz;
+	ses->map_size = size;
+	return 0;
 }
 
-int get_filter_part(Filter *flt, char *str, char **end) {
-	char *p = str;
-	while (*p && *p != '=' && *p != '<' && *p != '>')
-		p++;
+void close_session(Session *ses) {
+	if (ses->map) {
+		// drop the unused tail of the last growth step
+		u64 end = ((Session_Header*)ses->map)->end;
+		munmap(ses->map, ses->map_size);
+		ses->map = NULL;
+		ftruncate(ses->fd, end);
+	}
 
-	if (*p == 0)
-		return 0;
+	unmap_session(ses);
+}
 
-	int sign = -1;
-	if (*p == '=') {
-		sign = SIGN_EQ;
-	}
-	else if (*p == '<') {
-		if (p[1] == '=') {
-			sign = SIGN_LTE;
-			p++;
+int append_record(Session *ses, Xfer_Entry *xfer) {
+	Session_Header *hdr = (Session_Header*)ses->map;
+	int size = xfer->data ? xfer->size : 0;
+	if (size < 0)
+		size = 0;
+
+	int table_size = xfer->type == TYPE_ISOC ? xfer->n_pkts * sizeof(Iso_Packet) : 0;
+
+	u64 len = (sizeof(Session_Record) + table_size + size + 7) & ~7ULL;
+	if (hdr->end + len > ses->map_size) {
+		u64 new_size = ses->map_size + SESSION_GROW;
+		while (new_size < hdr->end + len)
+			new_size += SESSION_GROW;
+
+		if (map_session(ses, new_size) < 0) {
+			printf("Could not grow session file \"%s\", recording stopped\n", ses->name);
+			unmap_session(ses);
+			return -1;
 		}
-		else
-			sign = SIGN_LT;
+		hdr = (Session_Header*)ses->map;
 	}
-	else if (*p == '>') {
-		if (p[1] == '=') {
-			sign = SIGN_GTE;
-			p++;
-		}
+
+	Session_Record *rec = (Session_Record*)(ses->map + hdr->end);
+	rec->magic    = RECORD_MAGIC;
+	rec->length   = len;
+	rec->type     = xfer->type;
+	rec->endpoint = xfer->endpoint;
+	rec->req_type = xfer->req_type;
+	rec->req      = xfer->req;
+	rec->value    = xfer->value;
+	rec->index    = xfer->index;
+	rec->pkt_sz   = xfer->pkt_sz;
+	rec->n_pkts   = xfer->n_pkts;
+	rec->frame    = xfer->frame;
+	rec->n_errors = xfer->n_errors;
+	rec->res      = xfer->res;
+	rec->size     = size;
+	rec->t_submit   = xfer->t_submit;
+	rec->t_complete = xfer->t_complete;
+
+	u8 *p = (u8*)&rec[1];
+	if (table_size > 0) {
+		if (xfer->pkts)
+			memcpy(p, xfer->pkts, table_size);
 		else
-			sign = SIGN_GT;
+			memset(p, 0, table_size);
+		p += table_size;
 	}
 
-	if (sign < 0) {
-		printf("Unrecognised sign from \"%s\"\n", p);
-		return sign;
-	}
+	if (size > 0)
+		memcpy(p, xfer->data, size);
 
-	p++;
-	int n = strtol(p, &p, 0);
-	*end = p;
+	// Commit the record only after its contents are in place.
+	// If the process dies before this point, the record is simply not part of the session.
+	hdr->n_records++;
+	__atomic_store_n(&hdr->end, hdr->end + len, __ATOMIC_RELEASE);
 
-	switch (sign) {
-		case SIGN_EQ:
-			flt->min = flt->max = n;
-			break;
-		case SIGN_GT:
-			flt->min = n + 1;
-			break;
-		case SIGN_GTE:
-			flt->min = n;
-			break;
-		case SIGN_LT:
-			flt->max = n - 1;
-			break;
-		case SIGN_LTE:
-			flt->max = n;
+	return 0;
+}
+
+/*
+ * Capture writer
+ * Transfers are encoded into a ring buffer as they complete, and a separate thread writes the ring out to the file,
+ *  so that the shell never waits on the disk unless the ring fills up.
+ */
+Pcap_Writer pcap_writer = {0};
+
+void *pcap_writer_thread(void *arg) {
+	Pcap_Writer *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (w->head == w->tail && !w->stop)
+			pthread_cond_wait(&w->data_ready, &w->lock);
+
+		if (w->head == w->tail)
 			break;
+
+		u64 head = w->head;
+		pthread_mutex_unlock(&w->lock);
+
+		// the new data may wrap around the end of the ring
+		u64 pos = w->tail % PCAP_RING_SIZE;
+		u64 len = head - w->tail;
+		u64 first = len < PCAP_RING_SIZE - pos ? len : PCAP_RING_SIZE - pos;
+		fwrite(w->ring + pos, 1, first, w->f);
+		fwrite(w->ring, 1, len - first, w->f);
+
+		pthread_mutex_lock(&w->lock);
+		w->tail = head;
+		pthread_cond_signal(&w->space_free);
 	}
+	pthread_mutex_unlock(&w->lock);
 
-	return sign;
+	return NULL;
 }
 
-Filter parse_filter(char *flt_str) {
-	Filter flt = {-1, -1, -1};
+void pcap_put(Pcap_Writer *w, const void *src, int len) {
+	u64 pos = w->fill % PCAP_RING_SIZE;
+	int first = len < PCAP_RING_SIZE - pos ? len : PCAP_RING_SIZE - pos;
+	memcpy(w->ring + pos, src, first);
+	memcpy(w->ring, (u8*)src + first, len - first);
+	w->fill += len;
+}
 
-	char *p = flt_str;
-	while (*p >= 'a' && *p <= 'z')
-		p++;
+// Adds a record to the ring. The payload is cut off at the snap length, the same as USBPcap does,
+//  but the header (hdr_sz) has to fit within it.
+// For isochronous transfers, pkts gives the packets packed one after another in the payload,
+//  otherwise (pkts is NULL) every packet fills its pkt_sz slot in the buffer
+void pcap_put_record(Pcap_Writer *w, Usbpcap_Header *hdr, u64 t_ns, void *extra, int n_pkts, int pkt_sz, Iso_Packet *pkts, u8 *payload) {
+	int hdr_sz = hdr->hdr_sz;
+	int total = hdr_sz + hdr->data_len;
+	int incl = total < PCAP_SNAPLEN ? total : PCAP_SNAPLEN;
+
+	int len = sizeof(Pcap_Record) + incl;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->fill + len - w->tail > PCAP_RING_SIZE) {
+		w->n_stalls++;
+		while (w->fill + len - w->tail > PCAP_RING_SIZE)
+			pthread_cond_wait(&w->space_free, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
 
-	int len = p - flt_str;
-	if (!strncmp(flt_str, "id", len))
-		flt.var = VAR_ID;
-	else if (!strncmp(flt_str, "type", len))
-		flt.var = VAR_TYPE;
-	else if (!strncmp(flt_str, "size", len))
-		flt.var = VAR_SIZE;
+	u64 t = t_ns + w->wall_offset;
+	Pcap_Record rec = {t / 1000000000ULL, (t % 1000000000ULL) / 1000, incl, total};
+	pcap_put(w, &rec, sizeof(Pcap_Record));
+	pcap_put(w, hdr, sizeof(Usbpcap_Header));
+
+	if (hdr->type == URB_CTRL) {
+		pcap_put(w, extra, 1);
+	}
+	else if (hdr->type == URB_ISOC) {
+		pcap_put(w, extra, sizeof(Usbpcap_Isoc));
+
+		u32 offset = 0;
+		for (int i = 0; i < n_pkts; i++) {
+			Usbpcap_Iso_Packet pk = {i * pkt_sz, pkt_sz, 0};
+			if (pkts) {
+				pk.offset = offset;
+				pk.length = pkts[i].length;
+				pk.status = pkts[i].status ? USBD_STATUS_DEV_NOT_RESPONDING : 0;
+				offset += pkts[i].length;
+			}
+			pcap_put(w, &pk, sizeof(Usbpcap_Iso_Packet));
+		}
+	}
+
+	if (incl > hdr_sz)
+		pcap_put(w, payload, incl - hdr_sz);
+
+	w->n_records++;
+}
+
+u32 get_usbd_status(int res) {
+	if (res >= 0)
+		return 0;
+	if (res == LIBUSB_ERROR_PIPE)
+		return USBD_STATUS_STALL_PID;
+	if (res == LIBUSB_ERROR_INTERRUPTED)
+		return USBD_STATUS_CANCELED;
+
+	return USBD_STATUS_DEV_NOT_RESPONDING;
+}
+
+// Writes a transfer as a request record (at submission) followed by a response record (at completion)
+void pcap_write_transfer(Pcap_Writer *w, Xfer_Entry *xfer) {
+	const u8 urb_types[] = {0, URB_CTRL, URB_INTR, URB_BULK, URB_ISOC};
+	const u16 urb_funcs[] = {
+		0, URB_FUNCTION_CONTROL_TRANSFER, URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER,
+		URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER, URB_FUNCTION_ISOCH_TRANSFER
+	};
+
+	int in = xfer->type == TYPE_CTRL ? xfer->req_type & 0x80 : xfer->endpoint & 0x80;
+	int size = xfer->data && xfer->size > 0 ? xfer->size : 0;
+
+	// the device address isn't known here, so every transfer is attributed to device 1 on bus 1
+	Usbpcap_Header hdr = {0};
+	hdr.irp_id = xfer->id >= 0 ? xfer->id + 1 : PCAP_UNLOGGED_IRP | ++w->n_unlogged;
+	hdr.func = urb_funcs[xfer->type];
+	hdr.bus = 1;
+	hdr.device = 1;
+	hdr.endpoint = xfer->type == TYPE_CTRL ? in : xfer->endpoint;
+	hdr.type = urb_types[xfer->type];
+
+	Usbpcap_Isoc isoc = {xfer->frame, xfer->n_pkts, 0};
+	int n_pkts = 0;
+	void *extra = NULL;
+	u8 stage = USBPCAP_STAGE_SETUP;
+
+	if (xfer->type == TYPE_ISOC) {
+		// packets whose descriptors wouldn't fit in the snap length are left out (their data is still there)
+		int max_pkts = (PCAP_SNAPLEN - sizeof(Usbpcap_Header) - sizeof(Usbpcap_Isoc)) / sizeof(Usbpcap_Iso_Packet);
+		extra = &isoc;
+		n_pkts = xfer->n_pkts < max_pkts ? xfer->n_pkts : max_pkts;
+		isoc.n_pkts = n_pkts;
+		hdr.hdr_sz = sizeof(Usbpcap_Header) + sizeof(Usbpcap_Isoc) + n_pkts * sizeof(Usbpcap_Iso_Packet);
+		if (!in)
+			size = xfer->data ? xfer->n_pkts * xfer->pkt_sz : 0;
+	}
+	else if (xfer->type == TYPE_CTRL) {
+		extra = &stage;
+		hdr.hdr_sz = sizeof(Usbpcap_Header) + 1;
+	}
+	else {
+		hdr.hdr_sz = sizeof(Usbpcap_Header);
+	}
+
+	// request
+	if (xfer->type == TYPE_CTRL) {
+		u8 setup[LIBUSB_CONTROL_SETUP_SIZE + 0xffff];
+		libusb_fill_control_setup(setup, xfer->req_type, xfer->req, xfer->value, xfer->index, xfer->size);
+		hdr.data_len = LIBUSB_CONTROL_SETUP_SIZE;
+		if (!in && size > 0) {
+			memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, xfer->data, size);
+			hdr.data_len += size;
+		}
+		pcap_put_record(w, &hdr, xfer->t_submit, extra, 0, 0, NULL, setup);
+	}
+	else {
+		hdr.data_len = in ? 0 : size;
+		pcap_put_record(w, &hdr, xfer->t_submit, extra, n_pkts, xfer->pkt_sz, NULL, xfer->data);
+	}
+
+	// response
+	hdr.info = USBPCAP_INFO_RESPONSE;
+	hdr.status = get_usbd_status(xfer->res);
+	stage = USBPCAP_STAGE_COMPLETE;
+	isoc.n_errors = xfer->n_errors;
+
+	if (xfer->type == TYPE_ISOC)
+		hdr.data_len = in ? size : 0;
+	else
+		hdr.data_len = in && xfer->res > 0 && xfer->data ? xfer->res : 0;
+
+	pcap_put_record(w, &hdr, xfer->t_complete, extra, n_pkts, xfer->pkt_sz, xfer->pkts, xfer->data);
+
+	pthread_mutex_lock(&w->lock);
+	w->head = w->fill;
+	pthread_cond_signal(&w->data_ready);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void stop_pcap_writer(Pcap_Writer *w) {
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->data_ready);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+	fclose(w->f);
+
+	printf("Wrote %llu record(s) to \"%s\" (waited for the disk %llu time(s))\n\n", w->n_records, w->name, w->n_stalls);
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->data_ready);
+	pthread_cond_destroy(&w->space_free);
+	free(w->ring);
+	free(w->name);
+	memset(w, 0, sizeof(Pcap_Writer));
+}
+
+int start_pcap_writer(Pcap_Writer *w, char *name) {
+	w->f = fopen(name, "wb");
+	if (!w->f)
+		return -1;
+
+	Pcap_Header hdr = {PCAP_MAGIC, 2, 4, 0, 0, PCAP_SNAPLEN, LINKTYPE_USBPCAP};
+	fwrite(&hdr, 1, sizeof(Pcap_Header), w->f);
+
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+	w->wall_offset = (u64)wall.tv_sec * 1000000000ULL + wall.tv_nsec - get_time_ns();
+
+	w->name = strdup(name);
+	w->ring = malloc(PCAP_RING_SIZE);
+	w->head = w->fill = w->tail = 0;
+	w->stop = 0;
+	w->n_records = 0;
+	w->n_stalls = 0;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->data_ready, NULL);
+	pthread_cond_init(&w->space_free, NULL);
+	pthread_create(&w->thread, NULL, pcap_writer_thread, w);
+	return 0;
+}
+
+// Called once a transfer has finished (successfully or not) and its result fields are final
+void complete_transfer(Xfer_Entry *xfer) {
+	xfer->t_complete = get_time_ns();
+	dedup_transfer(xfer);
+
+	if (rec_session.map)
+		append_record(&rec_session, xfer);
+	if (pcap_writer.f)
+		pcap_write_transfer(&pcap_writer, xfer);
+}
+
+void *malloc_ator(int size) {
+	return malloc(size + 1);
+}
+
+int read_file(char *name, u8 **ptr, int max_size, Allocator ator) {
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return -1;
+
+	fseek(f, 0, SEEK_END);
+	int sz = ftell(f);
+	rewind(f);
+
+	if (max_size > 0 && sz > max_size)
+		sz = max_size;
+
+	if (ator)
+		*ptr = ator(sz);
+
+	fread(*ptr, 1, sz, f);
+	fclose(f);
+
+	return sz;
+}
+
+// Hex digit values, with bit 4 set to tell them apart from everything else (which is 0)
+static const u8 hex_digits[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+	['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f
+};
+
+static int is_hex_separator(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ',' || c == '"';
+}
+
+/*
+ * Decodes a run of hex numbers separated by whitespace or commas (eg. "81 00 5101, 0x2", or a hex text file,
+ *  where '#' starts a comment). Each number is big-endian and padded to a whole number of bytes,
+ *  so "123" gives 01 23, and numbers substituted into scripts work as single bytes.
+ * With dst as NULL, only counts the bytes. Otherwise stops after max bytes.
+ * Returns the number of bytes, or -(offset + 1) of the first character that isn't valid.
+ */
+int decode_hex(const char *str, int len, u8 *dst, int max) {
+	const u8 *p = (const u8*)str;
+	const u8 *end = p + len;
+	int n = 0;
+
+	while (p < end) {
+		if (is_hex_separator(*p)) {
+			p++;
+			continue;
+		}
+		if (*p == '#') {
+			while (p < end && *p != '\n')
+				p++;
+			continue;
+		}
+
+		if (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+			p += 2;
+
+		const u8 *start = p;
+		while (p < end && (hex_digits[*p] & 0x10))
+			p++;
+
+		if (p < end && !is_hex_separator(*p) && *p != '#')
+			return -(int)((const char*)p - str) - 1;
+
+		int n_digits = p - start;
+		int n_bytes = (n_digits + 1) / 2;
+		if (!dst) {
+			n += n_bytes;
+			continue;
+		}
+
+		const u8 *d = start;
+		if (n_digits & 1) {
+			if (n >= max)
+				return n;
+			dst[n++] = hex_digits[*d++] & 0xf;
+		}
+
+		for (; d < p; d += 2) {
+			if (n >= max)
+				return n;
+			dst[n++] = (hex_digits[d[0]] << 4) | (hex_digits[d[1]] & 0xf);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Turns arguments into bytes. Each argument is either hex (see decode_hex()) or @<file>, where the file holds hex text.
+ * If ator is given, *ptr is allocated to fit, otherwise at most max_size bytes are written into *ptr.
+ * Returns the number of bytes, or a negative value (after saying why) if the input isn't valid.
+ */
+int parse_byte_array(int n_args, char **args, int arg_idx, u8 **ptr, int max_size, Allocator ator) {
+	int n_texts = n_args - arg_idx;
+	if (n_texts <= 0)
+		return 0;
+
+	char **texts = calloc(n_texts, sizeof(char*));
+	int *lens = calloc(n_texts, sizeof(int));
+	int total = 0, res = 0;
+
+	for (int i = 0; i < n_texts; i++) {
+		char *arg = args[arg_idx + i];
+		texts[i] = arg;
+		lens[i] = strlen(arg);
+
+		if (arg[0] == '@') {
+			u8 *text = NULL;
+			lens[i] = read_file(arg + 1, &text, 0, malloc_ator);
+			if (lens[i] < 0) {
+				printf("Could not open hex file %s\n\n", arg + 1);
+				res = -1;
+				break;
+			}
+			texts[i] = (char*)text;
+		}
+
+		int n = decode_hex(texts[i], lens[i], NULL, 0);
+		if (n < 0) {
+			int off = -n - 1;
+			printf("Invalid hex at offset %d of %s: '%c'\n\n", off, arg[0] == '@' ? arg + 1 : arg, texts[i][off]);
+			res = -2;
+			break;
+		}
+		total += n;
+	}
+
+	if (res == 0) {
+		if (max_size > 0 && total > max_size)
+			total = max_size;
+
+		if (ator)
+			*ptr = ator(total);
+
+		if (total > 0 && !*ptr) {
+			printf("Could not allocate %d bytes\n\n", total);
+			res = -3;
+		}
+	}
+
+	int n = 0;
+	for (int i = 0; i < n_texts; i++) {
+		if (res == 0 && n < total)
+			n += decode_hex(texts[i], lens[i], *ptr + n, total - n);
+		if (texts[i] != args[arg_idx + i])
+			free(texts[i]);
+	}
+
+	free(texts);
+	free(lens);
+	return res < 0 ? res : n;
+}
+
+int get_filter_part(Filter *flt, char *str, char **end) {
+	char *p = str;
+	while (*p && *p != '=' && *p != '<' && *p != '>')
+		p++;
+
+	if (*p == 0)
+		return 0;
+
+	int sign = -1;
+	if (*p == '=') {
+		sign = SIGN_EQ;
+	}
+	else if (*p == '<') {
+		if (p[1] == '=') {
+			sign = SIGN_LTE;
+			p++;
+		}
+		else
+			sign = SIGN_LT;
+	}
+	else if (*p == '>') {
+		if (p[1] == '=') {
+			sign = SIGN_GTE;
+			p++;
+		}
+		else
+			sign = SIGN_GT;
+	}
+
+	if (sign < 0) {
+		printf("Unrecognised sign from \"%s\"\n", p);
+		return sign;
+	}
+
+	p++;
+	int n = strtol(p, &p, 0);
+	*end = p;
+
+	switch (sign) {
+		case SIGN_EQ:
+			flt->min = flt->max = n;
+			break;
+		case SIGN_GT:
+			flt->min = n + 1;
+			break;
+		case SIGN_GTE:
+			flt->min = n;
+			break;
+		case SIGN_LT:
+			flt->max = n - 1;
+			break;
+		case SIGN_LTE:
+			flt->max = n;
+			break;
+	}
+
+	return sign;
+}
+
+Filter parse_filter(char *flt_str) {
+	Filter flt = {-1, INT_MIN, INT_MAX};
+
+	char *p = flt_str;
+	while (*p >= 'a' && *p <= 'z')
+		p++;
+
+	int len = p - flt_str;
+	if (!strncmp(flt_str, "id", len))
+		flt.var = VAR_ID;
+	else if (!strncmp(flt_str, "type", len))
+		flt.var = VAR_TYPE;
+	else if (!strncmp(flt_str, "size", len))
+		flt.var = VAR_SIZE;
 	else if (!strncmp(flt_str, "index", len))
 		flt.var = VAR_INDEX;
 	else if (!strncmp(flt_str, "ep", len))
 		flt.var = VAR_EP;
 	else if (!strncmp(flt_str, "errors", len))
 		flt.var = VAR_ERRS;
+	else if (!strncmp(flt_str, "res", len))
+		flt.var = VAR_RES;
+	else if (!strncmp(flt_str, "data", len))
+		flt.var = VAR_DATA;
 	else {
 		*p = 0;
 		printf("Unrecognised variable \"%s\"\n", flt_str);
@@ -349,48 +1405,157 @@ Filter parse_filter(char *flt_str) {
 	return flt;
 }
 
+// Returns the value of a filter variable for a transfer, or INT_MIN if the variable does not apply to it
+int get_filter_value(Xfer_Entry *xfer, int var) {
+	switch (var) {
+		case VAR_ID:
+			return xfer->id;
+		case VAR_TYPE:
+			return xfer->type;
+		case VAR_SIZE:
+			return xfer->size;
+		case VAR_INDEX:
+			return xfer->type == TYPE_CTRL ? xfer->index : INT_MIN;
+		case VAR_EP:
+			return get_ep_key(xfer);
+		case VAR_ERRS:
+			return xfer->type == TYPE_ISOC ? xfer->n_errors : INT_MIN;
+		case VAR_RES:
+			return xfer->res;
+		case VAR_DATA:
+			return xfer->data && xfer->size > 0 ? xfer->data[0] : INT_MIN;
+	}
+
+	return INT_MIN;
+}
+
 int test_filters(Xfer_Entry *xfer, Filter *filters, int n_flts) {
-	int i;
 	Filter *flt = &filters[0];
 
 	for (int i = 0; i < n_flts; i++, flt++) {
-		int n;
-		int spec_type = -1;
+		int n = get_filter_value(xfer, flt->var);
+		if (n == INT_MIN || n < flt->min || n > flt->max)
+			return 0;
+	}
 
-		switch (flt->var) {
-			case VAR_ID:
-				n = xfer->id;
-				break;
-			case VAR_TYPE:
-				n = xfer->type;
-				break;
-			case VAR_SIZE:
-				n = xfer->size;
-				break;
-			case VAR_INDEX:
-				n = xfer->index;
-				spec_type = TYPE_CTRL;
-				break;
-			case VAR_EP:
-				n = (xfer->endpoint | xfer->req_type) & 0x1f;
-				break;
-			case VAR_ERRS:
-				n = xfer->n_errors;
-				spec_type = TYPE_ISOC;
-				break;
-			default:
-				return 0;
+	return 1;
+}
+
+int parse_filters(int n_strs, char **strs, Filter *filters) {
+	int n_flts = 0;
+
+	for (int i = 0; i < n_strs && i < N_VARS; i++) {
+		filters[i] = parse_filter(strs[i]);
+		if (filters[i].var < 0)
+			return -1;
+
+		n_flts++;
+		for (int j = 0; j < n_flts-1; j++) {
+			if (filters[i].var == filters[j].var) {
+				printf("Cannot apply two filters on the same variable\n");
+				return -2;
+			}
 		}
+	}
 
-		int no_min = flt->min < 0;
-		int no_max = flt->max < 0;
-		int pass = (n >= flt->min || no_min) && (n <= flt->max || no_max);
+	return n_flts;
+}
 
-		if (!pass || (xfer->type != spec_type && spec_type > 0))
-			return 0;
+// Returns the first position in a sorted id list whose id is >= the given id
+int lower_bound(Id_List *list, int id) {
+	int lo = 0, hi = list->len;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (list->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return 1;
+	return lo;
+}
+
+/*
+ * Calls visit() on every transfer that passes the given filters, in id order.
+ * An id filter narrows the search to a slice of the log, and an exact type, ep or index filter
+ *  narrows it to the matching index list (the shortest one is used if there are several).
+ * Every candidate is still run through test_filters() to apply the remaining filters.
+ * Returns the number of matching transfers, or whatever visit() returned if it stopped the query (without a summary).
+ */
+int query_transfers(Filter *filters, int n_flts, Xfer_Visitor visit, void *arg) {
+	u64 start = get_time_ns();
+
+	int lo = 0, hi = n_xfers - 1;
+	Id_List empty = {0};
+	Id_List *list = NULL;
+
+	for (int i = 0; i < n_flts; i++) {
+		Filter *flt = &filters[i];
+		Id_List *l = NULL;
+
+		if (flt->var == VAR_ID) {
+			if (flt->min > lo)
+				lo = flt->min;
+			if (flt->max < hi)
+				hi = flt->max;
+			continue;
+		}
+
+		if (flt->min != flt->max)
+			continue;
+
+		if (flt->var == VAR_TYPE)
+			l = flt->min >= 0 && flt->min <= TYPE_ISOC ? &type_index[flt->min] : &empty;
+		else if (flt->var == VAR_EP)
+			l = flt->min >= 0 && flt->min < N_EP_KEYS ? &ep_index[flt->min] : &empty;
+		else if (flt->var == VAR_INDEX)
+			l = flt->min >= 0 && flt->min <= 0xffff ? get_ctrl_list(flt->min, 0) : &empty;
+		else
+			continue;
+
+		if (!l)
+			l = &empty;
+
+		if (!list || l->len < list->len)
+			list = l;
+	}
+
+	int n_tested = 0, n_matched = 0;
+
+	if (list) {
+		for (int i = lower_bound(list, lo); i < list->len && list->ids[i] <= hi; i++) {
+			Xfer_Entry *xfer = get_transfer(list->ids[i]);
+			n_tested++;
+
+			if (test_filters(xfer, filters, n_flts)) {
+				int res = visit(xfer, arg);
+				if (res < 0)
+					return res;
+				n_matched++;
+			}
+		}
+	}
+	else {
+		for (int id = lo; id <= hi; id++) {
+			Xfer_Entry *xfer = get_transfer(id);
+			n_tested++;
+
+			if (test_filters(xfer, filters, n_flts)) {
+				int res = visit(xfer, arg);
+				if (res < 0)
+					return res;
+				n_matched++;
+			}
+		}
+	}
+
+	u64 elapsed = get_time_ns() - start;
+	printf(
+		"%d of %d transfer(s) matched (%d examined) in %.3f ms\n\n",
+		n_matched, n_xfers, n_tested, (double)elapsed / 1000000.0
+	);
+
+	return n_matched;
 }
 
 int help(int argc, char **args) {
@@ -402,6 +1567,13 @@ int help(int argc, char **args) {
 		"    Prints this message\n"
 		"  select <interface> <alt setting>\n"
 		"    Claim an interface and select an alt setting within that interface\n"
+		"  alts\n"
+		"    Lists every interface and alt setting, with each endpoint's wMaxPacketSize (and high-bandwidth multiplier)\n"
+		"     and, for periodic endpoints, the bytes per microframe and MB/s it reserves (at high speed)\n"
+		"  autoselect <bytes/sec> [measure [transfer count]]\n"
+		"    Selects the alt setting with the least isochronous IN bandwidth that can carry <bytes/sec>.\n"
+		"    With measure, each alt setting that should be enough is streamed from (%d transfers by default), smallest first,\n"
+		"     until one delivers the rate with no packet errors\n"
 		"  ctrl <req type> <request> <value> <index> <length / file / byte array>\n"
 		"    Issues a control transfer\n"
 		"  int <endpoint> <length / file / byte array>\n"
@@ -410,13 +1582,89 @@ int help(int argc, char **args) {
 		"    Issues a bulk transfer\n"
 		"  isoc <endpoint> <packet count> <packet size> [input file / byte array]\n"
 		"    Issues an isochronous transfer\n"
+		"  stream <endpoint> <packet count> <packet size> <queue depth> <transfer count>\n"
+		"    Reads a series of isochronous transfers, keeping <queue depth> of them in flight\n"
+		"  frames [<file / - / |command / none> [width] [height] [format] [weave / bob / motion] [rgb]] / [off]\n"
+		"    Rebuilds interlaced frames (default 720x576) from isochronous IN transfers as they complete,\n"
+		"     and writes each whole frame to a file, stdout (-) or the input of a command.\n"
+		"    The format is one of yuyv, yvyu, uyvy, vyuy, yuv411 or rgb565, otherwise it's worked out from V_IN_MODE and OUT_FORMAT.\n"
+		"    bob replaces the bottom field with lines interpolated from the top field, and motion only does so\n"
+		"     where the bottom field changed since the last frame. The default (weave) leaves the fields as they are.\n"
+		"     Deinterlacing applies to the sink and thumbnails; frames published with publish are always woven.\n"
+		"    With rgb, frames are converted to 24-bit RGB on the way to the sink.\n"
+		"    Frames with missing data are counted as incomplete, and frames the sink is too slow for are dropped.\n"
+		"    Without arguments, prints the frame counts and the latency from a frame's last packet to its delivery\n"
+		"  thumbs [<file prefix> [every n frames] [scale]] / [off]\n"
+		"    Writes every nth assembled frame (default %d) as an RGB PPM at 1/[scale] size (default 1/%d),\n"
+		"     on a thread of its own. Frames that come while the last one is still being written are skipped\n"
+		"  publish [<name> frames [slots] / <name> raw <slot size> [slots] / off]\n"
+		"    Publishes each assembled frame, or the payload of each isochronous IN transfer, into a shared-memory ring\n"
+		"     (default %d slots) that other processes can read from with shm_ring.h, eg. shm_reader\n"
+		"  devices\n"
+		"    Lists the open devices, and every attached device with the same vendor and product id\n"
+		"  open <bus-port path / serial number / emu>\n"
+		"    Opens another device, or another emulated device\n"
+		"  use <device>\n"
+		"    Selects the open device that every other command goes to\n"
+		"  shadow [on / off / reset]\n"
+		"    Keeps the last known value of each em28xx register on the current device, so that writes which change nothing\n"
+		"     are skipped and reads of registers that only change when written are answered without a round-trip.\n"
+		"    Volatile registers (eg. GPIO_STATE, I2C_STATUS, IR) always go to the device. Without arguments, shows how many round-trips were saved\n"
+		"  regdump [name]\n"
+		"    Reads all 256 em28xx registers from the device in a few multi-byte reads, bypassing the shadow.\n"
+		"    Without a name, prints every named register with its value decoded. With one, keeps them as a snapshot\n"
+		"  regdiff <snapshot> [snapshot / live]\n"
+		"    Lists the registers that differ between two snapshots, or between a snapshot and the device as it is now\n"
+		"  watch <register(s)...> <interval ms> <seconds>\n"
+		"    Polls registers (by name or number) from a timer, with several reads in flight, printing each value that changes.\n"
+		"    Shows the poll rate achieved against the one asked for. The reads are not added to the transfer log\n"
+		"  watch csv <file>\n"
+		"    Saves every value read by the last watch (up to %d) as CSV\n"
+		"  capture <endpoint> <packet count> <packet size> <queue depth> <seconds> [file prefix]\n"
+		"    Streams isochronous transfers from every open device at once, each on its own thread.\n"
+		"    Select an alt setting on each device first. With a prefix, device n's payload goes to <prefix><n>.bin.\n"
+		"    These transfers are counted per device, but not added to the transfer log\n"
 		"  list [filter(s)...]\n"
 		"    List all transfers that match certain criteria\n"
 		"    See \"Filters\" for more info\n"
 		"  save <file> [filter(s)...]\n"
 		"    Saves packet data from all transfers that match certain criteria\n"
-		"  exec <script file>\n"
-		"    Loads a text file and interprets each line as a command\n\n"
+		"  stats [filter(s)...]\n"
+		"    Shows latency percentiles, throughput and error counts per transfer type and endpoint\n"
+		"  dedup [on / off]\n"
+		"    Transfers with up to %d bytes of data share one copy of each distinct payload (on by default).\n"
+		"     Shows how many were shared and how much memory that saved\n"
+		"  bench [-o <csv file>] ctrl [count] [window]\n"
+		"  bench [-o <csv file>] bulk <endpoint> [count] [sizes...]\n"
+		"  bench [-o <csv file>] isoc <endpoint> <packet size> [count]\n"
+		"    Measures control round-trip rate (CHIP_ID reads), bulk throughput across request sizes,\n"
+		"     or isoc bandwidth and error rate across queue depths and packet counts.\n"
+		"    With -o, the results are also appended to a CSV file\n"
+		"  session [<file> / off]\n"
+		"    Records every transfer (including those already made) into a session file\n"
+		"  load <session file>\n"
+		"    Replaces the transfer log with the contents of a session file\n"
+		"  record [<file> / off]\n"
+		"    Writes every transfer (including those already made) into a USBPcap capture,\n"
+		"     which can be read by analyse, replay or Wireshark\n"
+		"  ctrlbatch <file> [window]\n"
+		"    Issues a sequence of control transfers, keeping up to [window] (default %d) in flight.\n"
+		"    Each line of the file holds the arguments to a ctrl command. Stops on the first error.\n"
+		"  replay <USBPcap file> [timed / max / <scale>] [window]\n"
+		"    Replays the requests from a capture, keeping up to [window] (default %d) in flight.\n"
+		"    timed (the default) keeps the captured gaps between requests, max ignores them,\n"
+		"     and a number scales them (eg. 0.5 for twice as fast). Responses that differ from the\n"
+		"     capture (result, length, or IN data except for isochronous transfers) are reported as they arrive.\n"
+		"    Standard requests other than SET_INTERFACE are skipped\n"
+		"  exec <script file> [window]\n"
+		"    Loads a text file and interprets each line as a command\n"
+		"    If [window] is more than 1, runs of consecutive ctrl commands are pipelined like ctrlbatch\n"
+		"    The script stops at the first command that fails, including a control transfer that fails\n\n"
+		"Byte arrays:\n"
+		"  Hex numbers separated by spaces or commas, eg. 81 00 5101 0x2. Each number is padded to whole bytes,\n"
+		"   so 123 gives 01 23. Quotes allow more numbers than the argument limit, eg. \"81 00 51 01 ...\"\n"
+		"  @<file> reads the same format from a text file, where # starts a comment\n"
+		"  Any line (at the prompt or in a file) ending with \\ is continued on the next one\n\n"
 		"Filters:\n"
 		"  A way of selecting which transfers to view or save.\n"
 		"  The format is: <variable> <sign> <value> [<sign> <value>]\n"
@@ -442,7 +1690,25 @@ int help(int argc, char **args) {
 		"  ep\n"
 		"    Select for the endpoint (or req type if ctrl) AND 0x1f\n"
 		"  errors\n"
-		"    For isochronous transfers only, select for the number of errors\n\n"
+		"    For isochronous transfers only, select for the number of errors\n"
+		"  res\n"
+		"    Select for the result of a transfer (negative values are libusb errors)\n"
+		"  data\n"
+		"    Select for the first byte of a transfer's data\n\n"
+		"Scripts:\n"
+		"  Scripts run by exec are compiled once before they run, and may also contain:\n"
+		"  set <name> <value> [<op> <value>]\n"
+		"    Sets a variable. A value is a number, $<name>, or a filter variable (eg. res, data),\n"
+		"     which reads from the last transfer. <op> is one of + - * / %% & | ^ << >>\n"
+		"  repeat <count> { ... }\n"
+		"  while <condition> { ... }\n"
+		"  if <condition> { ... }\n"
+		"    A condition is a filter tested against the last transfer, eg. \"data=0\", \"res<0\",\n"
+		"     or a filter on a variable, eg. \"$n<10\"\n"
+		"  break\n"
+		"    Leaves the innermost repeat or while loop\n"
+		"  Any argument of the form $<name> is replaced with the value of that variable\n\n",
+		DEFAULT_AUTOSELECT_COUNT, DEFAULT_THUMB_INTERVAL, DEFAULT_THUMB_STEP, DEFAULT_PUBLISH_SLOTS, WATCH_RING_LEN, DEDUP_MAX_SIZE, DEFAULT_CTRL_WINDOW, DEFAULT_CTRL_WINDOW
 	);
 
 	return 0;
@@ -450,331 +1716,3974 @@ int help(int argc, char **args) {
 
 int prev_iface = -1;
 
-int sel(int argc, char **args) {
-	int iface = strtol(args[1], NULL, 0);
-	int alt   = strtol(args[2], NULL, 0);
+int select_alt(int iface, int alt) {
+	if (prev_iface >= 0 && iface != prev_iface)
+		io->release_interface(dev, prev_iface);
+
+	int res = io->claim_interface(dev, iface);
+	if (res != 0) {
+		printf("Failed to claim interface %d: %s (%d)\n\n", iface, libusb_strerror(res), res);
+		return -1;
+	}
+
+	prev_iface = iface;
+
+	res = io->set_alt_setting(dev, iface, alt);
+	if (res != 0) {
+		printf("Failed to set alt setting %d on interface %d: %s (%d)\n\n", alt, iface, libusb_strerror(res), res);
+		return -2;
+	}
+
+	// alt settings aren't in the transfer log (hence no id), but a capture needs them to be replayable
+	if (pcap_writer.f) {
+		Xfer_Entry xfer = {-1, TYPE_CTRL, 0, 0x01, SET_INTERFACE, alt, iface};
+		xfer.t_submit = xfer.t_complete = get_time_ns();
+		pcap_write_transfer(&pcap_writer, &xfer);
+	}
+
+	return 0;
+}
+
+int sel(int argc, char **args) {
+	int iface = strtol(args[1], NULL, 0);
+	int alt   = strtol(args[2], NULL, 0);
+	return select_alt(iface, alt);
+}
+
+// Reads the payload of an outgoing transfer, from a binary file or as hex (see parse_byte_array()).
+// Returns its size, or a negative value if it isn't valid.
+int get_out_data(int argc, char **args, int arg_idx, u8 **data) {
+	int sz = read_file(args[arg_idx], data, 0, allocate);
+	if (sz <= 0)
+		sz = parse_byte_array(argc, args, arg_idx, data, 0, allocate);
+
+	return sz;
+}
+
+/*
+ * Register shadow
+ * With the shadow on, the last known value of each em28xx register is kept, so that register writes
+ *  which wouldn't change anything can be skipped, and reads of registers that only change when written can be
+ *  answered without a round-trip. Registers marked REG_VOLATILE in em28xx_regs.h (or not listed there) always go to the device.
+ */
+Reg_Shadow *shadow = NULL; // the current device's
+
+int is_reg_request(Xfer_Entry *xfer) {
+	return xfer->req == 0 && (xfer->req_type == 0xc0 || xfer->req_type == 0x40) &&
+		xfer->size > 0 && xfer->index + xfer->size <= 256;
+}
+
+// A write to a read-only register tells us nothing about its value
+int is_cacheable_reg(int index, int write) {
+	const struct Register *reg = get_register(index);
+	return reg && !(reg->flags & REG_VOLATILE) && !(write && (reg->flags & REG_READ_ONLY));
+}
+
+// Returns 1 if a request can be answered from the shadow, after filling in its result (and data, if it's a read).
+// A write that does go to the device is recorded in the shadow straight away, so that requests queued behind it see it.
+int shadow_filter(Xfer_Entry *xfer) {
+	if (!shadow || !shadow->enabled || !is_reg_request(xfer))
+		return 0;
+
+	int in = xfer->req_type & 0x80;
+	int hit = 1;
+	for (int i = 0; i < xfer->size && hit; i++) {
+		int reg = xfer->index + i;
+		hit = shadow->known[reg] && is_cacheable_reg(reg, !in) && (in || shadow->values[reg] == xfer->data[i]);
+	}
+
+	if (in) {
+		shadow->n_reads++;
+		if (hit) {
+			memcpy(xfer->data, &shadow->values[xfer->index], xfer->size);
+			shadow->reads_saved++;
+		}
+	}
+	else {
+		shadow->n_writes++;
+		if (hit) {
+			shadow->writes_saved++;
+		}
+		else {
+			shadow->seq++;
+			for (int i = 0; i < xfer->size; i++) {
+				int reg = xfer->index + i;
+				if (is_cacheable_reg(reg, 1)) {
+					shadow->values[reg] = xfer->data[i];
+					shadow->known[reg] = 1;
+					shadow->written[reg] = shadow->seq;
+				}
+			}
+		}
+	}
+
+	if (hit)
+		xfer->res = xfer->size;
+
+	return hit;
+}
+
+// Records the outcome of a register request that went to the device. <seq> is the shadow's seq from when it was sent.
+void shadow_complete(Xfer_Entry *xfer, u64 seq) {
+	if (!shadow || !shadow->enabled || !is_reg_request(xfer))
+		return;
+
+	int in = xfer->req_type & 0x80;
+	int len = xfer->res < xfer->size ? xfer->res : xfer->size;
+
+	// after a failed write, the register could hold either value
+	if (!in && xfer->res < 0) {
+		for (int i = 0; i < xfer->size; i++) {
+			if (is_cacheable_reg(xfer->index + i, 1))
+				shadow->known[xfer->index + i] = 0;
+		}
+	}
+
+	// a read that was in flight while the register was written has returned the old value
+	for (int i = 0; in && i < len; i++) {
+		int reg = xfer->index + i;
+		if (shadow->written[reg] <= seq && is_cacheable_reg(reg, 0)) {
+			shadow->values[reg] = xfer->data[i];
+			shadow->known[reg] = 1;
+		}
+	}
+}
+
+void print_shadow(Reg_Shadow *s) {
+	int n_known = 0;
+	for (int i = 0; i < 256; i++)
+		n_known += s->known[i];
+
+	printf(
+		"Shadow %s: %d register(s) known\n"
+		"%llu read(s), %llu answered from the shadow\n"
+		"%llu write(s), %llu skipped\n"
+		"%llu round-trip(s) saved\n\n",
+		s->enabled ? "on" : "off", n_known, s->n_reads, s->reads_saved, s->n_writes, s->writes_saved,
+		s->reads_saved + s->writes_saved
+	);
+}
+
+int shadow_cmd(int argc, char **args) {
+	if (argc < 2) {
+		print_shadow(shadow);
+		return 0;
+	}
+
+	if (!strcmp(args[1], "on")) {
+		shadow->enabled = 1;
+	}
+	else if (!strcmp(args[1], "off")) {
+		print_shadow(shadow);
+		memset(shadow, 0, sizeof(Reg_Shadow));
+	}
+	else if (!strcmp(args[1], "reset")) {
+		int enabled = shadow->enabled;
+		memset(shadow, 0, sizeof(Reg_Shadow));
+		shadow->enabled = enabled;
+	}
+	else {
+		printf("Expected on, off or reset\n\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Register snapshots
+ * The em28xx returns several consecutive registers from one read request, as long as the request
+ *  fits in the driver's control buffer (Linux caps it at 80 bytes), so the 256 registers take 4 reads of 64.
+ * If the device turns down a read of that size (or returns less), the size is halved until it doesn't.
+ * Each device keeps the size it settled on, and a read that times out is tried again at the same size.
+ */
+Reg_Snapshot reg_snapshots[MAX_SNAPSHOTS];
+int n_snapshots = 0;
+int *reg_read_size = NULL; // the current device's
+
+// Reads every register from the device (never from the shadow). Returns the number of reads, or a negative value on failure.
+int read_reg_space(u8 *values) {
+	int n_reads = 0;
+	int n_timeouts = 0;
+	int reg = 0;
+	while (reg < 256) {
+		// after a short read, the last request can reach past register 0xff
+		int size = *reg_read_size < 256 - reg ? *reg_read_size : 256 - reg;
+		Xfer_Entry *xfer = new_transfer(TYPE_CTRL);
+		xfer->req_type = 0xc0;
+		xfer->index = reg;
+		index_transfer(xfer);
+
+		xfer->size = size;
+		xfer->data = allocate(size);
+		if (!xfer->data)
+			return -1;
+
+		u64 seq = shadow ? shadow->seq : 0;
+		xfer->t_submit = get_time_ns();
+		xfer->res = io->control(dev, xfer->req_type, xfer->req, xfer->value, xfer->index, xfer->data, xfer->size, XFER_TIMEOUT);
+		shadow_complete(xfer, seq);
+		complete_transfer(xfer);
+		n_reads++;
+
+		if (xfer->res == LIBUSB_ERROR_TIMEOUT && ++n_timeouts < REG_READ_RETRIES)
+			continue;
+		n_timeouts = 0;
+
+		// whatever a short read did return is kept
+		if (xfer->res > 0) {
+			memcpy(values + reg, xfer->data, xfer->res);
+			reg += xfer->res;
+		}
+
+		if (xfer->res == size)
+			continue;
+
+		if (size == 1 || (xfer->res < 0 && xfer->res != LIBUSB_ERROR_PIPE)) {
+			if (xfer->res < 0)
+				printf("Reading register %#x failed: %s (%d)\n\n", reg, libusb_strerror(xfer->res), xfer->res);
+			else
+				printf("Reading register %#x returned no data\n\n", reg);
+			return -2;
+		}
+
+		*reg_read_size = size / 2;
+	}
+
+	return n_reads;
+}
+
+Reg_Snapshot *find_snapshot(const char *name) {
+	for (int i = 0; i < n_snapshots; i++) {
+		if (!strcmp(reg_snapshots[i].name, name))
+			return &reg_snapshots[i];
+	}
+	return NULL;
+}
+
+// Returns 0 if none of a register's named values match, in which case the decoded value is just the hex one
+int decode_reg(int reg, u8 value, char *buf, int size) {
+	format_reg_value(reg, value, buf, size);
+	return get_register(reg) && strncmp(buf, "0x", 2);
+}
+
+void print_reg(int reg, u8 value) {
+	const struct Register *r = get_register(reg);
+	char str[256];
+	int decoded = decode_reg(reg, value, str, sizeof(str));
+	printf("  0x%02x %-20s %02x  %s\n", reg, r ? r->str : "", value, decoded ? str : "");
+}
+
+int regdump(int argc, char **args) {
+	u8 values[256];
+	u64 start = get_time_ns();
+	int n_reads = read_reg_space(values);
+	if (n_reads < 0)
+		return -1;
+
+	double ms = (double)(get_time_ns() - start) / 1e6;
+
+	if (argc < 2) {
+		for (int i = 0; i < 256; i++) {
+			if (get_register(i))
+				print_reg(i, values[i]);
+		}
+	}
+	else {
+		Reg_Snapshot *snap = find_snapshot(args[1]);
+		if (!snap) {
+			if (n_snapshots >= MAX_SNAPSHOTS) {
+				printf("There can only be %d snapshots\n\n", MAX_SNAPSHOTS);
+				return -2;
+			}
+			snap = &reg_snapshots[n_snapshots++];
+			snprintf(snap->name, sizeof(snap->name), "%s", args[1]);
+		}
+
+		memcpy(snap->values, values, 256);
+		snap->t_taken = time(NULL);
+	}
+
+	printf("Read 256 registers in %d request(s) of %d bytes, %.3f ms\n\n", n_reads, *reg_read_size, ms);
+	return 0;
+}
+
+int regdiff(int argc, char **args) {
+	Reg_Snapshot *a = find_snapshot(args[1]);
+	if (!a) {
+		printf("No snapshot named \"%s\"\n\n", args[1]);
+		return -1;
+	}
+
+	u8 live[256];
+	u8 *b_values = live;
+	const char *b_name = "live";
+
+	if (argc > 2 && strcmp(args[2], "live")) {
+		Reg_Snapshot *b = find_snapshot(args[2]);
+		if (!b) {
+			printf("No snapshot named \"%s\"\n\n", args[2]);
+			return -2;
+		}
+		b_values = b->values;
+		b_name = b->name;
+	}
+	else if (read_reg_space(live) < 0) {
+		return -3;
+	}
+
+	printf("%s -> %s:\n", a->name, b_name);
+
+	int n_diffs = 0;
+	for (int i = 0; i < 256; i++) {
+		if (a->values[i] == b_values[i])
+			continue;
+
+		const struct Register *r = get_register(i);
+		char before[256], after[256];
+		int decoded = decode_reg(i, a->values[i], before, sizeof(before));
+		decoded |= decode_reg(i, b_values[i], after, sizeof(after));
+
+		printf("  0x%02x %-20s %02x -> %02x", i, r ? r->str : "", a->values[i], b_values[i]);
+		if (decoded)
+			printf("  %s -> %s", before, after);
+		if (r && (r->flags & REG_VOLATILE))
+			printf(" (volatile)");
+		putchar('\n');
+
+		n_diffs++;
+	}
+
+	printf("%d register(s) differ\n\n", n_diffs);
+	return 0;
+}
+
+// Returns NULL (without adding to the log) if the payload isn't valid
+Xfer_Entry *new_ctrl_transfer(int argc, char **args) {
+	u8 req_type = strtol(args[1], NULL, 16);
+	u8 *data = NULL;
+	int size;
+
+	if (req_type & 0x80) {
+		size = strtol(args[5], NULL, 0);
+		data = allocate(size);
+	}
+	else {
+		size = get_out_data(argc, args, 5, &data);
+		if (size < 0)
+			return NULL;
+	}
+
+	if (size > 0xffff) {
+		printf("Control transfers are limited to 65535 bytes\n\n");
+		return NULL;
+	}
+
+	Xfer_Entry *xfer = new_transfer(TYPE_CTRL);
+
+	xfer->req_type = req_type;
+	xfer->req = strtol(args[2], NULL, 0);
+	xfer->value = strtol(args[3], NULL, 0);
+	xfer->index = strtol(args[4], NULL, 0);
+	index_transfer(xfer);
+
+	xfer->size = size;
+	xfer->data = data;
+	return xfer;
+}
+
+int ctrl(int argc, char **args) {
+	Xfer_Entry *xfer = new_ctrl_transfer(argc, args);
+	if (!xfer)
+		return -1;
+
+	xfer->t_submit = get_time_ns();
+	if (shadow_filter(xfer)) {
+		complete_transfer(xfer);
+		return 0;
+	}
+
+	u64 seq = shadow ? shadow->seq : 0;
+	xfer->res = io->control(dev, xfer->req_type, xfer->req, xfer->value, xfer->index, xfer->data, xfer->size, XFER_TIMEOUT);
+	shadow_complete(xfer, seq);
+	complete_transfer(xfer);
+	return 0;
+}
+
+// Maps the status of an asynchronous transfer to what the equivalent synchronous call would have returned
+int get_async_result(struct libusb_transfer *usb_xfer) {
+	switch (usb_xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return usb_xfer->actual_length;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+/*
+ * The payload of an asynchronous control read is only allocated once it arrives, so that if it turns out to be a duplicate,
+ *  it's still the latest allocation and can be given back (see dedup_transfer())
+ */
+void defer_ctrl_payload(Xfer_Entry *xfer) {
+	if ((xfer->req_type & 0x80) && release_allocation(xfer->data, xfer->size))
+		xfer->data = NULL;
+}
+
+void receive_ctrl_payload(Xfer_Entry *xfer, struct libusb_transfer *usb_xfer) {
+	if (!xfer->data)
+		xfer->data = allocate(xfer->size);
+	if (xfer->res > 0 && xfer->data)
+		memcpy(xfer->data, libusb_control_transfer_get_data(usb_xfer), xfer->res);
+}
+
+Ctrl_Batch ctrl_batch = {0};
+
+void ctrl_batch_cb(struct libusb_transfer *usb_xfer) {
+	Batch_Slot *slot = usb_xfer->user_data;
+	Xfer_Entry *xfer = slot->xfer;
+
+	slot->xfer = NULL;
+	ctrl_batch.in_flight--;
+
+	xfer->res = get_async_result(usb_xfer);
+	if (xfer->req_type & 0x80)
+		receive_ctrl_payload(xfer, usb_xfer);
+
+	shadow_complete(xfer, slot->shadow_seq);
+
+	if (xfer->res < 0 && !ctrl_batch.failed) {
+		ctrl_batch.failed = xfer;
+
+		// Stop on the first error: anything submitted after the failed request gets cancelled
+		for (int i = 0; i < ctrl_batch.window; i++) {
+			if (ctrl_batch.slots[i].xfer)
+				io->cancel(ctrl_batch.slots[i].usb);
+		}
+	}
+
+	complete_transfer(xfer);
+}
+
+int wait_ctrl_batch(int max_in_flight) {
+	while (ctrl_batch.in_flight > max_in_flight) {
+		int res = io->handle_events(dev);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			printf("libusb_handle_events() = %d : %s\n\n", res, libusb_strerror(res));
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+void begin_ctrl_batch(int window) {
+	if (window < 1)
+		window = 1;
+	if (window > MAX_CTRL_WINDOW)
+		window = MAX_CTRL_WINDOW;
+
+	ctrl_batch.window = window;
+	ctrl_batch.next_slot = 0;
+	ctrl_batch.in_flight = 0;
+	ctrl_batch.failed = NULL;
+}
+
+// Queues a control transfer (same arguments as the ctrl command), waiting for a free slot if the window is full.
+// Returns a negative value without submitting anything if an earlier request in the batch has failed.
+int batch_ctrl(int argc, char **args) {
+	if (wait_ctrl_batch(ctrl_batch.window - 1) < 0)
+		return -1;
+	if (ctrl_batch.failed)
+		return -2;
+
+	Xfer_Entry *xfer = new_ctrl_transfer(argc, args);
+	if (!xfer)
+		return -4;
+
+	// while it's still the latest allocation
+	if ((xfer->req_type & 0x80) == 0)
+		dedup_transfer(xfer);
+
+	xfer->t_submit = get_time_ns();
+	if (shadow_filter(xfer)) {
+		complete_transfer(xfer);
+		return 0;
+	}
+
+	// the window is used round-robin, so the next slot in line is always the oldest one (and now free)
+	Batch_Slot *slot = &ctrl_batch.slots[ctrl_batch.next_slot];
+	ctrl_batch.next_slot = (ctrl_batch.next_slot + 1) % ctrl_batch.window;
+
+	int len = LIBUSB_CONTROL_SETUP_SIZE + xfer->size;
+	if (!slot->usb)
+		slot->usb = libusb_alloc_transfer(0);
+	if (slot->buf_size < len) {
+		slot->buf = realloc(slot->buf, len);
+		slot->buf_size = len;
+	}
+
+	libusb_fill_control_setup(slot->buf, xfer->req_type, xfer->req, xfer->value, xfer->index, xfer->size);
+	if ((xfer->req_type & 0x80) == 0 && xfer->size > 0)
+		memcpy(slot->buf + LIBUSB_CONTROL_SETUP_SIZE, xfer->data, xfer->size);
+
+	libusb_fill_control_transfer(slot->usb, dev, slot->buf, ctrl_batch_cb, slot, XFER_TIMEOUT);
+	slot->shadow_seq = shadow ? shadow->seq : 0;
+
+	xfer->t_submit = get_time_ns();
+	int res = io->submit(slot->usb);
+	if (res < 0) {
+		xfer->res = res;
+		shadow_complete(xfer, slot->shadow_seq);
+		ctrl_batch.failed = xfer;
+		complete_transfer(xfer);
+		return -3;
+	}
+
+	defer_ctrl_payload(xfer);
+	slot->xfer = xfer;
+	ctrl_batch.in_flight++;
+	return 0;
+}
+
+// Waits for every queued transfer to complete. Returns a negative value if any of them failed.
+int end_ctrl_batch(void) {
+	wait_ctrl_batch(0);
+
+	Xfer_Entry *xfer = ctrl_batch.failed;
+	if (xfer) {
+		printf(
+			"Control transfer %d (req type = %#x, req = %#x, value = %#x, index = %#x) failed: %s (%d)\n\n",
+			xfer->id, xfer->req_type, xfer->req, xfer->value, xfer->index, libusb_strerror(xfer->res), xfer->res
+		);
+		return -1;
+	}
+
+	return 0;
+}
+
+void destroy_ctrl_batch(void) {
+	for (int i = 0; i < MAX_CTRL_WINDOW; i++) {
+		if (ctrl_batch.slots[i].usb)
+			libusb_free_transfer(ctrl_batch.slots[i].usb);
+
+		free(ctrl_batch.slots[i].buf);
+	}
+
+	memset(&ctrl_batch, 0, sizeof(Ctrl_Batch));
+}
+
+/*
+ * Register watch
+ * Registers are polled from a timerfd with asynchronous reads (consecutive registers share one read),
+ *  keeping up to WATCH_WINDOW reads in flight so that the poll rate isn't limited by the round-trip time.
+ * Every value read goes into a ring of samples that can be saved as CSV afterwards, but only changes are printed.
+ */
+Watch watch = {0};
+
+void add_watch_sample(int reg, u8 value, u64 t_ns) {
+	u32 t_us = (t_ns - watch.t_start) / 1000;
+	Watch_Sample *s = &watch.samples[watch.n_samples++ & (WATCH_RING_LEN - 1)];
+	s->t_us = t_us;
+	s->reg = reg;
+	s->value = value;
+
+	if (watch.known[reg] && watch.last[reg] == value)
+		return;
+
+	const struct Register *r = get_register(reg);
+	char str[256];
+	int decoded = decode_reg(reg, value, str, sizeof(str));
+
+	if (watch.known[reg]) {
+		printf("%10.3f ms  0x%02x %-20s %02x -> %02x  %s\n", t_us / 1000.0, reg, r ? r->str : "", watch.last[reg], value, decoded ? str : "");
+		watch.n_changes++;
+	}
+	else {
+		printf("%10.3f ms  0x%02x %-20s %02x        %s\n", t_us / 1000.0, reg, r ? r->str : "", value, decoded ? str : "");
+	}
+
+	watch.last[reg] = value;
+	watch.known[reg] = 1;
+}
+
+void watch_cb(struct libusb_transfer *usb_xfer) {
+	Watch_Slot *slot = usb_xfer->user_data;
+	u64 now = get_time_ns();
+
+	watch.in_flight--;
+
+	u64 latency = now - slot->t_submit;
+	watch.latency_total += latency;
+	if (latency > watch.latency_max)
+		watch.latency_max = latency;
+
+	int res = get_async_result(usb_xfer);
+	if (res < 0) {
+		watch.n_errors++;
+		watch.last_error = res;
+		return;
+	}
+
+	u8 *data = libusb_control_transfer_get_data(usb_xfer);
+	for (int i = 0; i < res && i < watch.run_len[slot->run]; i++)
+		add_watch_sample(watch.run_start[slot->run] + i, data[i], now);
+}
+
+// Submits one read for each run of consecutive registers, or nothing if there aren't enough free slots for all of them
+int submit_watch_round(void) {
+	if (WATCH_WINDOW - watch.in_flight < watch.n_runs) {
+		watch.n_missed++;
+		return 0;
+	}
+
+	for (int i = 0; i < watch.n_runs; i++) {
+		// reads complete in order, so the slots free up in the same order they were used in
+		Watch_Slot *slot = &watch.slots[watch.next_slot];
+		watch.next_slot = (watch.next_slot + 1) % WATCH_WINDOW;
+
+		if (!slot->usb)
+			slot->usb = libusb_alloc_transfer(0);
+
+		libusb_fill_control_setup(slot->buf, 0xc0, 0, 0, watch.run_start[i], watch.run_len[i]);
+		libusb_fill_control_transfer(slot->usb, dev, slot->buf, watch_cb, slot, XFER_TIMEOUT);
+		slot->run = i;
+		slot->t_submit = get_time_ns();
+
+		int res = io->submit(slot->usb);
+		if (res < 0) {
+			watch.n_errors++;
+			watch.last_error = res;
+			return res;
+		}
+
+		watch.in_flight++;
+		watch.n_polls++;
+	}
+
+	watch.n_rounds++;
+	return 0;
+}
+
+int cmp_u8(const void *a, const void *b) {
+	return *(const u8*)a - *(const u8*)b;
+}
+
+int save_watch_csv(const char *name) {
+	FILE *f = fopen(name, "w");
+	if (!f) {
+		printf("Could not open \"%s\"\n\n", name);
+		return -1;
+	}
+
+	u64 first = watch.n_samples > WATCH_RING_LEN ? watch.n_samples - WATCH_RING_LEN : 0;
+
+	fprintf(f, "time_ms,reg,name,value\n");
+	for (u64 i = first; i < watch.n_samples; i++) {
+		Watch_Sample *s = &watch.samples[i & (WATCH_RING_LEN - 1)];
+		const struct Register *r = get_register(s->reg);
+		fprintf(f, "%.3f,0x%02x,%s,0x%02x\n", s->t_us / 1000.0, s->reg, r ? r->str : "", s->value);
+	}
+
+	fclose(f);
+	printf("Wrote %llu sample(s) to %s\n\n", watch.n_samples - first, name);
+	return 0;
+}
+
+int watch_cmd(int argc, char **args) {
+	if (!strcmp(args[1], "csv")) {
+		if (!watch.samples) {
+			printf("Nothing has been watched yet\n\n");
+			return -1;
+		}
+		return save_watch_csv(args[2]);
+	}
+
+	if (argc < 4) {
+		printf("Expected at least one register, an interval and a duration\n\n");
+		return -1;
+	}
+
+	double interval_ms = atof(args[argc-2]);
+	double secs = atof(args[argc-1]);
+	if (interval_ms <= 0 || secs <= 0) {
+		printf("The interval and duration must be more than 0\n\n");
+		return -2;
+	}
+
+	u8 regs[MAX_WATCH_REGS];
+	int n_regs = 0;
+	for (int i = 1; i < argc - 2; i++) {
+		const struct Register *r = find_register(args[i]);
+		char *end = NULL;
+		long reg = r ? r->index : strtol(args[i], &end, 0);
+		if ((!r && *end) || reg < 0 || reg > 0xff) {
+			printf("Unrecognised register \"%s\"\n\n", args[i]);
+			return -3;
+		}
+		if (n_regs >= MAX_WATCH_REGS) {
+			printf("Only %d registers can be watched at once\n\n", MAX_WATCH_REGS);
+			return -4;
+		}
+		regs[n_regs++] = reg;
+	}
+
+	if (!watch.samples) {
+		watch.samples = malloc(WATCH_RING_LEN * sizeof(Watch_Sample));
+		if (!watch.samples)
+			return -5;
+	}
+
+	// group the registers into runs of consecutive ones
+	qsort(regs, n_regs, 1, cmp_u8);
+	watch.n_runs = 0;
+	for (int i = 0; i < n_regs; i++) {
+		if (i > 0 && regs[i] == regs[i-1])
+			continue;
+
+		int r = watch.n_runs - 1;
+		if (r >= 0 && watch.run_start[r] + watch.run_len[r] == regs[i]) {
+			watch.run_len[r]++;
+		}
+		else {
+			watch.run_start[++r] = regs[i];
+			watch.run_len[r] = 1;
+			watch.n_runs++;
+		}
+	}
+
+	u64 interval_ns = (u64)(interval_ms * 1e6);
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (tfd < 0) {
+		printf("timerfd_create() failed\n\n");
+		return -6;
+	}
+
+	watch.n_samples = 0;
+	watch.n_rounds = watch.n_missed = watch.n_polls = watch.n_errors = watch.n_changes = 0;
+	watch.latency_total = watch.latency_max = 0;
+	watch.last_error = 0;
+	memset(watch.known, 0, sizeof(watch.known));
+
+	watch.t_start = get_time_ns();
+	u64 end = watch.t_start + (u64)(secs * 1e9);
+	u64 n_ticks = 0;
+
+	struct itimerspec its = {
+		.it_interval = {interval_ns / 1000000000ULL, interval_ns % 1000000000ULL},
+		.it_value    = {interval_ns / 1000000000ULL, interval_ns % 1000000000ULL}
+	};
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	// the first round goes out straight away
+	int res = submit_watch_round();
+
+	while (res >= 0 && watch.last_error != LIBUSB_ERROR_NO_DEVICE) {
+		u64 now = get_time_ns();
+		if (now >= end)
+			break;
+
+		u64 next_tick = watch.t_start + (n_ticks + 1) * interval_ns;
+		u64 wait = next_tick > now ? next_tick - now : 0;
+		if (end - now < wait)
+			wait = end - now;
+
+		if (watch.in_flight > 0) {
+			struct timeval tv = {wait / 1000000000ULL, (wait % 1000000000ULL) / 1000};
+			int ev = io->handle_events_timeout(dev, &tv);
+			if (ev < 0 && ev != LIBUSB_ERROR_INTERRUPTED) {
+				printf("libusb_handle_events_timeout() = %d : %s\n\n", ev, libusb_strerror(ev));
+				res = ev;
+				break;
+			}
+		}
+		else {
+			struct pollfd pfd = {.fd = tfd, .events = POLLIN};
+			poll(&pfd, 1, (wait + 999999) / 1000000);
+		}
+
+		u64 expired = 0;
+		if (read(tfd, &expired, sizeof(expired)) != sizeof(expired))
+			continue;
+
+		// a tick that was missed entirely (the timer expired more than once) can't be made up for
+		n_ticks += expired;
+		watch.n_missed += expired - 1;
+		res = submit_watch_round();
+	}
+
+	while (watch.in_flight > 0) {
+		if (io->handle_events(dev) < 0)
+			break;
+	}
+
+	close(tfd);
+
+	double elapsed = (double)(get_time_ns() - watch.t_start) / 1e9;
+	printf(
+		"\n%llu round(s) of %d read(s) in %.3f s: %.1f Hz achieved, %.1f Hz requested, %llu tick(s) missed\n"
+		"%llu error(s)%s%s, latency avg = %.3f ms, max = %.3f ms\n"
+		"%llu change(s), %llu sample(s) kept\n\n",
+		watch.n_rounds, watch.n_runs, elapsed, watch.n_rounds / elapsed, 1000.0 / interval_ms, watch.n_missed,
+		watch.n_errors, watch.last_error ? ", the last being " : "", watch.last_error ? libusb_strerror(watch.last_error) : "",
+		watch.n_polls ? (double)watch.latency_total / watch.n_polls / 1e6 : 0.0, (double)watch.latency_max / 1e6,
+		watch.n_changes, watch.n_samples < WATCH_RING_LEN ? watch.n_samples : WATCH_RING_LEN
+	);
+
+	return res < 0 ? res : 0;
+}
+
+void destroy_watch(void) {
+	for (int i = 0; i < WATCH_WINDOW; i++) {
+		if (watch.slots[i].usb)
+			libusb_free_transfer(watch.slots[i].usb);
+	}
+
+	free(watch.samples);
+	memset(&watch, 0, sizeof(Watch));
+}
+
+Xfer_Entry *data_transfer(int argc, char **args, int type, Data_Xfer func) {
+	u8 endpoint = (u8)strtol(args[1], NULL, 16);
+	u8 *data = NULL;
+	int size;
+
+	if (endpoint & 0x80) {
+		size = strtol(args[2], NULL, 0);
+		data = allocate(size);
+	}
+	else {
+		size = get_out_data(argc, args, 2, &data);
+		if (size < 0)
+			return NULL;
+	}
+
+	Xfer_Entry *xfer = new_transfer(type);
+	xfer->endpoint = endpoint;
+	index_transfer(xfer);
+
+	xfer->size = size;
+	xfer->data = data;
+
+	xfer->t_submit = get_time_ns();
+	func(dev, xfer->endpoint, xfer->data, xfer->size, &xfer->res, XFER_TIMEOUT);
+	complete_transfer(xfer);
+	return xfer;
+}
+
+int int_cmd(int argc, char **args) {
+	return data_transfer(argc, args, TYPE_INT, io->interrupt) ? 0 : -1;
+}
+int bulk(int argc, char **args) {
+	return data_transfer(argc, args, TYPE_BULK, io->bulk) ? 0 : -1;
+}
+
+// the lock outlives each run of thumbs, since the frame sink thread may be about to take it
+Thumb_Writer thumb_writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// the shared-memory ring that frames or isochronous payloads are published to (see publish)
+Shm_Ring publish_ring = {0};
+int publish_kind = 0;
+
+/*
+ * Frame assembly
+ * Packets from the video endpoint start with a 4-byte header when they begin a field (22 5a <field> 00),
+ *  and some chips mark the rest with 88 88 88 88. Bit 0 of <field> is set for the bottom field.
+ * With VBI capture on, a field starts with 33 95 <field> 00 instead, followed by the field's VBI lines
+ *  (VBI_WIDTH x VBI_HEIGHT, see frames()) and then its video, with no header of its own. The VBI is skipped.
+ * The two fields of a frame are woven together line by line into one of a few preallocated frame buffers,
+ *  which a sink thread then writes out, so that a slow sink drops frames instead of holding up the stream.
+ */
+Frame_Assembler frame_asm = {0};
+
+void offer_thumbnail(Thumb_Writer *tw, Frame_Assembler *fa, Frame *frame);
+
+void *frame_sink_thread(void *arg) {
+	Frame_Assembler *fa = arg;
+
+	pthread_mutex_lock(&fa->lock);
+	while (1) {
+		while (fa->ready_head == fa->ready_tail && !fa->stop)
+			pthread_cond_wait(&fa->frame_ready, &fa->lock);
+
+		if (fa->ready_head == fa->ready_tail)
+			break;
+
+		Frame *frame = fa->ready[fa->ready_tail % N_FRAME_BUFS];
+		pthread_mutex_unlock(&fa->lock);
+
+		deinterlace(&fa->deint, frame->data);
+
+		if (fa->sink && fa->rgb) {
+			u64 t = get_time_ns();
+			convert_to_rgb(fa->format, frame->data, fa->rgb, fa->width * fa->height);
+			fa->convert_ns += get_time_ns() - t;
+
+			fwrite(fa->rgb, 3, fa->width * fa->height, fa->sink);
+			fflush(fa->sink);
+		}
+		else if (fa->sink) {
+			fwrite(frame->data, 1, fa->frame_size, fa->sink);
+			fflush(fa->sink);
+		}
+		u64 latency = get_time_ns() - frame->t_done;
+
+		if (thumb_writer.running && frame->seq % thumb_writer.every == 0)
+			offer_thumbnail(&thumb_writer, fa, frame);
+
+		pthread_mutex_lock(&fa->lock);
+		fa->ready_tail++;
+		fa->free_list[fa->n_free++] = frame;
+
+		fa->n_delivered++;
+		fa->latency_total += latency;
+		if (latency > fa->latency_max)
+			fa->latency_max = latency;
+	}
+	pthread_mutex_unlock(&fa->lock);
+
+	return NULL;
+}
+
+// Ends the frame being assembled, either handing it to the sink or (if any of it is missing) throwing it away
+void finish_frame(Frame_Assembler *fa, int complete, u64 t) {
+	Frame *frame = fa->cur;
+	fa->cur = NULL;
+	fa->field = -1;
+	if (!frame)
+		return;
+
+	pthread_mutex_lock(&fa->lock);
+	if (complete && !fa->damaged) {
+		// straight from the isoc completion path, so published frames are woven: deinterlacing happens on the sink thread
+		if (publish_kind == SHM_RING_FRAMES)
+			shm_ring_publish(&publish_ring, frame->data, fa->frame_size, t);
+
+		frame->t_done = t;
+		frame->seq = fa->n_frames++;
+		fa->ready[fa->ready_head++ % N_FRAME_BUFS] = frame;
+		pthread_cond_signal(&fa->frame_ready);
+	}
+	else {
+		fa->n_incomplete++;
+		fa->free_list[fa->n_free++] = frame;
+	}
+	pthread_mutex_unlock(&fa->lock);
+}
+
+void start_field(Frame_Assembler *fa, int field, u64 t) {
+	if (fa->cur && (fa->field != 0 || fa->field_pos != fa->field_size))
+		finish_frame(fa, 0, t);
+
+	if (field == 1) {
+		// a bottom field only counts if it follows a whole top field
+		if (fa->cur) {
+			fa->field = 1;
+			fa->field_pos = 0;
+		}
+		return;
+	}
+
+	if (fa->cur)
+		finish_frame(fa, 0, t);
+
+	pthread_mutex_lock(&fa->lock);
+	if (fa->n_free > 0)
+		fa->cur = fa->free_list[--fa->n_free];
+	else
+		fa->n_dropped++;
+	pthread_mutex_unlock(&fa->lock);
+
+	fa->field = fa->cur ? 0 : -1;
+	fa->field_pos = 0;
+	fa->damaged = 0;
+}
+
+// Copies field data into every other line of the frame
+void copy_field_data(Frame_Assembler *fa, u8 *data, int len, u64 t) {
+	if (!fa->cur)
+		return;
+
+	if (fa->field_pos + len > fa->field_size) {
+		fa->damaged = 1;
+		len = fa->field_size - fa->field_pos;
+	}
+
+	while (len > 0) {
+		int line = fa->field_pos / fa->line_size;
+		int x = fa->field_pos % fa->line_size;
+		int chunk = fa->line_size - x;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(fa->cur->data + (2 * line + fa->field) * fa->line_size + x, data, chunk);
+
+		data += chunk;
+		len -= chunk;
+		fa->field_pos += chunk;
+	}
+
+	if (fa->field == 1 && fa->field_pos == fa->field_size)
+		finish_frame(fa, 1, t);
+}
+
+void assemble_packet(Frame_Assembler *fa, u8 *p, int len, int status, u64 t) {
+	fa->n_pkts++;
+	if (status != 0) {
+		fa->damaged = 1;
+		return;
+	}
+
+	if (len >= 4) {
+		if (p[0] == 0x88 && p[1] == 0x88 && p[2] == 0x88 && p[3] == 0x88) {
+			p += 4;
+			len -= 4;
+		}
+		else if ((p[0] == 0x22 && p[1] == 0x5a) || (p[0] == 0x33 && p[1] == 0x95)) {
+			start_field(fa, p[2] & 1, t);
+			fa->vbi_left = p[0] == 0x33 ? fa->vbi_size : 0;
+			p += 4;
+			len -= 4;
+
+			// without knowing how much VBI there is, there's no telling where the video starts
+			if (fa->vbi_left < 0) {
+				fa->damaged = 1;
+				fa->field = -1;
+			}
+		}
+	}
+
+	if (fa->vbi_left > 0) {
+		int skip = len < fa->vbi_left ? len : fa->vbi_left;
+		fa->vbi_left -= skip;
+		p += skip;
+		len -= skip;
+	}
+
+	if (fa->field >= 0 && len > 0)
+		copy_field_data(fa, p, len, t);
+}
+
+void assemble_transfer(Frame_Assembler *fa, Xfer_Entry *xfer) {
+	if (!xfer->pkts || !(xfer->endpoint & 0x80))
+		return;
+
+	u8 *p = xfer->data;
+	for (int i = 0; i < xfer->n_pkts; i++) {
+		int len = xfer->pkts[i].length;
+		assemble_packet(fa, p, len, xfer->pkts[i].status, xfer->t_complete);
+		p += len;
+	}
+}
+
+void print_frame_stats(Frame_Assembler *fa) {
+	pthread_mutex_lock(&fa->lock);
+	printf(
+		"%llu frame(s) delivered, %llu dropped (sink too slow), %llu incomplete, latency avg = %.3f ms, max = %.3f ms\n",
+		fa->n_delivered, fa->n_dropped, fa->n_incomplete,
+		fa->n_delivered ? (double)fa->latency_total / fa->n_delivered / 1e6 : 0.0, (double)fa->latency_max / 1e6
+	);
+	if (fa->deint.n_frames) {
+		printf(
+			"Deinterlacing (%s, %s): avg = %.3f ms, max = %.3f ms per frame\n", deint_names[fa->deint.mode], simd_names[get_simd_level()],
+			(double)fa->deint.total_ns / fa->deint.n_frames / 1e6, (double)fa->deint.max_ns / 1e6
+		);
+	}
+	if (fa->rgb && fa->sink && fa->n_delivered)
+		printf("RGB conversion (%s): %.3f ms per frame\n", simd_names[get_simd_level()], (double)fa->convert_ns / fa->n_delivered / 1e6);
+	printf("\n");
+	pthread_mutex_unlock(&fa->lock);
+}
+
+void stop_frames(Frame_Assembler *fa) {
+	pthread_mutex_lock(&fa->lock);
+	fa->stop = 1;
+	pthread_cond_signal(&fa->frame_ready);
+	pthread_mutex_unlock(&fa->lock);
+
+	pthread_join(fa->thread, NULL);
+	print_frame_stats(fa);
+
+	if (fa->is_pipe)
+		pclose(fa->sink);
+	else if (fa->sink && fa->sink != stdout)
+		fclose(fa->sink);
+
+	for (int i = 0; i < N_FRAME_BUFS; i++)
+		free(fa->frames[i].data);
+	free(fa->rgb);
+	free_deinterlacer(&fa->deint);
+
+	pthread_mutex_destroy(&fa->lock);
+	pthread_cond_destroy(&fa->frame_ready);
+	memset(fa, 0, sizeof(Frame_Assembler));
+}
+
+int frames(int argc, char **args) {
+	Frame_Assembler *fa = &frame_asm;
+	if (argc < 2) {
+		if (fa->running)
+			print_frame_stats(fa);
+		else
+			printf("Not assembling frames\n\n");
+
+		return 0;
+	}
+
+	if (fa->running)
+		stop_frames(fa);
+
+	if (!strcmp(args[1], "off"))
+		return 0;
+
+	// after the sink comes the width then height, and a format, deinterlacing mode and/or "rgb" anywhere
+	int width = 720, height = 576, n_dims = 0;
+	int format = -1, rgb = 0, deint = DEINT_WEAVE;
+	for (int i = 2; i < argc; i++) {
+		int fmt = get_video_format(args[i]);
+		int mode = get_deinterlace_mode(args[i]);
+		if (fmt >= 0)
+			format = fmt;
+		else if (mode >= 0)
+			deint = mode;
+		else if (!strcmp(args[i], "rgb"))
+			rgb = 1;
+		else if (n_dims++ == 0)
+			width = strtol(args[i], NULL, 0);
+		else
+			height = strtol(args[i], NULL, 0);
+	}
+
+	if (width <= 0 || height <= 0 || height % 2 || width % 4) {
+		printf("Invalid frame size %dx%d\n\n", width, height);
+		return -1;
+	}
+
+	// As the Linux driver sets them, VBI_WIDTH is in units of 4 bytes and VBI_HEIGHT in units of 2 lines per field.
+	// Each field carries that much VBI first when the card has VBI turned on (see assemble_packet()).
+	u8 vbi_dims[2];
+	int vbi_size = -1;
+	if (io->control(dev, 0xc0, 0, 0, 54, vbi_dims, 2, XFER_TIMEOUT) == 2)
+		vbi_size = vbi_dims[0] * 4 * vbi_dims[1] * 2;
+
+	// otherwise, go by what the card has been set up to send
+	if (format < 0) {
+		u8 v_in_mode = 0, out_format = 0;
+		io->control(dev, 0xc0, 0, 0, 0x10, &v_in_mode, 1, XFER_TIMEOUT);
+		io->control(dev, 0xc0, 0, 0, 0x27, &out_format, 1, XFER_TIMEOUT);
+
+		format = get_video_format_from_regs(v_in_mode, out_format);
+		if (format < 0)
+			format = FMT_YUYV;
+	}
+
+	if (format == FMT_RGB565 && deint != DEINT_WEAVE) {
+		printf("RGB565 frames can only be woven\n\n");
+		return -1;
+	}
+
+	// a command with spaces in it has to be quoted
+	char *name = args[1];
+	if (name[0] == '\"') {
+		name++;
+		int len = strlen(name);
+		if (len > 0 && name[len-1] == '\"')
+			name[len-1] = 0;
+	}
+
+	if (!strcmp(name, "none")) {
+		fa->sink = NULL;
+	}
+	else if (!strcmp(name, "-")) {
+		fa->sink = stdout;
+	}
+	else if (name[0] == '|') {
+		fa->sink = popen(name + 1, "w");
+		fa->is_pipe = 1;
+	}
+	else {
+		fa->sink = fopen(name, "wb");
+	}
+
+	if (!fa->sink && strcmp(name, "none")) {
+		printf("Could not open frame sink \"%s\"\n\n", name);
+		memset(fa, 0, sizeof(Frame_Assembler));
+		return -2;
+	}
+
+	fa->width = width;
+	fa->height = height;
+	fa->format = format;
+	fa->line_size = video_line_size(format, width);
+	fa->field_size = fa->line_size * height / 2;
+	fa->frame_size = fa->field_size * 2;
+	fa->field = -1;
+	fa->vbi_size = vbi_size;
+	fa->running = 1;
+
+	for (int i = 0; i < N_FRAME_BUFS; i++) {
+		fa->frames[i].data = malloc(fa->frame_size);
+		fa->free_list[i] = &fa->frames[i];
+	}
+	fa->n_free = N_FRAME_BUFS;
+
+	if (rgb)
+		fa->rgb = malloc(width * height * 3);
+
+	if (init_deinterlacer(&fa->deint, deint, fa->line_size, height, DEFAULT_MOTION_THRESHOLD) < 0) {
+		printf("Could not set up %s deinterlacing, weaving instead\n", deint_names[deint]);
+		fa->deint.mode = DEINT_WEAVE;
+	}
+
+	pthread_mutex_init(&fa->lock, NULL);
+	pthread_cond_init(&fa->frame_ready, NULL);
+	pthread_create(&fa->thread, NULL, frame_sink_thread, fa);
+
+	if (fa->sink != stdout)
+		printf(
+			"Assembling %dx%d %s frames from isochronous IN transfers into \"%s\"%s\n\n",
+			width, height, video_formats[format].name, name, rgb ? " as RGB" : ""
+		);
+
+	return 0;
+}
+
+/*
+ * Thumbnails
+ * Every so many frames, the frame sink thread hands a copy of a frame to a thread which converts it to RGB
+ *  and writes a scaled-down PPM. If that thread is still busy with the last one, the frame is skipped.
+ */
+void *thumb_thread(void *arg) {
+	Thumb_Writer *tw = arg;
+
+	pthread_mutex_lock(&tw->lock);
+	while (1) {
+		while (!tw->busy && !tw->stop)
+			pthread_cond_wait(&tw->cond, &tw->lock);
+
+		if (!tw->busy)
+			break;
+
+		pthread_mutex_unlock(&tw->lock);
+
+		convert_to_rgb(tw->format, tw->frame, tw->rgb, tw->width * tw->height);
+
+		char name[300];
+		snprintf(name, sizeof(name), "%s%06d.ppm", tw->prefix, tw->seq);
+		int res = write_ppm(name, tw->rgb, tw->width, tw->height, tw->step);
+
+		pthread_mutex_lock(&tw->lock);
+		if (res == 0)
+			tw->n_written++;
+		tw->busy = 0;
+	}
+	pthread_mutex_unlock(&tw->lock);
+
+	return NULL;
+}
+
+void offer_thumbnail(Thumb_Writer *tw, Frame_Assembler *fa, Frame *frame) {
+	pthread_mutex_lock(&tw->lock);
+	if (!tw->running) {
+		pthread_mutex_unlock(&tw->lock);
+		return;
+	}
+	if (tw->busy) {
+		tw->n_skipped++;
+		pthread_mutex_unlock(&tw->lock);
+		return;
+	}
+
+	// the buffers only change size when frames is restarted with a different size or format.
+	// The RGB size doesn't follow from the frame size, since formats differ in bytes per pixel
+	if (tw->frame_cap < fa->frame_size) {
+		tw->frame = realloc(tw->frame, fa->frame_size);
+		tw->frame_cap = fa->frame_size;
+	}
+	if (tw->rgb_cap < fa->width * fa->height * 3) {
+		tw->rgb = realloc(tw->rgb, fa->width * fa->height * 3);
+		tw->rgb_cap = fa->width * fa->height * 3;
+	}
+
+	memcpy(tw->frame, frame->data, fa->frame_size);
+	tw->format = fa->format;
+	tw->width = fa->width;
+	tw->height = fa->height;
+	tw->seq = frame->seq;
+	tw->busy = 1;
+
+	pthread_cond_signal(&tw->cond);
+	pthread_mutex_unlock(&tw->lock);
+}
+
+void stop_thumbs(Thumb_Writer *tw) {
+	pthread_mutex_lock(&tw->lock);
+	tw->running = 0;
+	tw->stop = 1;
+	pthread_cond_signal(&tw->cond);
+	pthread_mutex_unlock(&tw->lock);
+
+	pthread_join(tw->thread, NULL);
+	printf("%llu thumbnail(s) written, %llu skipped\n\n", tw->n_written, tw->n_skipped);
+
+	free(tw->frame);
+	free(tw->rgb);
+	tw->frame = tw->rgb = NULL;
+	tw->frame_cap = tw->rgb_cap = 0;
+	tw->stop = 0;
+	tw->n_written = tw->n_skipped = 0;
+}
+
+int thumbs(int argc, char **args) {
+	Thumb_Writer *tw = &thumb_writer;
+	if (argc < 2) {
+		if (tw->running)
+			printf("%llu thumbnail(s) written, %llu skipped\n\n", tw->n_written, tw->n_skipped);
+		else
+			printf("Not writing thumbnails\n\n");
+
+		return 0;
+	}
+
+	if (tw->running)
+		stop_thumbs(tw);
+
+	if (!strcmp(args[1], "off"))
+		return 0;
+
+	int every = argc > 2 ? strtol(args[2], NULL, 0) : DEFAULT_THUMB_INTERVAL;
+	int step = argc > 3 ? strtol(args[3], NULL, 0) : DEFAULT_THUMB_STEP;
+	if (every <= 0 || step <= 0) {
+		printf("Invalid thumbnail interval or scale\n\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&tw->lock);
+	snprintf(tw->prefix, sizeof(tw->prefix), "%s", args[1]);
+	tw->every = every;
+	tw->step = step;
+	tw->running = 1;
+	pthread_mutex_unlock(&tw->lock);
+
+	pthread_create(&tw->thread, NULL, thumb_thread, tw);
+
+	printf("Writing every %dth assembled frame to %s<frame>.ppm at 1/%d scale (conversion uses %s)\n\n", every, tw->prefix, step, simd_names[get_simd_level()]);
+	return 0;
+}
+
+/*
+ * Publishes whole frames (from frames) or the payload of each isochronous IN transfer into a shared-memory ring,
+ *  which any number of other processes can read from without copying or holding up the stream (see shm_ring.h).
+ */
+int publish(int argc, char **args) {
+	if (argc < 2) {
+		if (publish_kind)
+			printf("%llu message(s) published to %s\n\n", publish_ring.next, publish_ring.name);
+		else
+			printf("Not publishing\n\n");
+
+		return 0;
+	}
+
+	if (publish_kind) {
+		printf("%llu message(s) published to %s\n\n", publish_ring.next, publish_ring.name);
+		publish_kind = 0;
+		shm_ring_close(&publish_ring);
+	}
+
+	if (!strcmp(args[1], "off"))
+		return 0;
+
+	if (argc < 3) {
+		printf("Expected either frames or raw after the ring name\n\n");
+		return -1;
+	}
+
+	int kind, slot_size, n_slots;
+	if (!strcmp(args[2], "frames")) {
+		if (!frame_asm.running) {
+			printf("Frames are not being assembled (see frames)\n\n");
+			return -2;
+		}
+
+		kind = SHM_RING_FRAMES;
+		slot_size = frame_asm.frame_size;
+		n_slots = argc > 3 ? strtol(args[3], NULL, 0) : DEFAULT_PUBLISH_SLOTS;
+	}
+	else if (!strcmp(args[2], "raw")) {
+		if (argc < 4) {
+			printf("Expected a slot size (the largest transfer to publish)\n\n");
+			return -3;
+		}
+
+		kind = SHM_RING_RAW;
+		slot_size = strtol(args[3], NULL, 0);
+		n_slots = argc > 4 ? strtol(args[4], NULL, 0) : DEFAULT_PUBLISH_SLOTS;
+	}
+	else {
+		printf("Unrecognised message type \"%s\" (expected frames or raw)\n\n", args[2]);
+		return -4;
+	}
+
+	// POSIX shared memory names start with a slash
+	char name[64];
+	snprintf(name, sizeof(name), "%s%s", args[1][0] == '/' ? "" : "/", args[1]);
+
+	int width = kind == SHM_RING_FRAMES ? frame_asm.line_size / 2 : 0;
+	int height = kind == SHM_RING_FRAMES ? frame_asm.frame_size / frame_asm.line_size : 0;
+
+	int res = shm_ring_create(&publish_ring, name, kind, n_slots, slot_size, width, height);
+	if (res < 0) {
+		printf("Could not create shared-memory ring %s with %d slot(s) of %d bytes (%d)\n\n", name, n_slots, slot_size, res);
+		return -5;
+	}
+
+	publish_kind = kind;
+	printf("Publishing %s to %s (%d slots of %d bytes)\n\n", args[2], name, n_slots, slot_size);
+	return 0;
+}
+
+Isoc_Ring isoc_chain[ISOC_RING_LEN] = {NULL};
+Isoc_Ring *head_isoc = NULL;
+
+Isoc_Stream isoc_stream = {0};
+
+void setup_isoc_ring(int n_pkts) {
+	for (int i = 0; i < ISOC_RING_LEN; i++) {
+		int needs_realloc = isoc_chain[i].usb && isoc_chain[i].usb->num_iso_packets != n_pkts;
+		if (!isoc_chain[i].usb || needs_realloc) {
+			if (needs_realloc)
+				libusb_free_transfer(isoc_chain[i].usb);
+
+			isoc_chain[i].usb = libusb_alloc_transfer(n_pkts);
+
+			isoc_chain[i].next = i == ISOC_RING_LEN-1 ? &isoc_chain[0] : &isoc_chain[i+1];
+		}
+	}
+	if (!head_isoc)
+		head_isoc = &isoc_chain[0];
+}
+
+int submit_isoc(Isoc_Ring *slot) {
+	Isoc_Stream *stream = &isoc_stream;
+	struct libusb_transfer *usb_xfer = slot->usb;
+
+	Xfer_Entry *xfer = new_transfer(TYPE_ISOC);
+	xfer->endpoint = stream->endpoint;
+	xfer->n_pkts   = stream->n_pkts;
+	xfer->pkt_sz   = stream->pkt_sz;
+	index_transfer(xfer);
+
+	xfer->size = xfer->n_pkts * xfer->pkt_sz;
+
+	// outgoing transfers all send the same (read-only) payload
+	u8 *buf = stream->out_data;
+	if (stream->out_data) {
+		xfer->data = stream->out_data;
+	}
+	else {
+		if (slot->buf_size < xfer->size) {
+			slot->buf = realloc(slot->buf, xfer->size);
+			slot->buf_size = xfer->size;
+		}
+		buf = slot->buf;
+	}
+
+	slot->xfer = xfer;
+	libusb_fill_iso_transfer(usb_xfer, dev, xfer->endpoint, buf, xfer->size, xfer->n_pkts, isoc_cb, slot, XFER_TIMEOUT);
+	libusb_set_iso_packet_lengths(usb_xfer, xfer->pkt_sz);
+
+	xfer->t_submit = get_time_ns();
+	int res = io->submit(usb_xfer);
+	if (res < 0) {
+		printf("libusb_submit_transfer() = %d : %s\n\n", res, libusb_strerror(res));
+		xfer->res = res;
+		complete_transfer(xfer);
+		stream->error = res;
+		return res;
+	}
+
+	stream->n_submitted++;
+	stream->in_flight++;
+	return 0;
+}
+
+/*
+ * Keeps the length and status of every packet, and for IN transfers, packs the packets' data together
+ *  into a payload of exactly the bytes received, so that the transfer's own buffer can be reused.
+ * The packet copies are memcpy()s, which are vectorised, and the gaps between packets are never touched.
+ */
+void get_isoc_result(Xfer_Entry *xfer, struct libusb_transfer *usb_xfer) {
+	int total = usb_xfer->num_iso_packets;
+	int size = 0, errors = 0;
+	struct libusb_iso_packet_descriptor *pk = &usb_xfer->iso_packet_desc[0];
+
+	Iso_Packet *pkts = allocate(total * sizeof(Iso_Packet));
+	for (int i = 0; i < total; i++, pk++) {
+		size += pk->actual_length;
+		if (pk->status != 0)
+			errors++;
+
+		if (pkts) {
+			pkts[i].length = pk->actual_length;
+			pkts[i].status = pk->status;
+		}
+	}
+	xfer->pkts = pkts;
+
+	if (usb_xfer->endpoint & 0x80) {
+		u8 *dst = xfer->data = allocate(size);
+		u8 *src = usb_xfer->buffer;
+
+		pk = &usb_xfer->iso_packet_desc[0];
+		for (int i = 0; i < total && dst; i++, pk++) {
+			memcpy(dst, src, pk->actual_length);
+			dst += pk->actual_length;
+			src += pk->length;
+		}
+	}
+
+	// a payload that couldn't be stored is logged as empty
+	xfer->size = xfer->data ? size : 0;
+	xfer->res = usb_xfer->status == LIBUSB_TRANSFER_COMPLETED ? size : get_async_result(usb_xfer);
+	xfer->n_errors = errors;
+}
+
+void isoc_cb(struct libusb_transfer *usb_xfer) {
+	Isoc_Ring *slot = usb_xfer->user_data;
+	Xfer_Entry *xfer = slot->xfer;
+	get_isoc_result(xfer, usb_xfer);
+	complete_transfer(xfer);
+
+	if (frame_asm.running)
+		assemble_transfer(&frame_asm, xfer);
+	if (publish_kind == SHM_RING_RAW && (xfer->endpoint & 0x80) && xfer->data)
+		shm_ring_publish(&publish_ring, xfer->data, xfer->size, xfer->t_complete);
+
+	//printf("isoc_cb() : Success rate = %d / %d\n", n, total);
+
+	Isoc_Stream *stream = &isoc_stream;
+	stream->in_flight--;
+
+	if (xfer->res < 0 && !stream->error)
+		stream->error = xfer->res;
+
+	// keep the queue full by resubmitting this (now free) transfer
+	if (stream->n_submitted < stream->count && !stream->error)
+		submit_isoc(slot);
+}
+
+/*
+ * Issues <count> isochronous transfers of <n_pkts> x <pkt_sz> bytes, keeping <depth> of them in flight.
+ * If out_data is NULL, the endpoint is read from, otherwise every transfer sends the contents of out_data.
+ * Returns 0 if every transfer completed, or the first error.
+ */
+int stream_isoc(u8 endpoint, int n_pkts, int pkt_sz, int depth, int count, u8 *out_data) {
+	// every transfer's payload has to fit in one of the log's buckets
+	if (n_pkts <= 0 || pkt_sz <= 0 || (long long)n_pkts * pkt_sz > BUCKET_SIZE) {
+		printf("Isochronous transfers are limited to %d bytes (packet count x packet size)\n\n", BUCKET_SIZE);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if (depth < 1)
+		depth = 1;
+	if (depth > ISOC_RING_LEN)
+		depth = ISOC_RING_LEN;
+
+	setup_isoc_ring(n_pkts);
+
+	Isoc_Stream *stream = &isoc_stream;
+	memset(stream, 0, sizeof(Isoc_Stream));
+	stream->endpoint = endpoint;
+	stream->n_pkts   = n_pkts;
+	stream->pkt_sz   = pkt_sz;
+	stream->count    = count;
+	stream->out_data = out_data;
+
+	for (int i = 0; i < depth && i < count; i++) {
+		if (submit_isoc(head_isoc) < 0)
+			break;
+
+		head_isoc = head_isoc->next;
+	}
+
+	while (stream->in_flight > 0) {
+		int res = io->handle_events(dev);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			printf("libusb_handle_events() = %d : %s\n\n", res, libusb_strerror(res));
+			return res;
+		}
+	}
+
+	return stream->error;
+}
+
+int isoc(int argc, char **args) {
+	u8 endpoint = strtol(args[1], NULL, 16);
+	int n_pkts  = strtol(args[2], NULL, 0);
+	int pkt_sz  = strtol(args[3], NULL, 0);
+	u8 *out_data = NULL;
+
+	if ((endpoint & 0x80) == 0) {
+		if (argc < 5) {
+			printf("Input file or array required for sending data w/ isochronous transfer\n");
+			return -1;
+		}
+
+		int size = n_pkts * pkt_sz;
+		out_data = allocate(size);
+		if (!out_data) {
+			printf("Isochronous transfers are limited to %d bytes (packet count x packet size)\n\n", BUCKET_SIZE);
+			return -3;
+		}
+
+		int sz = read_file(args[4], &out_data, size, NULL);
+		if (sz <= 0)
+			sz = parse_byte_array(argc, args, 4, &out_data, size, NULL);
+		if (sz < 0)
+			return -2;
+
+		if (sz < size)
+			memset(out_data + sz, 0, size - sz);
+	}
+
+	int res = stream_isoc(endpoint, n_pkts, pkt_sz, 1, 1, out_data);
+	return res < 0 ? res : 0;
+}
+
+int stream(int argc, char **args) {
+	u8 endpoint = strtol(args[1], NULL, 16);
+	int n_pkts  = strtol(args[2], NULL, 0);
+	int pkt_sz  = strtol(args[3], NULL, 0);
+	int depth   = strtol(args[4], NULL, 0);
+	int count   = strtol(args[5], NULL, 0);
+
+	if ((endpoint & 0x80) == 0) {
+		printf("The stream command only reads from IN endpoints\n\n");
+		return -1;
+	}
+
+	int first = n_xfers;
+	int res = stream_isoc(endpoint, n_pkts, pkt_sz, depth, count, NULL);
+	if (res == LIBUSB_ERROR_INVALID_PARAM)
+		return res;
+
+	u64 bytes = 0;
+	int pkt_errors = 0;
+	for (int i = first; i < n_xfers; i++) {
+		Xfer_Entry *xfer = get_transfer(i);
+		if (xfer->res > 0)
+			bytes += xfer->res;
+		pkt_errors += xfer->n_errors;
+	}
+
+	Xfer_Entry *a = get_transfer(first), *b = get_transfer(n_xfers - 1);
+	double secs = a ? (double)(b->t_complete - a->t_submit) / 1e9 : 0;
+
+	printf(
+		"%d transfer(s), %llu bytes in %.3f s (%.3f MB/s), %d packet error(s)\n\n",
+		n_xfers - first, bytes, secs, secs > 0 ? bytes / secs / 1000000.0 : 0.0, pkt_errors
+	);
+
+	return res < 0 ? res : 0;
+}
+
+/*
+ * Devices
+ * dev and io always refer to the device chosen with "use". Every open device keeps its own handle, libusb context,
+ *  claimed interface, register shadow and capture ring, so that capture can stream from all of them at once, one thread per device.
+ * Everything else (the isoc ring used by isoc and stream, control batches, replay) is shared, and only ever talks to the current device.
+ */
+Device devices[MAX_DEVICES];
+int n_devices = 0;
+int cur_device = 0;
+
+u16 vendor_id = EMU_VENDOR;
+u16 product_id = EMU_PRODUCT;
+
+int emu_rate = EMU_PKT_RATE;
+int emu_error_interval = 0;
+
+// Writes the bus number and port path of a device, eg. "1-1.4"
+void get_device_path(libusb_device *udev, char *buf, int size) {
+	u8 ports[8];
+	int n_ports = libusb_get_port_numbers(udev, ports, 8);
+	int len = snprintf(buf, size, "%d-", libusb_get_bus_number(udev));
+
+	for (int i = 0; i < n_ports && len < size; i++)
+		len += snprintf(buf + len, size - len, i ? ".%d" : "%d", ports[i]);
+}
+
+int find_open_device(const char *path) {
+	for (int i = 0; i < n_devices; i++) {
+		if (!strcmp(devices[i].path, path))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Calls visit() for every attached device with the shell's vendor and product ids, with the device opened.
+ * If visit() returns non-zero, the search stops and the device is left open in *handle.
+ */
+int find_devices(libusb_context *ctx, int (*visit)(const char*, const char*, void*), void *arg, struct libusb_device_handle **handle) {
+	libusb_device **list;
+	int n = libusb_get_device_list(ctx, &list);
+	int found = 0;
+
+	for (int i = 0; i < n && !found; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != vendor_id || desc.idProduct != product_id)
+			continue;
+
+		char path[32], serial[64] = "";
+		get_device_path(list[i], path, sizeof(path));
+
+		struct libusb_device_handle *h = NULL;
+		if (libusb_open(list[i], &h) == 0 && desc.iSerialNumber)
+			libusb_get_string_descriptor_ascii(h, desc.iSerialNumber, (u8*)serial, sizeof(serial));
+
+		found = visit(path, serial, arg);
+		if (found && handle)
+			*handle = h;
+		else if (h)
+			libusb_close(h);
+	}
+
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+
+	return found;
+}
+
+int match_device(const char *path, const char *serial, void *arg) {
+	const char *selector = arg;
+	if (find_open_device(path) >= 0)
+		return 0;
+
+	if (!selector || !strcmp(selector, path) || (serial[0] && !strcmp(selector, serial))) {
+		Device *d = &devices[n_devices];
+		snprintf(d->path, sizeof(d->path), "%s", path);
+		snprintf(d->serial, sizeof(d->serial), "%s", serial);
+		return 1;
+	}
+
+	return 0;
+}
+
+int print_device(const char *path, const char *serial, void *arg) {
+	int idx = find_open_device(path);
+	printf("  %-12s serial = %s", path, serial[0] ? serial : "(unknown)");
+	if (idx >= 0)
+		printf(" (open as %d)", idx);
+
+	putchar('\n');
+	return 0;
+}
+
+/*
+ * Opens another device, either an emulated one ("emu") or the first attached device that matches the selector
+ *  (a bus-port path or a serial number). A NULL selector picks the first attached device that isn't already open.
+ * Returns the device's index.
+ */
+int add_device(const char *selector) {
+	if (n_devices >= MAX_DEVICES)
+		return -1;
+
+	Device *d = &devices[n_devices];
+	memset(d, 0, sizeof(Device));
+	d->iface = -1;
+	d->reg_read_size = REG_READ_SIZE;
+
+	if (selector && !strcmp(selector, "emu")) {
+		d->io = &emu_transport;
+		d->handle = emu_open(emu_rate);
+		((Emu_Device*)d->handle)->error_interval = emu_error_interval;
+		snprintf(d->path, sizeof(d->path), "emu%d", n_devices);
+		return n_devices++;
+	}
+
+	if (libusb_init(&d->ctx) < 0)
+		return -2;
+
+	if (!find_devices(d->ctx, match_device, (void*)selector, &d->handle) || !d->handle) {
+		libusb_exit(d->ctx);
+		return -3;
+	}
+
+	d->io = &libusb_transport;
+	set_transport_context(d->handle, d->ctx);
+	return n_devices++;
+}
+
+void use_device(int idx) {
+	devices[cur_device].iface = prev_iface;
+
+	cur_device = idx;
+	dev = devices[idx].handle;
+	io = devices[idx].io;
+	prev_iface = devices[idx].iface;
+	shadow = &devices[idx].shadow;
+	reg_read_size = &devices[idx].reg_read_size;
+}
+
+void close_devices(void) {
+	devices[cur_device].iface = prev_iface;
+
+	for (int i = 0; i < n_devices; i++) {
+		Device *d = &devices[i];
+		if (d->iface >= 0)
+			d->io->release_interface(d->handle, d->iface);
+
+		d->io->close(d->handle);
+		if (d->ctx)
+			libusb_exit(d->ctx);
+	}
+
+	n_devices = 0;
+}
+
+int list_devices(int argc, char **args) {
+	printf("Open devices:\n");
+	for (int i = 0; i < n_devices; i++) {
+		printf("%c %2d : %s", i == cur_device ? '*' : ' ', i, devices[i].path);
+		if (devices[i].serial[0])
+			printf(", serial = %s", devices[i].serial);
+		putchar('\n');
+	}
+
+	printf("\nAttached %04x:%04x devices:\n", vendor_id, product_id);
+
+	libusb_context *ctx;
+	if (libusb_init(&ctx) == 0) {
+		find_devices(ctx, print_device, NULL, NULL);
+		libusb_exit(ctx);
+	}
+
+	putchar('\n');
+	return 0;
+}
+
+int open_dev(int argc, char **args) {
+	int idx = add_device(args[1]);
+	if (idx < 0) {
+		printf("Could not open device \"%s\"\n\n", args[1]);
+		return -1;
+	}
+
+	printf("Opened %s as device %d\n\n", devices[idx].path, idx);
+	return 0;
+}
+
+int use_dev(int argc, char **args) {
+	int idx = strtol(args[1], NULL, 0);
+	if (idx < 0 || idx >= n_devices) {
+		printf("There is no device %d (see \"devices\")\n\n", idx);
+		return -1;
+	}
+
+	use_device(idx);
+	return 0;
+}
+
+// Runs on the capture thread of the device that the transfer belongs to
+void capture_cb(struct libusb_transfer *usb_xfer) {
+	Device *d = usb_xfer->user_data;
+	d->in_flight--;
+	d->n_xfers++;
+
+	if (usb_xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		d->n_xfer_errors++;
+		if (!d->error)
+			d->error = get_async_result(usb_xfer);
+		return;
+	}
+
+	u8 *buf = usb_xfer->buffer;
+	for (int i = 0; i < usb_xfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *pk = &usb_xfer->iso_packet_desc[i];
+		if (pk->status != 0) {
+			d->n_pkt_errors++;
+		}
+		else if (pk->actual_length > 0) {
+			d->bytes += pk->actual_length;
+			if (d->sink)
+				fwrite(buf, 1, pk->actual_length, d->sink);
+		}
+
+		buf += pk->length;
+	}
+
+	if (d->error || get_time_ns() >= d->t_stop)
+		return;
+
+	int res = d->io->submit(usb_xfer);
+	if (res < 0)
+		d->error = res;
+	else
+		d->in_flight++;
+}
+
+void *capture_thread(void *arg) {
+	Device *d = arg;
+	int xfer_size = d->n_pkts * d->pkt_sz;
+
+	int n_filled = 0;
+
+	for (; n_filled < d->depth; n_filled++) {
+		struct libusb_transfer *usb_xfer = d->ring[n_filled];
+		libusb_fill_iso_transfer(usb_xfer, d->handle, d->endpoint, d->ring_buf + n_filled * xfer_size, xfer_size, d->n_pkts, capture_cb, d, XFER_TIMEOUT);
+		libusb_set_iso_packet_lengths(usb_xfer, d->pkt_sz);
+
+		int res = d->io->submit(usb_xfer);
+		if (res < 0) {
+			d->error = res;
+			break;
+		}
+		d->in_flight++;
+	}
+
+	while (d->in_flight > 0) {
+		struct timeval tv = {0, 100000};
+		int res = d->io->handle_events_timeout(d->handle, &tv);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			d->error = res;
+			break;
+		}
+	}
+
+	// the ring can only be freed once every callback has run
+	if (d->in_flight > 0) {
+		for (int i = 0; i < n_filled; i++)
+			d->io->cancel(d->ring[i]);
+
+		int n_errors = 0;
+		while (d->in_flight > 0 && n_errors < MAX_DRAIN_ERRORS) {
+			struct timeval tv = {0, 100000};
+			int res = d->io->handle_events_timeout(d->handle, &tv);
+			if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+				n_errors++;
+		}
+	}
+
+	d->t_end = get_time_ns();
+	return NULL;
+}
+
+int capture(int argc, char **args) {
+	u8 endpoint = strtol(args[1], NULL, 16);
+	int n_pkts  = strtol(args[2], NULL, 0);
+	int pkt_sz  = strtol(args[3], NULL, 0);
+	int depth   = strtol(args[4], NULL, 0);
+	double secs = strtod(args[5], NULL);
+	char *prefix = argc > 6 ? args[6] : NULL;
+
+	if ((endpoint & 0x80) == 0 || n_pkts <= 0 || pkt_sz <= 0 || secs <= 0) {
+		printf("Invalid capture parameters\n\n");
+		return -1;
+	}
+	if (depth < 1)
+		depth = 1;
+	if (depth > ISOC_RING_LEN)
+		depth = ISOC_RING_LEN;
+
+	// every ring is allocated before any capture starts, so running out of memory doesn't leave some devices capturing
+	for (int i = 0; i < n_devices; i++) {
+		Device *d = &devices[i];
+		int ok = 1;
+
+		for (int j = 0; j < depth; j++) {
+			d->ring[j] = libusb_alloc_transfer(n_pkts);
+			ok = ok && d->ring[j];
+		}
+		d->ring_buf = malloc((size_t)depth * n_pkts * pkt_sz);
+
+		if (!ok || !d->ring_buf) {
+			printf("Could not allocate %d transfer(s) of %d x %d bytes for device %d\n\n", depth, n_pkts, pkt_sz, i);
+			for (int k = 0; k <= i; k++) {
+				for (int j = 0; j < depth; j++) {
+					libusb_free_transfer(devices[k].ring[j]);
+					devices[k].ring[j] = NULL;
+				}
+				free(devices[k].ring_buf);
+				devices[k].ring_buf = NULL;
+			}
+			return -3;
+		}
+	}
+
+	u64 start = get_time_ns();
+
+	for (int i = 0; i < n_devices; i++) {
+		Device *d = &devices[i];
+		d->endpoint = endpoint;
+		d->n_pkts = n_pkts;
+		d->pkt_sz = pkt_sz;
+		d->depth = depth;
+		d->in_flight = 0;
+		d->error = 0;
+		d->n_xfers = d->bytes = d->n_pkt_errors = d->n_xfer_errors = 0;
+
+		d->sink = NULL;
+		if (prefix) {
+			char name[256];
+			snprintf(name, sizeof(name), "%s%d.bin", prefix, i);
+			d->sink = fopen(name, "wb");
+			if (!d->sink)
+				printf("Could not open %s, device %d will not be saved\n", name, i);
+			else
+				setvbuf(d->sink, NULL, _IOFBF, 1 << 20);
+		}
+
+		d->t_start = get_time_ns();
+		d->t_stop = d->t_start + (u64)(secs * 1e9);
+		pthread_create(&d->thread, NULL, capture_thread, d);
+	}
+
+	u64 total_bytes = 0;
+	int failed = 0;
+
+	for (int i = 0; i < n_devices; i++) {
+		Device *d = &devices[i];
+		pthread_join(d->thread, NULL);
+
+		double elapsed = (double)(d->t_end - d->t_start) / 1e9;
+		printf(
+			"%2d %-12s : %llu transfer(s), %llu bytes in %.3f s (%.3f MB/s), %llu packet error(s), %llu transfer error(s)",
+			i, d->path, d->n_xfers, d->bytes, elapsed, elapsed > 0 ? d->bytes / elapsed / 1000000.0 : 0.0,
+			d->n_pkt_errors, d->n_xfer_errors
+		);
+		if (d->error) {
+			printf(" - stopped: %s (%d)", libusb_strerror(d->error), d->error);
+			failed = 1;
+		}
+		putchar('\n');
+
+		total_bytes += d->bytes;
+
+		// if some transfers never came back, leaking them (and their buffer) is better than freeing them from under libusb
+		if (d->in_flight > 0) {
+			printf("%2d %-12s : %d transfer(s) could not be cancelled, and are leaked\n", i, d->path, d->in_flight);
+		}
+		else {
+			for (int j = 0; j < depth; j++)
+				libusb_free_transfer(d->ring[j]);
+			free(d->ring_buf);
+		}
+		d->ring_buf = NULL;
+		if (d->sink)
+			fclose(d->sink);
+	}
+
+	double elapsed = (double)(get_time_ns() - start) / 1e9;
+	printf("Total: %llu bytes from %d device(s) in %.3f s (%.3f MB/s)\n\n", total_bytes, n_devices, elapsed, total_bytes / elapsed / 1000000.0);
+
+	return failed ? -2 : 0;
+}
+
+int list_transfer(Xfer_Entry *xfer, void *arg) {
+	const char *types[] = {
+		"control", "interrupt", "bulk", "isochronous"
+	};
+
+	printf(
+		"%5d - %.6f s (%.3f ms) - type = %s, ",
+		xfer->id, (double)(xfer->t_submit - time_origin) / 1e9,
+		(double)(xfer->t_complete - xfer->t_submit) / 1e6, types[xfer->type - 1]
+	);
+
+	int i;
+	switch (xfer->type) {
+		case TYPE_CTRL:
+			printf(
+				"req type = %#x, req = %#x, value = %#x, index = %#x, data = ",
+				xfer->req_type, xfer->req, xfer->value, xfer->index
+			);
+			for (i = 0; i < xfer->size; i++)
+				printf("%02x ", xfer->data[i]);
+
+			break;
+		case TYPE_INT:
+		case TYPE_BULK:
+			printf("endpoint = %#x, data = ", xfer->endpoint);
+			for (i = 0; i < xfer->size; i++)
+				printf("%02x ", xfer->data[i]);
+
+			break;
+		case TYPE_ISOC:
+			printf(
+				"endpoint = %#x, max size = %d, actual size = %d, packets = %d, errors = %d",
+				xfer->endpoint, xfer->n_pkts * xfer->pkt_sz, xfer->size, xfer->n_pkts, xfer->n_errors
+			);
+			break;
+	}
+
+	putchar('\n');
+	return 0;
+}
+
+int list(int argc, char **args) {
+	Filter filters[N_VARS];
+	int n_flts = parse_filters(argc-1, &args[1], filters);
+	if (n_flts < 0)
+		return n_flts;
+
+	query_transfers(filters, n_flts, list_transfer, NULL);
+	return 0;
+}
+
+typedef struct {
+	char *name;
+	FILE *f;
+} Save_Ctx;
+
+// The file is only created once something matches
+int save_transfer(Xfer_Entry *xfer, void *arg) {
+	Save_Ctx *ctx = arg;
+
+	if (!ctx->f) {
+		ctx->f = fopen(ctx->name, "wb");
+		if (!ctx->f) {
+			printf("Could not open file \"%s\"\n", ctx->name);
+			return -3;
+		}
+	}
+
+	// transfers whose payload couldn't be stored have nothing to write
+	if (xfer->data)
+		fwrite(xfer->data, 1, xfer->size, ctx->f);
+	return 0;
+}
+
+int save(int argc, char **args) {
+	Filter filters[N_VARS];
+	int n_flts = parse_filters(argc-2, &args[2], filters);
+	if (n_flts < 0)
+		return n_flts;
+
+	Save_Ctx ctx = {args[1], NULL};
+	int res = query_transfers(filters, n_flts, save_transfer, &ctx);
+
+	if (ctx.f)
+		fclose(ctx.f);
+
+	return res < 0 ? res : 0;
+}
+
+typedef struct {
+	const char *test;
+	int size;
+	int depth;
+	int n_pkts;
+	int count;
+	double secs;
+	u64 bytes;
+	int n_failed;
+	int n_pkt_errors;
+	int n_pkts_total;
+} Bench_Result;
+
+// Summarises the transfers made since <first> (ie. the ones made by a single benchmark step)
+void measure_transfers(Bench_Result *r, int first) {
+	r->count = n_xfers - first;
+	r->bytes = 0;
+	r->n_failed = r->n_pkt_errors = r->n_pkts_total = 0;
+
+	for (int i = first; i < n_xfers; i++) {
+		Xfer_Entry *xfer = get_transfer(i);
+		// for everything except isoc, res holds the number of bytes actually transferred
+		if (xfer->res < 0)
+			r->n_failed++;
+		else
+			r->bytes += xfer->type == TYPE_ISOC ? xfer->size : xfer->res;
+
+		r->n_pkt_errors += xfer->n_errors;
+		r->n_pkts_total += xfer->n_pkts;
+	}
+
+	Xfer_Entry *a = get_transfer(first), *b = get_transfer(n_xfers - 1);
+	r->secs = r->count > 0 ? (double)(b->t_complete - a->t_submit) / 1e9 : 0;
+}
+
+void print_bench_result(Bench_Result *r, FILE *csv) {
+	double rate = r->secs > 0 ? r->count / r->secs : 0;
+	double mbps = r->secs > 0 ? r->bytes / r->secs / 1000000.0 : 0;
+	int errors = r->n_pkts_total ? r->n_pkt_errors : r->n_failed;
+	int total  = r->n_pkts_total ? r->n_pkts_total : r->count;
+	double err_pc = total ? 100.0 * errors / total : 0;
+
+	printf(
+		"%-10s %8d %6d %7d %7d %9.3f %11.1f %10.3f %8d %7.2f%%\n",
+		r->test, r->size, r->depth, r->n_pkts, r->count, r->secs, rate, mbps, errors, err_pc
+	);
+
+	if (csv) {
+		fprintf(
+			csv, "%s,%d,%d,%d,%d,%.6f,%.1f,%.0f,%d,%.6f\n",
+			r->test, r->size, r->depth, r->n_pkts, r->count, r->secs, rate,
+			r->secs > 0 ? r->bytes / r->secs : 0, errors, total ? (double)errors / total : 0
+		);
+	}
+}
+
+int bench_ctrl(int argc, char **args, FILE *csv) {
+	int count = argc > 2 ? strtol(args[2], NULL, 0) : 1000;
+	int window = argc > 3 ? strtol(args[3], NULL, 0) : DEFAULT_CTRL_WINDOW;
+
+	// CHIP_ID register reads, first one at a time, then pipelined.
+	// CHIP_ID never changes, so the shadow would answer all but the first of them: it's off while they run
+	char *read_args[] = {"ctrl", "c0", "0", "0", "0xa", "1"};
+	Bench_Result r = {"ctrl", 1, 1, 0};
+
+	int shadow_enabled = shadow && shadow->enabled;
+	if (shadow)
+		shadow->enabled = 0;
+
+	int first = n_xfers;
+	for (int i = 0; i < count; i++)
+		ctrl(6, read_args);
+
+	measure_transfers(&r, first);
+	print_bench_result(&r, csv);
+
+	first = n_xfers;
+	begin_ctrl_batch(window);
+	for (int i = 0; i < count; i++) {
+		if (batch_ctrl(6, read_args) < 0)
+			break;
+	}
+	end_ctrl_batch();
+
+	r.test = "ctrl-batch";
+	r.depth = ctrl_batch.window;
+	measure_transfers(&r, first);
+	print_bench_result(&r, csv);
+
+	if (shadow)
+		shadow->enabled = shadow_enabled;
+
+	return 0;
+}
+
+int bench_bulk(int argc, char **args, FILE *csv) {
+	if (argc < 3) {
+		printf("bench bulk requires an endpoint\n\n");
+		return -1;
+	}
+
+	u8 endpoint = strtol(args[2], NULL, 16);
+	if ((endpoint & 0x80) == 0) {
+		printf("bench bulk only reads from IN endpoints\n\n");
+		return -2;
+	}
+
+	int count = argc > 3 ? strtol(args[3], NULL, 0) : 100;
+
+	int default_sizes[] = {512, 1024, 4096, 16384, 65536, 0x30000};
+	int n_sizes = argc > 4 ? argc - 4 : sizeof(default_sizes) / sizeof(int);
+
+	for (int i = 0; i < n_sizes; i++) {
+		int size = argc > 4 ? strtol(args[4 + i], NULL, 0) : default_sizes[i];
+
+		char size_str[16];
+		snprintf(size_str, 16, "%d", size);
+		char *bulk_args[] = {"bulk", args[2], size_str};
+
+		Bench_Result r = {"bulk", size, 1, 0};
+		int first = n_xfers;
+		for (int j = 0; j < count; j++)
+			bulk(3, bulk_args);
+
+		measure_transfers(&r, first);
+		print_bench_result(&r, csv);
+	}
+
+	return 0;
+}
+
+int bench_isoc(int argc, char **args, FILE *csv) {
+	if (argc < 4) {
+		printf("bench isoc requires an endpoint and a packet size\n\n");
+		return -1;
+	}
+
+	u8 endpoint = strtol(args[2], NULL, 16);
+	int pkt_sz = strtol(args[3], NULL, 0);
+	int count = argc > 4 ? strtol(args[4], NULL, 0) : 100;
+
+	if ((endpoint & 0x80) == 0) {
+		printf("bench isoc only reads from IN endpoints\n\n");
+		return -2;
+	}
+
+	int depths[] = {1, 2, 4, 8, 16, 32};
+	int pkt_counts[] = {8, 16, 32, 64};
+
+	for (int i = 0; i < sizeof(pkt_counts) / sizeof(int); i++) {
+		if (pkt_counts[i] * pkt_sz > BUCKET_SIZE)
+			continue;
+
+		for (int j = 0; j < sizeof(depths) / sizeof(int); j++) {
+			Bench_Result r = {"isoc", pkt_sz, depths[j], pkt_counts[i]};
+			int first = n_xfers;
+
+			stream_isoc(endpoint, pkt_counts[i], pkt_sz, depths[j], count, NULL);
+
+			measure_transfers(&r, first);
+			print_bench_result(&r, csv);
+		}
+	}
+
+	return 0;
+}
+
+int bench(int argc, char **args) {
+	FILE *csv = NULL;
+
+	if (!strcmp(args[1], "-o")) {
+		if (argc < 4) {
+			printf("bench -o requires a file name and a test\n\n");
+			return -1;
+		}
+
+		csv = fopen(args[2], "a");
+		if (!csv) {
+			printf("Could not open \"%s\"\n\n", args[2]);
+			return -2;
+		}
+		if (ftell(csv) == 0)
+			fprintf(csv, "test,size,depth,packets,transfers,seconds,transfers_per_sec,bytes_per_sec,errors,error_rate\n");
+
+		argc -= 2;
+		args += 2;
+	}
+
+	printf("test           size  depth packets  xfers   seconds     xfers/s       MB/s   errors   err %%\n");
+
+	int res;
+	if (!strcmp(args[1], "ctrl"))
+		res = bench_ctrl(argc, args, csv);
+	else if (!strcmp(args[1], "bulk"))
+		res = bench_bulk(argc, args, csv);
+	else if (!strcmp(args[1], "isoc"))
+		res = bench_isoc(argc, args, csv);
+	else {
+		printf("Unrecognised benchmark \"%s\"\n", args[1]);
+		res = -3;
+	}
+
+	putchar('\n');
+
+	if (csv)
+		fclose(csv);
+
+	return res;
+}
+
+/*
+ * Alt settings
+ * The em28xx's alt settings differ in how much isochronous bandwidth the video endpoint reserves. At high speed, a periodic endpoint
+ *  moves up to (wMaxPacketSize & 0x7ff) bytes, 1 + bits 11-12 times (the high-bandwidth multiplier), every 2^(bInterval-1) microframes.
+ */
+typedef struct {
+	int iface;
+	int alt;
+	u8 endpoint;
+	int pkt_bytes; // per service interval, ie. the packet size to stream with
+	u64 bytes_per_sec;
+} Alt_Candidate;
+
+int is_periodic(const struct libusb_endpoint_descriptor *ep) {
+	int type = ep->bmAttributes & 3;
+	return type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || type == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+}
+
+int endpoint_interval_bytes(const struct libusb_endpoint_descriptor *ep) {
+	int mps = ep->wMaxPacketSize;
+	return (mps & 0x7ff) * (1 + ((mps >> 11) & 3));
+}
+
+// in microframes
+int endpoint_interval(const struct libusb_endpoint_descriptor *ep) {
+	int b = ep->bInterval;
+	b = b < 1 ? 1 : (b > 16 ? 16 : b);
+	return 1 << (b - 1);
+}
+
+u64 endpoint_bytes_per_sec(const struct libusb_endpoint_descriptor *ep) {
+	if (!is_periodic(ep))
+		return 0;
+
+	return (u64)endpoint_interval_bytes(ep) * MICROFRAMES_PER_SEC / endpoint_interval(ep);
+}
+
+void print_endpoint(const struct libusb_endpoint_descriptor *ep) {
+	static const char *type_names[] = {"ctrl", "isoc", "bulk", "int"};
+	int mps = ep->wMaxPacketSize;
+
+	printf(
+		"    ep %#04x %-4s %-3s  wMaxPacketSize 0x%04x = %4d x %d",
+		ep->bEndpointAddress, type_names[ep->bmAttributes & 3], ep->bEndpointAddress & 0x80 ? "in" : "out",
+		mps, mps & 0x7ff, 1 + ((mps >> 11) & 3)
+	);
+
+	if (is_periodic(ep)) {
+		int interval = endpoint_interval(ep);
+		printf(
+			", every %d uframe(s): %.1f bytes/uframe, %.3f MB/s",
+			interval, (double)endpoint_interval_bytes(ep) / interval, endpoint_bytes_per_sec(ep) / 1000000.0
+		);
+	}
+
+	putchar('\n');
+}
+
+// For every alt setting with an isochronous IN endpoint, the one with the most bandwidth
+int get_alt_candidates(struct libusb_config_descriptor *config, Alt_Candidate *cands, int max) {
+	int n = 0;
+
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (int j = 0; j < iface->num_altsetting && n < max; j++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[j];
+			Alt_Candidate *c = &cands[n];
+			c->bytes_per_sec = 0;
+
+			for (int k = 0; k < alt->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep = &alt->endpoint[k];
+				u64 rate = endpoint_bytes_per_sec(ep);
+
+				if ((ep->bmAttributes & 3) == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && (ep->bEndpointAddress & 0x80) && rate > c->bytes_per_sec) {
+					c->iface = alt->bInterfaceNumber;
+					c->alt = alt->bAlternateSetting;
+					c->endpoint = ep->bEndpointAddress;
+					c->pkt_bytes = endpoint_interval_bytes(ep);
+					c->bytes_per_sec = rate;
+				}
+			}
+
+			if (c->bytes_per_sec > 0)
+				n++;
+		}
+	}
+
+	return n;
+}
+
+int cmp_alt_candidates(const void *a, const void *b) {
+	const Alt_Candidate *x = a, *y = b;
+	if (x->bytes_per_sec != y->bytes_per_sec)
+		return x->bytes_per_sec < y->bytes_per_sec ? -1 : 1;
+	if (x->iface != y->iface)
+		return x->iface - y->iface;
+	return x->alt - y->alt;
+}
+
+int alts(int argc, char **args) {
+	struct libusb_config_descriptor *config;
+	int res = io->get_config_descriptor(dev, &config);
+	if (res < 0) {
+		printf("Could not read the configuration descriptor: %s (%d)\n\n", libusb_strerror(res), res);
+		return -1;
+	}
+
+	printf("Configuration %d, %d interface(s)\n", config->bConfigurationValue, config->bNumInterfaces);
+
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (int j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[j];
+			printf(
+				"  interface %d alt %d: class %#04x, %d endpoint(s)\n",
+				alt->bInterfaceNumber, alt->bAlternateSetting, alt->bInterfaceClass, alt->bNumEndpoints
+			);
+
+			for (int k = 0; k < alt->bNumEndpoints; k++)
+				print_endpoint(&alt->endpoint[k]);
+		}
+	}
+
+	putchar('\n');
+	io->free_config_descriptor(config);
+	return 0;
+}
+
+/*
+ * Selects the alt setting with the least isochronous IN bandwidth that still covers <bytes/sec>.
+ * With "measure", each alt setting that should be enough is streamed from for a moment, smallest first,
+ *  and the first one that actually delivers the rate without any packet errors is kept. This needs the device to be sending already.
+ */
+int autoselect(int argc, char **args) {
+	u64 target = strtoull(args[1], NULL, 0);
+	int measure = argc > 2 && !strcmp(args[2], "measure");
+	int count = measure && argc > 3 ? strtol(args[3], NULL, 0) : DEFAULT_AUTOSELECT_COUNT;
+
+	struct libusb_config_descriptor *config;
+	int res = io->get_config_descriptor(dev, &config);
+	if (res < 0) {
+		printf("Could not read the configuration descriptor: %s (%d)\n\n", libusb_strerror(res), res);
+		return -1;
+	}
+
+	Alt_Candidate cands[MAX_ALT_CANDIDATES];
+	int n_cands = get_alt_candidates(config, cands, MAX_ALT_CANDIDATES);
+	io->free_config_descriptor(config);
+
+	qsort(cands, n_cands, sizeof(Alt_Candidate), cmp_alt_candidates);
+
+	int first = 0;
+	while (first < n_cands && cands[first].bytes_per_sec < target)
+		first++;
+
+	if (first == n_cands) {
+		if (n_cands > 0) {
+			Alt_Candidate *c = &cands[n_cands - 1];
+			printf("No alt setting can carry %llu bytes/s (the most is %llu, on interface %d alt %d)\n\n", target, c->bytes_per_sec, c->iface, c->alt);
+		}
+		else {
+			printf("No alt setting has an isochronous IN endpoint\n\n");
+		}
+		return -2;
+	}
+
+	if (!measure) {
+		Alt_Candidate *c = &cands[first];
+		printf(
+			"Interface %d alt %d: endpoint %#04x carries up to %llu bytes/s in %d-byte packets\n\n",
+			c->iface, c->alt, c->endpoint, c->bytes_per_sec, c->pkt_bytes
+		);
+		return select_alt(c->iface, c->alt);
+	}
+
+	printf("test           size  depth packets  xfers   seconds     xfers/s       MB/s   errors   err %%\n");
+
+	for (int i = first; i < n_cands; i++) {
+		Alt_Candidate *c = &cands[i];
+		if (select_alt(c->iface, c->alt) < 0)
+			continue;
+
+		char name[16];
+		snprintf(name, sizeof(name), "alt %d/%d", c->iface, c->alt);
+
+		Bench_Result r = {name, c->pkt_bytes, AUTOSELECT_DEPTH, AUTOSELECT_PKTS};
+		int start = n_xfers;
+		stream_isoc(c->endpoint, AUTOSELECT_PKTS, c->pkt_bytes, AUTOSELECT_DEPTH, count, NULL);
+
+		measure_transfers(&r, start);
+		print_bench_result(&r, NULL);
+
+		if (r.secs > 0 && r.bytes / r.secs >= target && r.n_failed == 0 && r.n_pkt_errors == 0) {
+			printf("\nSelected interface %d alt %d, endpoint %#04x\n\n", c->iface, c->alt, c->endpoint);
+			return 0;
+		}
+	}
+
+	printf("\nNo alt setting delivered %llu bytes/s without errors; the last one tried is still selected\n\n", target);
+	return -3;
+}
+
+typedef struct {
+	u64 *latencies;
+	int count;
+	int cap;
+	int n_failed;
+	int n_pkt_errors;
+	u64 bytes;
+	u64 first_submit;
+	u64 last_complete;
+} Xfer_Stats;
+
+int add_transfer_stats(Xfer_Entry *xfer, void *arg) {
+	Xfer_Stats *st = &((Xfer_Stats*)arg)[(xfer->type & 3) * N_EP_KEYS + get_ep_key(xfer)];
+
+	if (st->count >= st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 256;
+		st->latencies = realloc(st->latencies, st->cap * sizeof(u64));
+	}
+
+	st->latencies[st->count++] = xfer->t_complete - xfer->t_submit;
+
+	if (xfer->res < 0)
+		st->n_failed++;
+	else
+		st->bytes += xfer->size;
+
+	st->n_pkt_errors += xfer->n_errors;
+
+	if (st->first_submit == 0 || xfer->t_submit < st->first_submit)
+		st->first_submit = xfer->t_submit;
+	if (xfer->t_complete > st->last_complete)
+		st->last_complete = xfer->t_complete;
+
+	return 0;
+}
+
+int compare_u64(const void *a, const void *b) {
+	u64 x = *(u64*)a, y = *(u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+double get_percentile_us(u64 *sorted, int count, int pc) {
+	int idx = (count - 1) * pc / 100;
+	return (double)sorted[idx] / 1000.0;
+}
+
+int stats(int argc, char **args) {
+	Filter filters[N_VARS];
+	int n_flts = parse_filters(argc-1, &args[1], filters);
+	if (n_flts < 0)
+		return n_flts;
+
+	Xfer_Stats *groups = calloc(4 * N_EP_KEYS, sizeof(Xfer_Stats));
+	query_transfers(filters, n_flts, add_transfer_stats, groups);
+
+	const char *types[] = {
+		"isoc", "ctrl", "int", "bulk"
+	};
+
+	printf(
+		"type ep     count  failed  pkt errs        bytes       MB/s    xfers/s   p50 us   p90 us   p99 us   max us\n"
+	);
+
+	for (int i = 0; i < 4 * N_EP_KEYS; i++) {
+		Xfer_Stats *st = &groups[i];
+		if (st->count == 0)
+			continue;
+
+		qsort(st->latencies, st->count, sizeof(u64), compare_u64);
+
+		double secs = (double)(st->last_complete - st->first_submit) / 1e9;
+		double mbps = secs > 0 ? (double)st->bytes / secs / 1000000.0 : 0;
+		double rate = secs > 0 ? st->count / secs : 0;
+
+		printf(
+			"%-4s 0x%02x %8d %7d %9d %12llu %10.3f %10.1f %8.1f %8.1f %8.1f %8.1f\n",
+			types[i / N_EP_KEYS], i % N_EP_KEYS, st->count, st->n_failed, st->n_pkt_errors, st->bytes, mbps, rate,
+			get_percentile_us(st->latencies, st->count, 50),
+			get_percentile_us(st->latencies, st->count, 90),
+			get_percentile_us(st->latencies, st->count, 99),
+			(double)st->latencies[st->count - 1] / 1000.0
+		);
+
+		free(st->latencies);
+	}
+
+	putchar('\n');
+	free(groups);
+	return 0;
+}
+
+int dedup_cmd(int argc, char **args) {
+	Payload_Store *ps = &payload_store;
+
+	if (argc > 1) {
+		if (!strcmp(args[1], "on") || !strcmp(args[1], "off")) {
+			ps->on = args[1][1] == 'n';
+		}
+		else {
+			printf("Usage: dedup [on / off]\n\n");
+			return -1;
+		}
+	}
+
+	u64 kept = ps->bytes - ps->freed_bytes;
+	printf(
+		"Payload deduplication is %s\n"
+		"%llu payload(s) of up to %d bytes went through the store, %d distinct, %llu duplicate(s)\n"
+		"%llu payload bytes, %llu of them duplicates, %llu given back to the buckets\n"
+		"Dedup ratio: %.2f (by content), %.2f (by memory used)\n\n",
+		ps->on ? "on" : "off", ps->n_payloads, DEDUP_MAX_SIZE, ps->n_unique, ps->n_dups,
+		ps->bytes, ps->dup_bytes, ps->freed_bytes,
+		ps->bytes > ps->dup_bytes ? (double)ps->bytes / (ps->bytes - ps->dup_bytes) : 1.0,
+		kept > 0 ? (double)ps->bytes / kept : 1.0
+	);
+
+	return 0;
+}
+
+int session(int argc, char **args) {
+	if (argc < 2) {
+		if (rec_session.map) {
+			Session_Header *hdr = (Session_Header*)rec_session.map;
+			printf("Recording to \"%s\" : %u record(s), %llu bytes\n\n", rec_session.name, hdr->n_records, hdr->end);
+		}
+		else
+			printf("Not recording a session\n\n");
+
+		return 0;
+	}
+
+	if (rec_session.map)
+		close_session(&rec_session);
+
+	if (!strcmp(args[1], "off"))
+		return 0;
+
+	rec_session.fd = open(args[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (rec_session.fd < 0) {
+		printf("Could not open session file \"%s\"\n\n", args[1]);
+		return -1;
+	}
+
+	rec_session.name = strdup(args[1]);
+	if (map_session(&rec_session, SESSION_GROW) < 0) {
+		printf("Could not map session file \"%s\"\n\n", args[1]);
+		unmap_session(&rec_session);
+		return -2;
+	}
+
+	Session_Header *hdr = (Session_Header*)rec_session.map;
+	hdr->magic = SESSION_MAGIC;
+	hdr->version = SESSION_VERSION;
+	hdr->n_records = 0;
+	hdr->end = sizeof(Session_Header);
+
+	// The session covers everything in the transfer log, not just what comes after this command
+	for (int i = 0; i < n_xfers && rec_session.map; i++)
+		append_record(&rec_session, get_transfer(i));
+
+	printf("Recording session to \"%s\"\n\n", args[1]);
+	return 0;
+}
+
+int record(int argc, char **args) {
+	Pcap_Writer *w = &pcap_writer;
+	if (argc < 2) {
+		if (w->f)
+			printf("Recording to \"%s\" : %llu record(s)\n\n", w->name, w->n_records);
+		else
+			printf("Not recording a capture\n\n");
+
+		return 0;
+	}
+
+	if (w->f)
+		stop_pcap_writer(w);
+
+	if (!strcmp(args[1], "off"))
+		return 0;
+
+	if (start_pcap_writer(w, args[1]) < 0) {
+		printf("Could not open capture file \"%s\"\n\n", args[1]);
+		return -1;
+	}
+
+	// like a session, the capture covers everything in the transfer log
+	for (int i = 0; i < n_xfers; i++)
+		pcap_write_transfer(w, get_transfer(i));
+
+	printf("Recording capture to \"%s\"\n\n", args[1]);
+	return 0;
+}
+
+int load(int argc, char **args) {
+	// Finish the current recording first, since it might be the very file being loaded
+	if (rec_session.map) {
+		printf("Stopped recording to \"%s\"\n", rec_session.name);
+		close_session(&rec_session);
+	}
+
+	int fd = open(args[1], O_RDONLY);
+	if (fd < 0) {
+		printf("Could not open session file \"%s\"\n\n", args[1]);
+		return -1;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	if (st.st_size < sizeof(Session_Header)) {
+		printf("\"%s\" is too small to be a session file\n\n", args[1]);
+		close(fd);
+		return -2;
+	}
+
+	u8 *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("Could not map session file \"%s\"\n\n", args[1]);
+		close(fd);
+		return -3;
+	}
+
+	Session_Header *hdr = (Session_Header*)map;
+	if (hdr->magic != SESSION_MAGIC || hdr->version != SESSION_VERSION) {
+		printf("\"%s\" is not a session file (or is from an incompatible version)\n\n", args[1]);
+		munmap(map, st.st_size);
+		close(fd);
+		return -4;
+	}
+
+	destroy_transfers();
+	destroy_buckets();
+	unmap_session(&load_session);
+
+	load_session.fd = fd;
+	load_session.map = map;
+	load_session.map_size = st.st_size;
+	load_session.name = strdup(args[1]);
+
+	u64 end = hdr->end < st.st_size ? hdr->end : st.st_size;
+	u64 off = sizeof(Session_Header);
+
+	// Payloads stay in the mapping; only the fixed-size records are turned into log entries
+	while (off + sizeof(Session_Record) <= end) {
+		Session_Record *rec = (Session_Record*)(map + off);
+		u64 table_size = rec->type == TYPE_ISOC && rec->n_pkts > 0 ? rec->n_pkts * sizeof(Iso_Packet) : 0;
+		if (rec->magic != RECORD_MAGIC || rec->length < sizeof(Session_Record) || rec->size < 0 ||
+			sizeof(Session_Record) + table_size + rec->size > rec->length || off + rec->length > end
+		) {
+			printf("Session is truncated at offset %#llx (torn record)\n", off);
+			break;
+		}
+
+		// the type indexes tables when listing and exporting
+		if (rec->type < TYPE_CTRL || rec->type > TYPE_ISOC) {
+			printf("Session has a record of unknown type %d at offset %#llx, and is only loaded up to there\n", rec->type, off);
+			break;
+		}
+
+		Xfer_Entry *xfer = new_transfer(rec->type);
+		xfer->endpoint = rec->endpoint;
+		xfer->req_type = rec->req_type;
+		xfer->req      = rec->req;
+		xfer->value    = rec->value;
+		xfer->index    = rec->index;
+		xfer->pkt_sz   = rec->pkt_sz;
+		xfer->n_pkts   = rec->n_pkts;
+		xfer->frame    = rec->frame;
+		xfer->n_errors = rec->n_errors;
+		xfer->res      = rec->res;
+		xfer->size     = rec->size;
+		xfer->pkts     = table_size > 0 ? (Iso_Packet*)&rec[1] : NULL;
+		xfer->data     = rec->size > 0 ? (u8*)&rec[1] + table_size : NULL;
+		xfer->t_submit   = rec->t_submit;
+		xfer->t_complete = rec->t_complete;
+		index_transfer(xfer);
+
+		if (xfer->id == 0)
+			time_origin = xfer->t_submit;
+
+		off += rec->length;
+	}
+
+	printf("Loaded %d transfer(s) from \"%s\"\n\n", n_xfers, args[1]);
+	return 0;
+}
+
+static char *cmd_buf = NULL;
+static int cmd_cap = 0;
+
+/*
+ * Reads a line of any length into *buf, growing it as needed. A backslash at the end of a line joins it to the next one.
+ * Returns the length of the (joined) line, or -1 at the end of the file.
+ */
+int read_line(FILE *f, char **buf, int *cap) {
+	if (!*buf) {
+		*cap = CMD_BUF_SIZE;
+		*buf = malloc(*cap);
+	}
+
+	int len = 0;
+	while (1) {
+		if (*cap - len < 2) {
+			*cap *= 2;
+			*buf = realloc(*buf, *cap);
+		}
+
+		if (!fgets(*buf + len, *cap - len, f)) {
+			if (len == 0)
+				return -1;
+			break;
+		}
+
+		len += strlen(*buf + len);
+		char *b = *buf;
+
+		// the line didn't fit, so keep reading it into a bigger buffer
+		if (b[len-1] != '\n' && !feof(f))
+			continue;
+
+		int end = len;
+		while (end > 0 && (b[end-1] == '\n' || b[end-1] == '\r'))
+			end--;
+
+		if (end == 0 || b[end-1] != '\\')
+			break;
+
+		b[end-1] = ' ';
+		len = end;
+	}
+
+	(*buf)[len] = 0;
+	return len;
+}
+
+// Splits a line into arguments in-place. Returns the number of arguments found, which may exceed max_args.
+int tokenise(char *line, int line_size, char **args, int max_args) {
+	int n_args = 0;
+	int quotes = 0;
+	char *p = line;
+	for (int i = 0; i < line_size; i++) {
+		quotes ^= *p == '\"';
+		int end = *p == '\n' || *p == '\r' || *p == 0;
+
+		if (*p == '\t')
+			*p = ' ';
+
+		if (end || (*p == ' ' && !quotes)) {
+			*p = 0;
+			n_args++;
+			if (end) break;
+		}
+		p++;
+	}
+
+	p = line;
+	for (int i = 0; i < n_args && i < max_args; i++) {
+		args[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	return n_args;
+}
+
+int parse_and_run_command(char **args, const int max_args);
+
+int ctrlbatch(int argc, char **args) {
+	int window = argc > 2 ? strtol(args[2], NULL, 0) : DEFAULT_CTRL_WINDOW;
+
+	FILE *f = fopen(args[1], "r");
+	if (!f) {
+		printf("Could not open batch file %s\n", args[1]);
+		return -1;
+	}
+
+	char *line = NULL;
+	int line_cap = 0, line_len;
+	char *line_args[MAX_ARGS + 1];
+	int n_lines = 0, n_xfers_before = n_xfers;
+	u64 start = get_time_ns();
+
+	begin_ctrl_batch(window);
+
+	while ((line_len = read_line(f, &line, &line_cap)) >= 0) {
+		n_lines++;
+		// each line has the same arguments as the ctrl command, with or without the command name itself
+		char **a = &line_args[0];
+		int n_args = tokenise(line, line_len + 1, &a[1], MAX_ARGS) + 1;
+		if (!strlen(line) || line[0] == '#')
+			continue;
+
+		if (!strcmp(a[1], "ctrl")) {
+			a++;
+			n_args--;
+		}
+		a[0] = "ctrl";
+
+		if (n_args < 6 || n_args > MAX_ARGS) {
+			printf("Line %d of %s is not a valid control transfer\n", n_lines, args[1]);
+			break;
+		}
+
+		if (batch_ctrl(n_args, a) < 0)
+			break;
+	}
+
+	fclose(f);
+	free(line);
+
+	int res = end_ctrl_batch();
+	u64 elapsed = get_time_ns() - start;
+	int count = n_xfers - n_xfers_before;
+
+	printf(
+		"%d control transfer(s) in %.3f ms (%.0f / s, window = %d)\n\n",
+		count, (double)elapsed / 1000000.0, elapsed ? count * 1e9 / elapsed : 0.0, ctrl_batch.window
+	);
+
+	return res;
+}
+
+Replay replay_state = {0};
+
+// Pairs every request in a capture with its response. IRP ids get reused once a request completes,
+//  so a response belongs to the oldest outstanding request with the same id.
+int pair_requests(u8 *buf, int size, Replay_Pair **pairs_out) {
+	Replay_Pair *pairs = NULL;
+	int n_pairs = 0, cap = 0;
+
+	int *open = NULL;
+	int n_open = 0, open_cap = 0;
+
+	struct Packet pkt;
+	int idx = PCAP_FIRST_PACKET;
+	int count = 0;
+
+	while (idx + 27 <= size) {
+		int len = get_next_packet(&pkt, buf, idx);
+		if (idx + len - 0x10 > size)
+			break;
+
+		count++;
+
+		if ((pkt.dir & 1) == 0) {
+			if (n_pairs >= cap) {
+				cap = cap ? cap * 2 : 256;
+				pairs = realloc(pairs, cap * sizeof(Replay_Pair));
+			}
+			if (n_open >= open_cap) {
+				open_cap = open_cap ? open_cap * 2 : 64;
+				open = realloc(open, open_cap * sizeof(int));
+			}
+
+			pairs[n_pairs] = (Replay_Pair){count, idx, -1, pkt.id};
+			open[n_open++] = n_pairs++;
+		}
+		else {
+			for (int i = 0; i < n_open; i++) {
+				if (pairs[open[i]].irp_id == pkt.id) {
+					pairs[open[i]].resp = idx;
+					memmove(&open[i], &open[i+1], (n_open - i - 1) * sizeof(int));
+					n_open--;
+					break;
+				}
+			}
+		}
+
+		idx += len;
+	}
+
+	free(open);
+	*pairs_out = pairs;
+	return n_pairs;
+}
+
+// Flags every way in which a replayed transfer differs from the captured response
+void compare_replay(Replay_Pair *pair, Xfer_Entry *xfer) {
+	if (pair->resp < 0)
+		return;
+
+	struct Packet resp;
+	get_next_packet(&resp, replay_state.capture, pair->resp);
+
+	int was_ok = resp.status == 0;
+	if (was_ok != (xfer->res >= 0)) {
+		if (was_ok)
+			printf("Mismatch at record %d (transfer %d): failed with %s (%d), but succeeded in the capture\n", pair->n, xfer->id, libusb_strerror(xfer->res), xfer->res);
+		else
+			printf("Mismatch at record %d (transfer %d): succeeded, but failed in the capture (status %#x)\n", pair->n, xfer->id, resp.status);
+
+		replay_state.n_mismatches++;
+		return;
+	}
+
+	// isochronous data (ie. video) is expected to differ
+	int in = xfer->type == TYPE_CTRL ? xfer->req_type & 0x80 : xfer->endpoint & 0x80;
+	if (!was_ok || !in || xfer->type == TYPE_ISOC)
+		return;
+
+	if (xfer->res != resp.pkt_sz) {
+		printf("Mismatch at record %d (transfer %d): returned %d byte(s) instead of %d\n", pair->n, xfer->id, xfer->res, resp.pkt_sz);
+		replay_state.n_mismatches++;
+		return;
+	}
+
+	for (int i = 0; i < xfer->res; i++) {
+		if (xfer->data[i] != resp.payload[i]) {
+			printf(
+				"Mismatch at record %d (transfer %d): byte %d is %02x instead of %02x\n",
+				pair->n, xfer->id, i, xfer->data[i], resp.payload[i]
+			);
+			replay_state.n_mismatches++;
+			return;
+		}
+	}
+}
+
+void replay_cb(struct libusb_transfer *usb_xfer) {
+	Replay_Slot *slot = usb_xfer->user_data;
+	Xfer_Entry *xfer = slot->xfer;
+
+	slot->xfer = NULL;
+	replay_state.in_flight--;
+
+	if (xfer->type == TYPE_ISOC) {
+		get_isoc_result(xfer, usb_xfer);
+	}
+	else {
+		xfer->res = get_async_result(usb_xfer);
+		if (xfer->type == TYPE_CTRL && (xfer->req_type & 0x80))
+			receive_ctrl_payload(xfer, usb_xfer);
+	}
+
+	complete_transfer(xfer);
+	compare_replay(slot->pair, xfer);
+}
+
+int wait_replay(int max_in_flight) {
+	while (replay_state.in_flight > max_in_flight) {
+		int res = io->handle_events(dev);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			printf("libusb_handle_events() = %d : %s\n\n", res, libusb_strerror(res));
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+// Handles completions until the given time, so that a timed replay doesn't hold up transfers already in flight
+int wait_replay_until(u64 due) {
+	u64 now;
+	while ((now = get_time_ns()) < due) {
+		u64 left = due - now;
+		if (replay_state.in_flight == 0) {
+			struct timespec ts = {left / 1000000000ULL, left % 1000000000ULL};
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		struct timeval tv = {left / 1000000000ULL, (left % 1000000000ULL) / 1000};
+		int res = io->handle_events_timeout(dev, &tv);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			printf("libusb_handle_events_timeout() = %d : %s\n\n", res, libusb_strerror(res));
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Submits the request from a capture record.
+ * Returns 1 if it was submitted, 0 if the request was skipped, or a negative value on failure.
+ * IN lengths come from the captured response, since USBPcap only records the length of the data that came back.
+ */
+int submit_replay(Replay_Pair *pair) {
+	const int urb_types[] = {TYPE_ISOC, TYPE_INT, TYPE_CTRL, TYPE_BULK};
+
+	struct Packet pkt, resp;
+	get_next_packet(&pkt, replay_state.capture, pair->req);
+	if (pair->resp >= 0)
+		get_next_packet(&resp, replay_state.capture, pair->resp);
+
+	if (pkt.type < URB_ISOC || pkt.type > URB_BULK)
+		return 0;
+
+	int in = pkt.endpoint & 0x80;
+	int n_iso = 0, iso_len = 0, size = 0;
+
+	switch (pkt.type) {
+		case URB_CTRL:
+			// only requests in the setup stage carry a setup packet
+			if (pkt.pkt_sz < 8 || pkt.stage != 0)
+				return 0;
+
+			// standard requests belong to the host's USB stack, apart from selecting an alt setting
+			if ((pkt.req_type & 0x60) == 0) {
+				if (pkt.req_type != 0x01 || pkt.req != SET_INTERFACE)
+					return 0;
+
+				if (wait_replay(0) < 0)
+					return -1;
+
+				return select_alt(pkt.index, pkt.value) < 0 ? -2 : 1;
+			}
+
+			in = pkt.req_type & 0x80;
+			size = pkt.len;
+			if (!in && size > pkt.pkt_sz - 8)
+				size = pkt.pkt_sz - 8;
+			break;
+		case URB_INTR:
+		case URB_BULK:
+			if (in && pair->resp < 0)
+				return 0;
+
+			size = in ? resp.pkt_sz : pkt.pkt_sz;
+			break;
+		case URB_ISOC:
+			n_iso = pkt.packs;
+			iso_len = pkt.per_pack;
+			if (iso_len == 0 && pair->resp >= 0)
+				iso_len = resp.pkt_sz;
+			if (n_iso <= 0 || iso_len <= 0)
+				return 0;
+
+			size = n_iso * iso_len;
+			break;
+	}
+
+	if (wait_replay(replay_state.window - 1) < 0)
+		return -1;
+
+	Replay_Slot *slot = &replay_state.slots[0];
+	while (slot->xfer)
+		slot++;
+
+	if (slot->usb && slot->n_iso < n_iso) {
+		libusb_free_transfer(slot->usb);
+		slot->usb = NULL;
+	}
+	if (!slot->usb) {
+		slot->usb = libusb_alloc_transfer(n_iso);
+		slot->n_iso = n_iso;
+	}
+
+	Xfer_Entry *xfer = new_transfer(urb_types[pkt.type]);
+	xfer->endpoint = pkt.endpoint;
+	xfer->size = size;
+
+	// isochronous IN data is read into the slot, then packed into the log on completion
+	if (pkt.type != URB_ISOC || !in)
+		xfer->data = allocate(size);
+
+	if (pkt.type == URB_CTRL) {
+		xfer->endpoint = 0;
+		xfer->req_type = pkt.req_type;
+		xfer->req = pkt.req;
+		xfer->value = pkt.value;
+		xfer->index = pkt.index;
+	}
+	else if (pkt.type == URB_ISOC) {
+		xfer->n_pkts = n_iso;
+		xfer->pkt_sz = iso_len;
+	}
+	index_transfer(xfer);
+
+	if (!in) {
+		u8 *src = pkt.type == URB_CTRL ? pkt.data : pkt.payload;
+		int len = pkt.type == URB_CTRL ? size : pkt.pkt_sz;
+		memcpy(xfer->data, src, len < size ? len : size);
+		dedup_transfer(xfer);
+	}
+
+	switch (pkt.type) {
+		case URB_CTRL:
+		{
+			int len = LIBUSB_CONTROL_SETUP_SIZE + size;
+			if (slot->buf_size < len) {
+				slot->buf = realloc(slot->buf, len);
+				slot->buf_size = len;
+			}
+
+			libusb_fill_control_setup(slot->buf, xfer->req_type, xfer->req, xfer->value, xfer->index, size);
+			if (!in && size > 0)
+				memcpy(slot->buf + LIBUSB_CONTROL_SETUP_SIZE, xfer->data, size);
+
+			libusb_fill_control_transfer(slot->usb, dev, slot->buf, replay_cb, slot, XFER_TIMEOUT);
+			break;
+		}
+		case URB_INTR:
+			libusb_fill_interrupt_transfer(slot->usb, dev, xfer->endpoint, xfer->data, size, replay_cb, slot, XFER_TIMEOUT);
+			break;
+		case URB_BULK:
+			libusb_fill_bulk_transfer(slot->usb, dev, xfer->endpoint, xfer->data, size, replay_cb, slot, XFER_TIMEOUT);
+			break;
+		case URB_ISOC:
+		{
+			u8 *buf = xfer->data;
+			if (in) {
+				if (slot->buf_size < size) {
+					slot->buf = realloc(slot->buf, size);
+					slot->buf_size = size;
+				}
+				buf = slot->buf;
+			}
+
+			libusb_fill_iso_transfer(slot->usb, dev, xfer->endpoint, buf, size, n_iso, replay_cb, slot, XFER_TIMEOUT);
+			libusb_set_iso_packet_lengths(slot->usb, iso_len);
+			break;
+		}
+	}
+
+	xfer->t_submit = get_time_ns();
+	int res = io->submit(slot->usb);
+	if (res < 0) {
+		printf("Could not submit record %d: %s (%d)\n", pair->n, libusb_strerror(res), res);
+		xfer->res = res;
+		complete_transfer(xfer);
+		return -3;
+	}
+
+	if (xfer->type == TYPE_CTRL)
+		defer_ctrl_payload(xfer);
+
+	slot->xfer = xfer;
+	slot->pair = pair;
+	replay_state.in_flight++;
+	return 1;
+}
+
+void destroy_replay(void) {
+	for (int i = 0; i < MAX_REPLAY_WINDOW; i++) {
+		if (replay_state.slots[i].usb)
+			libusb_free_transfer(replay_state.slots[i].usb);
+
+		free(replay_state.slots[i].buf);
+	}
 
-	if (prev_iface >= 0 && iface != prev_iface)
-		libusb_release_interface(dev, prev_iface);
+	memset(&replay_state, 0, sizeof(Replay));
+}
 
-	int res = libusb_claim_interface(dev, iface);
-	if (res != 0) {
-		printf("Failed to claim interface %d: %s (%d)\n\n", iface, libusb_strerror(res), res);
+int replay(int argc, char **args) {
+	// the gaps between requests get multiplied by scale, so 0 means as fast as possible
+	double scale = 1.0;
+	if (argc > 2) {
+		if (!strcmp(args[2], "max"))
+			scale = 0;
+		else if (strcmp(args[2], "timed"))
+			scale = strtod(args[2], NULL);
+	}
+	if (scale < 0) {
+		printf("Invalid replay mode \"%s\"\n\n", args[2]);
 		return -1;
 	}
 
-	prev_iface = iface;
+	int window = argc > 3 ? strtol(args[3], NULL, 0) : DEFAULT_CTRL_WINDOW;
+	if (window < 1)
+		window = 1;
+	if (window > MAX_REPLAY_WINDOW)
+		window = MAX_REPLAY_WINDOW;
 
-	res = libusb_set_interface_alt_setting(dev, iface, alt);
-	if (res != 0) {
-		printf("Failed to set alt setting %d on interface %d: %s (%d)\n\n", alt, iface, libusb_strerror(res), res);
+	int fd = open(args[1], O_RDONLY);
+	if (fd < 0) {
+		printf("Could not open %s\n\n", args[1]);
 		return -2;
 	}
 
-	return 0;
-}
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_size < PCAP_MIN_SIZE) {
+		printf("%s is too small to be a capture\n\n", args[1]);
+		close(fd);
+		return -3;
+	}
 
-int ctrl(int argc, char **args) {
-	Xfer_Entry *xfer = new_transfer();
-	xfer->type = TYPE_CTRL;
+	u8 *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		printf("Could not map %s\n\n", args[1]);
+		return -4;
+	}
 
-	xfer->req_type = strtol(args[1], NULL, 16);
-	xfer->req = strtol(args[2], NULL, 0);
-	xfer->value = strtol(args[3], NULL, 0);
-	xfer->index = strtol(args[4], NULL, 0);
+	Replay_Pair *pairs = NULL;
+	int n_pairs = pair_requests(buf, st.st_size, &pairs);
 
-	if (xfer->req_type & 0x80) {
-		xfer->size = strtol(args[5], NULL, 0);
-		xfer->data = allocate(xfer->size);
-	}
-	else {
-		int sz = read_file(args[5], &xfer->data, 0, allocate);
-		if (sz <= 0)
-			sz = parse_byte_array(argc, args, 5, &xfer->data, 0, allocate);
+	replay_state.window = window;
+	replay_state.in_flight = 0;
+	replay_state.capture = buf;
+	replay_state.n_mismatches = 0;
 
-		xfer->size = sz;
-	}
+	int n_replayed = 0, n_skipped = 0, res = 0;
+	u64 start = get_time_ns();
+	u64 first_ts = 0, last_ts = 0;
 
-	xfer->res = libusb_control_transfer(dev, xfer->req_type, xfer->req, xfer->value, xfer->index, xfer->data, xfer->size, XFER_TIMEOUT);	
-	return 0;
-}
+	for (int i = 0; i < n_pairs; i++) {
+		struct Packet pkt;
+		get_next_packet(&pkt, buf, pairs[i].req);
+		if (i == 0)
+			first_ts = pkt.ts_us;
+		last_ts = pkt.ts_us;
 
-Xfer_Entry *data_transfer(int argc, char **args, Data_Xfer func) {
-	Xfer_Entry *xfer = new_transfer();
-	xfer->endpoint = (u8)strtol(args[1], NULL, 16);
+		// records aren't necessarily in order of submission (eg. those written by record)
+		u64 offset_us = pkt.ts_us > first_ts ? pkt.ts_us - first_ts : 0;
+		if (scale > 0 && wait_replay_until(start + (u64)(offset_us * 1000.0 * scale)) < 0)
+			break;
 
-	if (xfer->endpoint & 0x80) {
-		xfer->size = strtol(args[2], NULL, 0);
-		xfer->data = allocate(xfer->size);
-	}
-	else {
-		int sz = read_file(args[2], &xfer->data, 0, allocate);
-		if (sz <= 0)
-			sz = parse_byte_array(argc, args, 5, &xfer->data, 0, allocate);
+		res = submit_replay(&pairs[i]);
+		if (res < 0)
+			break;
 
-		xfer->size = sz;
+		if (res > 0)
+			n_replayed++;
+		else
+			n_skipped++;
 	}
 
-	func(dev, xfer->endpoint, xfer->data, xfer->size, &xfer->res, XFER_TIMEOUT);
-	return xfer;
-}
+	wait_replay(0);
+	u64 elapsed = get_time_ns() - start;
 
-int int_cmd(int argc, char **args) {
-	Xfer_Entry *xfer = data_transfer(argc, args, libusb_interrupt_transfer);
-	xfer->type = TYPE_INT;
-	return 0;
-}
-int bulk(int argc, char **args) {
-	Xfer_Entry *xfer = data_transfer(argc, args, libusb_bulk_transfer);
-	xfer->type = TYPE_BULK;
-	return 0;
+	printf(
+		"Replayed %d of %d request(s) in %.3f s (%.3f s in the capture), %d skipped, %d mismatch(es)\n\n",
+		n_replayed, n_pairs, (double)elapsed / 1e9, (double)(last_ts - first_ts) / 1e6, n_skipped, replay_state.n_mismatches
+	);
+
+	munmap(buf, st.st_size);
+	free(pairs);
+	replay_state.capture = NULL;
+
+	return res < 0 ? res : 0;
 }
 
-Isoc_Ring isoc_chain[ISOC_RING_LEN] = {NULL};
-Isoc_Ring *head_isoc = NULL;
+typedef struct {
+	int kind;
+	int value;
+} Operand;
 
-void isoc_cb(struct libusb_transfer *usb_xfer) {
-	int total = usb_xfer->num_iso_packets;
-	int size = 0, errors = 0;
-	struct libusb_iso_packet_descriptor *pk = &usb_xfer->iso_packet_desc[0];
+typedef struct {
+	int var;  // script variable slot, or -1 to test the last transfer
+	Filter flt;
+} Condition;
 
-	for (int i = 0; i < total; i++, pk++) {
-		size += pk->actual_length;
-		if (pk->status != 0)
-			errors++;
-	}
+typedef struct {
+	int op;
+	int line;
 
-	Xfer_Entry *xfer = usb_xfer->user_data;
-	xfer->size = size;
-	xfer->res = xfer->size;
-	xfer->n_errors = errors;
+	// OP_CMD
+	int cmd;
+	int argc;
+	char **args;
+	int *arg_vars; // per argument: the variable slot to substitute, or -1
 
-	//printf("isoc_cb() : Success rate = %d / %d\n", n, total);
-}
+	// OP_SET
+	int dest;
+	int bin_op;
+	Operand a;
+	Operand b;
 
-int isoc(int argc, char **args) {
-	Xfer_Entry *xfer = new_transfer();
-	xfer->type = TYPE_ISOC;
+	// OP_REPEAT / OP_WHILE / OP_IF
+	Condition cond;
 
-	xfer->endpoint = strtol(args[1], NULL, 16);
-	xfer->n_pkts   = strtol(args[2], NULL, 0);
-	xfer->pkt_sz   = strtol(args[3], NULL, 0);
+	// OP_REPEAT / OP_WHILE / OP_IF: index of the matching OP_END
+	// OP_END / OP_BREAK: index of the block (or loop) that it closes
+	int jump;
+} Instr;
 
-	xfer->size = xfer->n_pkts * xfer->pkt_sz;
-	xfer->data = allocate(xfer->size);
+typedef struct {
+	char *name;
+	char *text;
+	Instr *code;
+	int n_instrs;
+	int cap;
+} Script;
 
-	for (int i = 0; i < ISOC_RING_LEN; i++) {
-		int needs_realloc = isoc_chain[i].usb && isoc_chain[i].usb->num_iso_packets != xfer->n_pkts;
-		if (!isoc_chain[i].usb || needs_realloc) {
-			if (needs_realloc)
-				libusb_free_transfer(isoc_chain[i].usb);
+struct Command {
+	int (*func)(int, char **);
+	const char *name;
+	int min_args;
+};
 
-			isoc_chain[i].usb = libusb_alloc_transfer(xfer->n_pkts);
+extern struct Command cmd_table[];
+int find_command(const char *name);
 
-			isoc_chain[i].next = i == ISOC_RING_LEN-1 ? &isoc_chain[0] : &isoc_chain[i+1];
-		}
+char script_var_names[MAX_SCRIPT_VARS][SCRIPT_NAME_LEN];
+int script_vars[MAX_SCRIPT_VARS];
+int n_script_vars = 0;
+
+int get_script_var(const char *name, int len) {
+	if (len <= 0 || len >= SCRIPT_NAME_LEN)
+		return -1;
+
+	for (int i = 0; i < n_script_vars; i++) {
+		if (!strncmp(script_var_names[i], name, len) && script_var_names[i][len] == 0)
+			return i;
 	}
-	if (!head_isoc)
-		head_isoc = &isoc_chain[0];
 
-	if ((xfer->endpoint & 0x80) == 0) {
-		if (argc < 5) {
-			printf("Input file or array required for sending data w/ isochronous transfer\n");
-			return -1;
-		}
+	if (n_script_vars >= MAX_SCRIPT_VARS)
+		return -1;
 
-		int sz = read_file(args[4], &xfer->data, xfer->size, NULL);
-		if (sz <= 0)
-			sz = parse_byte_array(argc, args, 4, &xfer->data, xfer->size, NULL);
+	memcpy(script_var_names[n_script_vars], name, len);
+	script_var_names[n_script_vars][len] = 0;
+	script_vars[n_script_vars] = 0;
+	return n_script_vars++;
+}
 
-		if (sz < xfer->size)
-			memset(xfer->data + sz, 0, xfer->size - sz);
-	}
+int get_var_name_len(const char *str) {
+	const char *p = str;
+	while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
+		p++;
 
-	libusb_fill_iso_transfer(head_isoc->usb, dev, xfer->endpoint, xfer->data, xfer->size, xfer->n_pkts, isoc_cb, xfer, XFER_TIMEOUT);
-	libusb_set_iso_packet_lengths(head_isoc->usb, xfer->pkt_sz);
+	return p - str;
+}
 
-	int res = libusb_submit_transfer(head_isoc->usb);
-	head_isoc = head_isoc->next;
+int parse_operand(Operand *opnd, char *str) {
+	if (*str == '$') {
+		opnd->kind = OPND_VAR;
+		opnd->value = get_script_var(str + 1, get_var_name_len(str + 1));
+		return opnd->value;
+	}
 
-	if (res >= 0) {
-		res = libusb_handle_events(NULL);
-		if (res < 0)
-			printf("libusb_handle_events() = %d : %s\n\n", res, libusb_strerror(res));
+	if ((*str >= '0' && *str <= '9') || *str == '-') {
+		opnd->kind = OPND_CONST;
+		opnd->value = strtol(str, NULL, 0);
+		return 0;
 	}
-	else
-		printf("libusb_submit_transfer() = %d : %s\n\n", res, libusb_strerror(res));
 
-	return res < 0 ? res : 0;
+	Filter flt = parse_filter(str);
+	opnd->kind = OPND_XFER;
+	opnd->value = flt.var;
+	return flt.var;
 }
 
-int list(int argc, char **args) {
-	Filter filters[N_VARS];
-	int n_flts = 0;
+int parse_condition(Condition *cond, char *str) {
+	if (*str != '$') {
+		cond->var = -1;
+		cond->flt = parse_filter(str);
+		return cond->flt.var;
+	}
 
-	for (int i = 0; i < argc-1 && i < N_VARS; i++) {
-		filters[i] = parse_filter(args[i+1]);
-		if (filters[i].var < 0)
-			return -1;
+	int len = get_var_name_len(str + 1);
+	cond->var = get_script_var(str + 1, len);
+	cond->flt.var = 0;
+	cond->flt.min = INT_MIN;
+	cond->flt.max = INT_MAX;
 
-		n_flts++;
-		for (int j = 0; j < n_flts-1; j++) {
-			if (filters[i].var == filters[j].var) {
-				printf("Cannot apply two filters on the same variable\n");
-				return -2;
-			}
-		}
+	char *p = str + 1 + len;
+	int sign = get_filter_part(&cond->flt, p, &p);
+	if (sign <= 0) {
+		printf("No qualifier in \"%s\" was found\n", str);
+		return -1;
 	}
 
-	const char *types[] = {
-		"control", "interrupt", "bulk", "isochronous"
-	};
+	get_filter_part(&cond->flt, p, &p);
+	return cond->var;
+}
 
-	Xfer_Entry *xfer = first_xfer;
-	int count = 0;
-	while (xfer) {
-		count++;
+int get_operand(Operand *opnd) {
+	if (opnd->kind == OPND_CONST)
+		return opnd->value;
+	if (opnd->kind == OPND_VAR)
+		return script_vars[opnd->value];
 
-		if (test_filters(xfer, filters, n_flts) == 0) {
-			xfer = xfer->next;
-			continue;
-		}
+	Xfer_Entry *last = get_transfer(n_xfers - 1);
+	if (!last)
+		return 0;
 
-		printf("%5d - type = %s, ", xfer->id, types[xfer->type - 1]);
+	int n = get_filter_value(last, opnd->value);
+	return n == INT_MIN ? 0 : n;
+}
 
-		int i;
-		switch (xfer->type) {
-			case TYPE_CTRL:
-				printf(
-					"req type = %#x, req = %#x, value = %#x, index = %#x, data = ",
-					xfer->req_type, xfer->req, xfer->value, xfer->index
-				);
-				for (i = 0; i < xfer->size; i++)
-					printf("%02x ", xfer->data[i]);
+int test_condition(Condition *cond) {
+	if (cond->var >= 0) {
+		int n = script_vars[cond->var];
+		return n >= cond->flt.min && n <= cond->flt.max;
+	}
 
-				break;
-			case TYPE_INT:
-			case TYPE_BULK:
-				printf("endpoint = %#x, data = ", xfer->endpoint);
-				for (i = 0; i < xfer->size; i++)
-					printf("%02x ", xfer->data[i]);
+	Xfer_Entry *last = get_transfer(n_xfers - 1);
+	return last && test_filters(last, &cond->flt, 1);
+}
 
-				break;
-			case TYPE_ISOC:
-				printf(
-					"endpoint = %#x, max size = %d, actual size = %d, packets = %d, errors = %d",
-					xfer->endpoint, xfer->n_pkts * xfer->pkt_sz, xfer->size, xfer->n_pkts, xfer->n_errors
-				);
-				break;
-		}
+Instr *add_instr(Script *scr, int op, int line) {
+	if (scr->n_instrs >= scr->cap) {
+		scr->cap = scr->cap ? scr->cap * 2 : 256;
+		scr->code = realloc(scr->code, scr->cap * sizeof(Instr));
+	}
 
-		putchar('\n');
-		xfer = xfer->next;
+	Instr *ins = &scr->code[scr->n_instrs++];
+	memset(ins, 0, sizeof(Instr));
+	ins->op = op;
+	ins->line = line;
+	ins->jump = -1;
+	return ins;
+}
+
+void free_script(Script *scr) {
+	for (int i = 0; i < scr->n_instrs; i++) {
+		free(scr->code[i].args);
+		free(scr->code[i].arg_vars);
 	}
 
-	putchar('\n');
+	free(scr->code);
+	free(scr->text);
+	memset(scr, 0, sizeof(Script));
 }
 
-int save(int argc, char **args) {
-	Filter filters[N_VARS];
-	int n_flts = 0;
+// Turns a script file into a list of instructions. Returns 0 on success.
+int compile_script(Script *scr, char *name) {
+	memset(scr, 0, sizeof(Script));
+	scr->name = name;
 
-	for (int i = 0; i < argc-2 && i < N_VARS; i++) {
-		filters[i] = parse_filter(args[i+2]);
-		if (filters[i].var < 0)
-			return -1;
+	int sz = read_file(name, (u8**)&scr->text, 0, malloc_ator);
+	if (sz < 0) {
+		printf("Could not open script file %s\n", name);
+		return -1;
+	}
+	scr->text[sz] = 0;
 
-		n_flts++;
-		for (int j = 0; j < n_flts-1; j++) {
-			if (filters[i].var == filters[j].var) {
-				printf("Cannot apply two filters on the same variable\n");
-				return -2;
+	int blocks[MAX_BLOCK_DEPTH];
+	int depth = 0;
+	int line_no = 0;
+	char *args[MAX_ARGS];
+	char *p = scr->text;
+
+	int next_line = 1;
+
+	while (*p) {
+		char *line = p;
+		line_no = next_line++;
+
+		while (*p && *p != '\n') {
+			// a backslash at the end of a line joins it to the next one
+			if (p[0] == '\\' && (p[1] == '\n' || (p[1] == '\r' && p[2] == '\n'))) {
+				while (*p != '\n')
+					*p++ = ' ';
+				*p++ = ' ';
+				next_line++;
+				continue;
 			}
+			p++;
 		}
-	}
+		if (*p)
+			*p++ = 0;
 
-	FILE *f = NULL;
-	Xfer_Entry *xfer = first_xfer;
+		int n_args = tokenise(line, strlen(line) + 1, args, MAX_ARGS);
+		if (n_args > MAX_ARGS) {
+			printf("Line %d of %s exceeds the argument limit of %d\n", line_no, name, MAX_ARGS-1);
+			return -2;
+		}
 
-	while (xfer) {
-		if (test_filters(xfer, &filters[0], n_flts) == 0) {
-			xfer = xfer->next;
-			continue;
+		// drop the empty arguments left by indentation and repeated spaces
+		int argc = 0;
+		for (int i = 0; i < n_args; i++) {
+			if (args[i][0])
+				args[argc++] = args[i];
 		}
 
-		if (!f) {
-			f = fopen(args[1], "wb");
-			if (!f) {
-				printf("Could not open file \"%s\"\n", args[1]);
+		if (argc == 0 || args[0][0] == '#')
+			continue;
+
+		char *cmd = args[0];
+		int opens_block = !strcmp(args[argc-1], "{");
+		if (opens_block)
+			argc--;
+
+		Instr *ins = NULL;
+		int err = 0;
+
+		if (!strcmp(cmd, "}")) {
+			if (depth == 0) {
+				printf("Line %d of %s: unmatched \"}\"\n", line_no, name);
 				return -3;
 			}
+
+			ins = add_instr(scr, OP_END, line_no);
+			ins->jump = blocks[--depth];
+			scr->code[ins->jump].jump = scr->n_instrs - 1;
+			continue;
+		}
+
+		if (!strcmp(cmd, "repeat") || !strcmp(cmd, "while") || !strcmp(cmd, "if")) {
+			if (!opens_block || argc != 2) {
+				printf("Line %d of %s: expected \"%s <%s> {\"\n", line_no, name, cmd, cmd[0] == 'r' ? "count" : "condition");
+				return -4;
+			}
+			if (depth >= MAX_BLOCK_DEPTH) {
+				printf("Line %d of %s: blocks are nested too deeply\n", line_no, name);
+				return -5;
+			}
+
+			if (cmd[0] == 'r') {
+				ins = add_instr(scr, OP_REPEAT, line_no);
+				err = parse_operand(&ins->a, args[1]);
+			}
+			else {
+				ins = add_instr(scr, cmd[0] == 'w' ? OP_WHILE : OP_IF, line_no);
+				err = parse_condition(&ins->cond, args[1]);
+			}
+
+			blocks[depth++] = scr->n_instrs - 1;
+		}
+		else if (opens_block) {
+			printf("Line %d of %s: unexpected \"{\"\n", line_no, name);
+			return -4;
+		}
+		else if (!strcmp(cmd, "break")) {
+			ins = add_instr(scr, OP_BREAK, line_no);
+			for (int i = depth-1; i >= 0; i--) {
+				if (scr->code[blocks[i]].op != OP_IF) {
+					ins->jump = blocks[i];
+					break;
+				}
+			}
+			if (ins->jump < 0) {
+				printf("Line %d of %s: break outside of a loop\n", line_no, name);
+				return -6;
+			}
+		}
+		else if (!strcmp(cmd, "exit") || !strcmp(cmd, "quit")) {
+			add_instr(scr, OP_EXIT, line_no);
+		}
+		else if (!strcmp(cmd, "set")) {
+			if (argc != 3 && argc != 5) {
+				printf("Line %d of %s: expected \"set <name> <value> [<op> <value>]\"\n", line_no, name);
+				return -7;
+			}
+
+			ins = add_instr(scr, OP_SET, line_no);
+			ins->dest = get_script_var(args[1], strlen(args[1]));
+			err = ins->dest < 0 ? -1 : parse_operand(&ins->a, args[2]);
+
+			if (argc == 5 && err >= 0) {
+				const char *ops[] = {"+", "-", "*", "/", "%", "&", "|", "^", "<<", ">>"};
+				for (int i = 0; i < sizeof(ops) / sizeof(char*); i++) {
+					if (!strcmp(args[3], ops[i]))
+						ins->bin_op = i + 1;
+				}
+				err = ins->bin_op ? parse_operand(&ins->b, args[4]) : -1;
+			}
+		}
+		else {
+			int idx = find_command(cmd);
+			if (idx < 0) {
+				printf("Line %d of %s: unrecognised command \"%s\"\n", line_no, name, cmd);
+				return -8;
+			}
+			if (argc < cmd_table[idx].min_args) {
+				printf(
+					"Line %d of %s: the %s command requires at least %d parameter(s)\n",
+					line_no, name, cmd, cmd_table[idx].min_args-1
+				);
+				return -9;
+			}
+
+			ins = add_instr(scr, OP_CMD, line_no);
+			ins->cmd = idx;
+			ins->argc = argc;
+			ins->args = malloc(argc * sizeof(char*));
+			memcpy(ins->args, args, argc * sizeof(char*));
+
+			for (int i = 1; i < argc; i++) {
+				if (args[i][0] != '$')
+					continue;
+
+				if (!ins->arg_vars) {
+					ins->arg_vars = malloc(argc * sizeof(int));
+					for (int j = 0; j < argc; j++)
+						ins->arg_vars[j] = -1;
+				}
+
+				ins->arg_vars[i] = get_script_var(args[i] + 1, strlen(args[i] + 1));
+				if (ins->arg_vars[i] < 0)
+					err = -1;
+			}
 		}
 
-		fwrite(xfer->data, 1, xfer->size, f);
+		if (err < 0) {
+			printf("Line %d of %s could not be compiled\n", line_no, name);
+			return -10;
+		}
+	}
 
-		xfer = xfer->next;
+	if (depth > 0) {
+		printf("%s: missing \"}\" for the block opened on line %d\n", name, scr->code[blocks[depth-1]].line);
+		return -11;
 	}
-	if (f)
-		fclose(f);
 
 	return 0;
 }
 
-static char cmd_buf[CMD_BUF_SIZE];
+// Works out the script line of the request a batch failed on (or <line>, if it failed some other way), and returns the error
+int batch_failure(const int *batch_lines, int line, int *failed_line) {
+	Xfer_Entry *xfer = ctrl_batch.failed;
+	*failed_line = xfer ? batch_lines[xfer->id % MAX_CTRL_WINDOW] : line;
+	return xfer ? xfer->res : -2;
+}
 
-int parse_and_run_command(char **args, const int max_args);
+// Stops at the first command that fails (for ctrl, that includes the transfer itself failing, whether it's pipelined or not)
+int run_script(Script *scr, int window) {
+	int *counters = calloc(scr->n_instrs + 1, sizeof(int));
+	int batch_lines[MAX_CTRL_WINDOW]; // line of each pipelined transfer, by transfer id
+	int batching = 0;
+	int res = 0;
+	int failed_line = 0;
+	int pc = 0;
+
+	while (pc < scr->n_instrs) {
+		Instr *ins = &scr->code[pc];
+		struct Command *cmd = ins->op == OP_CMD ? &cmd_table[ins->cmd] : NULL;
+
+		// Consecutive control transfers are pipelined (if a window was given).
+		// Anything that might look at the result of a transfer flushes them first.
+		int keeps_batch = ins->op == OP_REPEAT || ins->op == OP_END || (cmd && cmd->func == ctrl);
+		if (batching && !keeps_batch) {
+			batching = 0;
+			if (end_ctrl_batch() < 0) {
+				res = batch_failure(batch_lines, ins->line, &failed_line);
+				break;
+			}
+		}
 
-int exec(int argc, char **args) {
-	FILE *f = fopen(args[1], "r");
-	if (!f) {
-		printf("Could not open script file %s\n", args[1]);
-		return -1;
+		pc++;
+
+		switch (ins->op) {
+			case OP_CMD:
+			{
+				char **args = ins->args;
+				char *sub_args[MAX_ARGS];
+				char sub_bufs[MAX_ARGS][16];
+
+				if (ins->arg_vars) {
+					for (int i = 0; i < ins->argc; i++) {
+						sub_args[i] = ins->args[i];
+						if (ins->arg_vars[i] < 0)
+							continue;
+
+						snprintf(sub_bufs[i], 16, "%#x", script_vars[ins->arg_vars[i]]);
+						sub_args[i] = sub_bufs[i];
+					}
+					args = sub_args;
+				}
+
+				if (window > 1 && cmd->func == ctrl) {
+					if (!batching)
+						begin_ctrl_batch(window);
+
+					batching = 1;
+					if (batch_ctrl(ins->argc, args) < 0) {
+						res = batch_failure(batch_lines, ins->line, &failed_line);
+						pc = scr->n_instrs;
+					}
+					else {
+						batch_lines[(n_xfers - 1) % MAX_CTRL_WINDOW] = ins->line;
+					}
+					break;
+				}
+
+				int first = n_xfers;
+				int cmd_res = cmd->func(ins->argc, args);
+				if (cmd_res == EXIT) {
+					res = EXIT;
+					pc = scr->n_instrs;
+				}
+				else if (cmd_res < 0 || (cmd->func == ctrl && n_xfers > first && get_transfer(n_xfers - 1)->res < 0)) {
+					res = cmd_res < 0 ? cmd_res : get_transfer(n_xfers - 1)->res;
+					failed_line = ins->line;
+					pc = scr->n_instrs;
+				}
+				break;
+			}
+			case OP_SET:
+			{
+				int a = get_operand(&ins->a);
+				int b = ins->bin_op ? get_operand(&ins->b) : 0;
+
+				switch (ins->bin_op) {
+					case 0:  break;
+					case 1:  a += b; break;
+					case 2:  a -= b; break;
+					case 3:  a *= b; break;
+					case 4:  a = b ? a / b : 0; break;
+					case 5:  a = b ? a % b : 0; break;
+					case 6:  a &= b; break;
+					case 7:  a |= b; break;
+					case 8:  a ^= b; break;
+					case 9:  a <<= b; break;
+					case 10: a >>= b; break;
+				}
+
+				script_vars[ins->dest] = a;
+				break;
+			}
+			case OP_REPEAT:
+				counters[pc-1] = get_operand(&ins->a);
+				if (counters[pc-1] <= 0)
+					pc = ins->jump + 1;
+				break;
+			case OP_WHILE:
+			case OP_IF:
+				if (!test_condition(&ins->cond))
+					pc = ins->jump + 1;
+				break;
+			case OP_END:
+			{
+				Instr *block = &scr->code[ins->jump];
+				if (block->op == OP_WHILE)
+					pc = ins->jump;
+				else if (block->op == OP_REPEAT && --counters[ins->jump] > 0)
+					pc = ins->jump + 1;
+				break;
+			}
+			case OP_BREAK:
+				pc = scr->code[ins->jump].jump + 1;
+				break;
+			case OP_EXIT:
+				res = EXIT;
+				pc = scr->n_instrs;
+				break;
+		}
 	}
 
-	while (fgets(cmd_buf, CMD_BUF_SIZE, f)) {
-		int res = parse_and_run_command(args, MAX_ARGS);
-		if (res == EXIT)
-			return res;
+	if (batching && end_ctrl_batch() < 0) {
+		res = batch_failure(batch_lines, scr->code[scr->n_instrs - 1].line, &failed_line);
 	}
 
-	return 0;
+	if (failed_line)
+		printf("%s stopped at line %d, which failed (%d)\n\n", scr->name, failed_line, res);
+
+	free(counters);
+	return res;
 }
 
-struct Command {
-	int (*func)(int, char **);
-	const char *name;
-	int min_args;
-} cmd_table[] = {
+int exec(int argc, char **args) {
+	// with a window > 1, consecutive ctrl commands are pipelined as a batch
+	int window = argc > 2 ? strtol(args[2], NULL, 0) : 1;
+
+	Script scr;
+	int res = compile_script(&scr, args[1]);
+	if (res == 0)
+		res = run_script(&scr, window);
+
+	free_script(&scr);
+	return res;
+}
+
+struct Command cmd_table[] = {
 	{help, "help", 1},
 	{sel, "select", 3},
+	{alts, "alts", 1},
+	{autoselect, "autoselect", 2},
 	{ctrl, "ctrl", 6},
 	{int_cmd, "int", 3},
 	{bulk, "bulk", 3},
 	{isoc, "isoc", 4},
+	{stream, "stream", 6},
+	{frames, "frames", 1},
+	{thumbs, "thumbs", 1},
+	{publish, "publish", 1},
 	{list, "list", 1},
 	{save, "save", 2},
+	{stats, "stats", 1},
+	{dedup_cmd, "dedup", 1},
+	{bench, "bench", 2},
+	{list_devices, "devices", 1},
+	{open_dev, "open", 2},
+	{use_dev, "use", 2},
+	{shadow_cmd, "shadow", 1},
+	{regdump, "regdump", 1},
+	{regdiff, "regdiff", 2},
+	{watch_cmd, "watch", 3},
+	{capture, "capture", 6},
+	{session, "session", 1},
+	{load, "load", 2},
+	{record, "record", 1},
+	{ctrlbatch, "ctrlbatch", 2},
+	{replay, "replay", 2},
 	{exec, "exec", 2}
 };
 const int N_CMDS = sizeof(cmd_table) / sizeof(struct Command);
 
-int parse_and_run_command(char **args, const int max_args) {
-	int n_args = 0;
-	int quotes = 0;
-	char *p = cmd_buf;
-	for (int i = 0; i < CMD_BUF_SIZE; i++) {
-		quotes ^= *p == '\"';
-		int end = *p == '\n' || *p == '\r';
+int find_command(const char *name) {
+	for (int i = 0; i < N_CMDS; i++) {
+		if (!strcmp(name, cmd_table[i].name))
+			return i;
+	}
 
-		if (*p == '\t')
-			*p = ' ';
+	return -1;
+}
 
-		if (end || (*p == ' ' && !quotes)) {
-			*p = 0;
-			n_args++;
-			if (end) break;
-		}
-		p++;
-	}
+int parse_and_run_command(char **args, const int max_args) {
+	int n_args = tokenise(cmd_buf, strlen(cmd_buf) + 1, args, max_args);
 
 	if (!strlen(cmd_buf))
 		return 0;
@@ -789,23 +5698,10 @@ int parse_and_run_command(char **args, const int max_args) {
 		return 0;
 	}
 
-	p = cmd_buf;
-	for (int i = 0; i < n_args; i++) {
-		args[i] = p;
-		p += strlen(p) + 1;
-	}
-
 	if (!strcmp(args[0], "exit") || !strcmp(args[0], "quit"))
 		return EXIT;
 
-	int idx = -1;
-	for (int i = 0; i < N_CMDS; i++) {
-		if (!strcmp(args[0], cmd_table[i].name)) {
-			idx = i;
-			break;
-		}
-	}
-
+	int idx = find_command(args[0]);
 	if (idx < 0) {
 		printf("Unrecognised command \"%s\"\n\n", args[0]);
 		return 0;
@@ -831,10 +5727,17 @@ int parse_and_run_command(char **args, const int max_args) {
 
 int main(int argc, char **argv) {
 	printf("USB Packet Shell\n\n");
-	if (argc != 3) {
+	time_origin = get_time_ns();
+	int emulate = argc >= 2 && !strcmp(argv[1], "-e");
+	if ((argc != 3 && argc != 4) && !emulate) {
 		printf(
-			"Usage: %s <Vendor ID> <Product ID>\n",
-			argv[0]
+			"Usage: %s <Vendor ID> <Product ID> [bus-port path / serial number]\n"
+			"       %s -e [packets/sec] [error interval]\n"
+			"  Opens the first matching device, unless a path (eg. 1-1.4) or serial number is given.\n"
+			"  -e runs against an emulated em28xx instead of a real device.\n"
+			"     Its video endpoint (0x82) produces [packets/sec] isochronous packets per second\n"
+			"     (default %d, 0 = unlimited), and every [error interval]th packet fails (default never)\n",
+			argv[0], argv[0], EMU_PKT_RATE
 		);
 		return 1;
 	}
@@ -844,23 +5747,34 @@ int main(int argc, char **argv) {
 		return 2;
 	}
 
-	int vendor  = strtol(argv[1], NULL, 16);
-	int product = strtol(argv[2], NULL, 16);
+	if (emulate) {
+		emu_rate = argc > 2 ? strtol(argv[2], NULL, 0) : EMU_PKT_RATE;
+		emu_error_interval = argc > 3 ? strtol(argv[3], NULL, 0) : 0;
+		add_device("emu");
 
-	dev = libusb_open_device_with_vid_pid(NULL, vendor, product);
-	if (!dev) {
-		printf("Could not open USB device %04x:%04x\n", vendor, product);
-		libusb_exit(NULL);
-		return 3;
+		printf("Opened emulated device %04x:%04x\nType \"help\" for a list of recognised commands\n\n", EMU_VENDOR, EMU_PRODUCT);
+	}
+	else {
+		vendor_id  = strtol(argv[1], NULL, 16);
+		product_id = strtol(argv[2], NULL, 16);
+
+		if (add_device(argc > 3 ? argv[3] : NULL) < 0) {
+			printf("Could not open USB device %04x:%04x\n", vendor_id, product_id);
+			libusb_exit(NULL);
+			return 3;
+		}
+
+		printf("Opened device %04x:%04x at %s\nType \"help\" for a list of recognised commands\n\n", vendor_id, product_id, devices[0].path);
 	}
 
-	printf("Opened device %04x:%04x\nType \"help\" for a list of recognised commands\n\n", vendor, product);
+	use_device(0);
 
 	char *args[MAX_ARGS];
 
 	while (1) {
 		printf("> ");
-		fgets(cmd_buf, CMD_BUF_SIZE, stdin);
+		if (read_line(stdin, &cmd_buf, &cmd_cap) < 0)
+			break;
 		putchar('\n');
 
 		int res = parse_and_run_command(args, MAX_ARGS);
@@ -872,16 +5786,32 @@ int main(int argc, char **argv) {
 		for (int i = 0; i < ISOC_RING_LEN; i++) {
 			if (isoc_chain[i].usb)
 				libusb_free_transfer(isoc_chain[i].usb);
+
+			free(isoc_chain[i].buf);
 		}
 	}
 
-	if (prev_iface >= 0)
-		libusb_release_interface(dev, prev_iface);
-
+	destroy_ctrl_batch();
+	destroy_watch();
+	destroy_replay();
+
+	if (rec_session.map)
+		close_session(&rec_session);
+	if (pcap_writer.f)
+		stop_pcap_writer(&pcap_writer);
+	if (frame_asm.running)
+		stop_frames(&frame_asm);
+	if (thumb_writer.running)
+		stop_thumbs(&thumb_writer);
+	shm_ring_close(&publish_ring);
+
+	unmap_session(&load_session);
+	destroy_transfers();
 	destroy_buckets();
 
-	libusb_close(dev);
+	close_devices();
 	libusb_exit(NULL);
+	free(cmd_buf);
 
 	return 0;
 }
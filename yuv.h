@@ -0,0 +1,378 @@
+// Conversion of the em28xx's video output formats to packed 24-bit RGB, and PPM output.
+// The 4:2:2 formats (the ones V_IN_MODE selects) have SSE2 and AVX2 kernels, picked at run time.
+// Every kernel uses the same fixed-point BT.601 maths (studio range in, full range out), so they all give the same result.
+// YUV411 is taken to be packed as U Y0 Y1 V Y2 Y3, which is how V4L2 describes the em28xx's 12-bit format.
+
+#ifndef YUV_H
+#define YUV_H
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_X86 1
+#endif
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define FMT_YUYV   0
+#define FMT_YVYU   1
+#define FMT_UYVY   2
+#define FMT_VYUY   3
+#define FMT_YUV411 4
+#define FMT_RGB565 5
+#define N_VIDEO_FORMATS 6
+
+#define SIMD_SCALAR 0
+#define SIMD_SSE2   1
+#define SIMD_AVX2   2
+
+static const struct {
+	const char *name;
+	int bits; // per pixel
+	int y, u, v; // byte offsets within each 4-byte group, for the 4:2:2 formats
+} video_formats[N_VIDEO_FORMATS] = {
+	{"yuyv",   16, 0, 1, 3},
+	{"yvyu",   16, 0, 3, 1},
+	{"uyvy",   16, 1, 0, 2},
+	{"vyuy",   16, 1, 2, 0},
+	{"yuv411", 12},
+	{"rgb565", 16}
+};
+
+static const char *simd_names[] = {"scalar", "SSE2", "AVX2"};
+
+// the highest level of SIMD that the conversions may use, set on first use (or beforehand, to force a lower one)
+static int yuv_simd = -1;
+
+static inline int get_video_format(const char *name) {
+	for (int i = 0; i < N_VIDEO_FORMATS; i++) {
+		if (!strcmp(name, video_formats[i].name))
+			return i;
+	}
+	return -1;
+}
+
+// Finds the format that the card sends given the values of V_IN_MODE (0x10) and OUT_FORMAT (0x27), or -1 for one that can't be converted
+static inline int get_video_format_from_regs(u8 v_in_mode, u8 out_format) {
+	if (out_format == 0x04)
+		return FMT_RGB565;
+	if (out_format == 0x18)
+		return FMT_YUV411;
+
+	switch (v_in_mode) {
+		case 0x08:
+			return FMT_YUYV;
+		case 0x09:
+			return FMT_YVYU;
+		case 0x0a:
+		case 0x10: // CbYCrY
+			return FMT_UYVY;
+		case 0x0b:
+			return FMT_VYUY;
+	}
+	return -1;
+}
+
+static inline int video_line_size(int fmt, int width) {
+	return width * video_formats[fmt].bits / 8;
+}
+
+static inline int get_simd_level(void) {
+	if (yuv_simd < 0) {
+		yuv_simd = SIMD_SCALAR;
+#ifdef YUV_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			yuv_simd = SIMD_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			yuv_simd = SIMD_SSE2;
+#endif
+	}
+	return yuv_simd;
+}
+
+// (a * b) >> 16, as _mm_mulhi_epi16 does it
+static inline int mulhi(int a, int b) {
+	return (a * b) >> 16;
+}
+
+static inline u8 clamp_u8(int x) {
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+// The coefficients are scaled by 512, and the inputs by 128, so that each product fits in 16 bits
+static inline void yuv_to_rgb(u8 *dst, int y, int u, int v) {
+	int yy = mulhi((y - 16) << 7, 596);
+	u = (u - 128) << 7;
+	v = (v - 128) << 7;
+
+	dst[0] = clamp_u8(yy + mulhi(v, 817));
+	dst[1] = clamp_u8(yy - mulhi(u, 200) - mulhi(v, 416));
+	dst[2] = clamp_u8(yy + mulhi(u, 1033));
+}
+
+static inline void yuv422_to_rgb_scalar(int fmt, const u8 *src, u8 *dst, int n_pixels) {
+	int yo = video_formats[fmt].y, uo = video_formats[fmt].u, vo = video_formats[fmt].v;
+
+	for (int i = 0; i < n_pixels; i += 2, src += 4, dst += 6) {
+		yuv_to_rgb(dst, src[yo], src[uo], src[vo]);
+		yuv_to_rgb(dst + 3, src[yo + 2], src[uo], src[vo]);
+	}
+}
+
+static inline void yuv411_to_rgb(const u8 *src, u8 *dst, int n_pixels) {
+	for (int i = 0; i < n_pixels; i += 4, src += 6, dst += 12) {
+		yuv_to_rgb(dst, src[1], src[0], src[3]);
+		yuv_to_rgb(dst + 3, src[2], src[0], src[3]);
+		yuv_to_rgb(dst + 6, src[4], src[0], src[3]);
+		yuv_to_rgb(dst + 9, src[5], src[0], src[3]);
+	}
+}
+
+static inline void rgb565_to_rgb(const u8 *src, u8 *dst, int n_pixels) {
+	for (int i = 0; i < n_pixels; i++, src += 2, dst += 3) {
+		int p = src[0] | (src[1] << 8);
+		int r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+		dst[0] = (r << 3) | (r >> 2);
+		dst[1] = (g << 2) | (g >> 4);
+		dst[2] = (b << 3) | (b >> 2);
+	}
+}
+
+#ifdef YUV_X86
+
+/*
+ * The SIMD kernels work on runs of 16 (SSE2) or 32 (AVX2) pixels.
+ * Each group of 4 pixels is written with a 16-byte store, 4 bytes of which get overwritten by the next group,
+ *  so a run may only be converted this way if there is at least one more pixel after it.
+ */
+
+// Converts 8 pixels of Y, U and V (one chroma value per pixel, already offset and scaled) to R, G and B
+#define YUV_RGB_8(vec, mulhi, add, sub, set1, y, u, v, r, g, b) \
+	do { \
+		vec yy = mulhi(y, set1(596)); \
+		r = add(yy, mulhi(v, set1(817))); \
+		g = sub(sub(yy, mulhi(u, set1(200))), mulhi(v, set1(416))); \
+		b = add(yy, mulhi(u, set1(1033))); \
+	} while (0)
+
+static inline __m128i rgbx_to_rgb_sse2(__m128i p) {
+	// within each 8-byte half, pack the second pixel up against the first
+	__m128i lo = _mm_and_si128(p, _mm_set1_epi64x(0xffffffLL));
+	__m128i hi = _mm_and_si128(_mm_srli_epi64(p, 8), _mm_set1_epi64x(0xffffff000000LL));
+	p = _mm_or_si128(lo, hi);
+
+	// then move the upper 6 bytes down against the lower ones
+	__m128i first = _mm_and_si128(p, _mm_set_epi32(0, 0, 0xffff, 0xffffffff));
+	__m128i second = _mm_and_si128(_mm_srli_si128(p, 2), _mm_set_epi32(0, 0xffffffff, 0xffff0000, 0));
+	return _mm_or_si128(first, second);
+}
+
+static inline void yuv422_to_rgb_sse2(int fmt, const u8 *src, u8 *dst, int n_pixels) {
+	int y_odd = video_formats[fmt].y;
+	int v_first = video_formats[fmt].v < video_formats[fmt].u;
+
+	const __m128i lo_bytes = _mm_set1_epi16(0xff);
+	const __m128i lo_words = _mm_set1_epi32(0xffff);
+	const __m128i y_bias = _mm_set1_epi16(16);
+	const __m128i c_bias = _mm_set1_epi16(128);
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 16 < n_pixels; i += 16, src += 32, dst += 48) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+
+		__m128i ya, yb, ca, cb;
+		if (y_odd) {
+			ya = _mm_srli_epi16(a, 8);
+			yb = _mm_srli_epi16(b, 8);
+			ca = _mm_and_si128(a, lo_bytes);
+			cb = _mm_and_si128(b, lo_bytes);
+		}
+		else {
+			ya = _mm_and_si128(a, lo_bytes);
+			yb = _mm_and_si128(b, lo_bytes);
+			ca = _mm_srli_epi16(a, 8);
+			cb = _mm_srli_epi16(b, 8);
+		}
+
+		// ca and cb alternate between the two chroma components
+		__m128i c0 = _mm_packs_epi32(_mm_and_si128(ca, lo_words), _mm_and_si128(cb, lo_words));
+		__m128i c1 = _mm_packs_epi32(_mm_srli_epi32(ca, 16), _mm_srli_epi32(cb, 16));
+		__m128i u = v_first ? c1 : c0;
+		__m128i v = v_first ? c0 : c1;
+
+		ya = _mm_slli_epi16(_mm_sub_epi16(ya, y_bias), 7);
+		yb = _mm_slli_epi16(_mm_sub_epi16(yb, y_bias), 7);
+		u = _mm_slli_epi16(_mm_sub_epi16(u, c_bias), 7);
+		v = _mm_slli_epi16(_mm_sub_epi16(v, c_bias), 7);
+
+		__m128i ra, ga, ba, rb, gb, bb;
+		YUV_RGB_8(__m128i, _mm_mulhi_epi16, _mm_add_epi16, _mm_sub_epi16, _mm_set1_epi16,
+			ya, _mm_unpacklo_epi16(u, u), _mm_unpacklo_epi16(v, v), ra, ga, ba);
+		YUV_RGB_8(__m128i, _mm_mulhi_epi16, _mm_add_epi16, _mm_sub_epi16, _mm_set1_epi16,
+			yb, _mm_unpackhi_epi16(u, u), _mm_unpackhi_epi16(v, v), rb, gb, bb);
+
+		__m128i r = _mm_packus_epi16(ra, rb);
+		__m128i g = _mm_packus_epi16(ga, gb);
+		__m128i bl = _mm_packus_epi16(ba, bb);
+
+		__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+		__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+		__m128i b_lo = _mm_unpacklo_epi8(bl, zero);
+		__m128i b_hi = _mm_unpackhi_epi8(bl, zero);
+
+		_mm_storeu_si128((__m128i*)dst,        rgbx_to_rgb_sse2(_mm_unpacklo_epi16(rg_lo, b_lo)));
+		_mm_storeu_si128((__m128i*)(dst + 12), rgbx_to_rgb_sse2(_mm_unpackhi_epi16(rg_lo, b_lo)));
+		_mm_storeu_si128((__m128i*)(dst + 24), rgbx_to_rgb_sse2(_mm_unpacklo_epi16(rg_hi, b_hi)));
+		_mm_storeu_si128((__m128i*)(dst + 36), rgbx_to_rgb_sse2(_mm_unpackhi_epi16(rg_hi, b_hi)));
+	}
+
+	yuv422_to_rgb_scalar(fmt, src, dst, n_pixels - i);
+}
+
+__attribute__((target("avx2")))
+static inline void yuv422_to_rgb_avx2(int fmt, const u8 *src, u8 *dst, int n_pixels) {
+	int y_odd = video_formats[fmt].y;
+	int v_first = video_formats[fmt].v < video_formats[fmt].u;
+
+	const __m256i lo_bytes = _mm256_set1_epi16(0xff);
+	const __m256i lo_words = _mm256_set1_epi32(0xffff);
+	const __m256i y_bias = _mm256_set1_epi16(16);
+	const __m256i c_bias = _mm256_set1_epi16(128);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i pack_rgb = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+	);
+
+	int i = 0;
+	for (; i + 32 < n_pixels; i += 32, src += 64, dst += 96) {
+		// every step below works within 128-bit lanes, so lane 0 ends up with pixels 0-7 and 16-23, and lane 1 with 8-15 and 24-31
+		__m256i a = _mm256_loadu_si256((const __m256i*)src);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+
+		__m256i ya, yb, ca, cb;
+		if (y_odd) {
+			ya = _mm256_srli_epi16(a, 8);
+			yb = _mm256_srli_epi16(b, 8);
+			ca = _mm256_and_si256(a, lo_bytes);
+			cb = _mm256_and_si256(b, lo_bytes);
+		}
+		else {
+			ya = _mm256_and_si256(a, lo_bytes);
+			yb = _mm256_and_si256(b, lo_bytes);
+			ca = _mm256_srli_epi16(a, 8);
+			cb = _mm256_srli_epi16(b, 8);
+		}
+
+		__m256i c0 = _mm256_packs_epi32(_mm256_and_si256(ca, lo_words), _mm256_and_si256(cb, lo_words));
+		__m256i c1 = _mm256_packs_epi32(_mm256_srli_epi32(ca, 16), _mm256_srli_epi32(cb, 16));
+		__m256i u = v_first ? c1 : c0;
+		__m256i v = v_first ? c0 : c1;
+
+		ya = _mm256_slli_epi16(_mm256_sub_epi16(ya, y_bias), 7);
+		yb = _mm256_slli_epi16(_mm256_sub_epi16(yb, y_bias), 7);
+		u = _mm256_slli_epi16(_mm256_sub_epi16(u, c_bias), 7);
+		v = _mm256_slli_epi16(_mm256_sub_epi16(v, c_bias), 7);
+
+		__m256i ra, ga, ba, rb, gb, bb;
+		YUV_RGB_8(__m256i, _mm256_mulhi_epi16, _mm256_add_epi16, _mm256_sub_epi16, _mm256_set1_epi16,
+			ya, _mm256_unpacklo_epi16(u, u), _mm256_unpacklo_epi16(v, v), ra, ga, ba);
+		YUV_RGB_8(__m256i, _mm256_mulhi_epi16, _mm256_add_epi16, _mm256_sub_epi16, _mm256_set1_epi16,
+			yb, _mm256_unpackhi_epi16(u, u), _mm256_unpackhi_epi16(v, v), rb, gb, bb);
+
+		__m256i r = _mm256_packus_epi16(ra, rb);
+		__m256i g = _mm256_packus_epi16(ga, gb);
+		__m256i bl = _mm256_packus_epi16(ba, bb);
+
+		__m256i rg_lo = _mm256_unpacklo_epi8(r, g);
+		__m256i rg_hi = _mm256_unpackhi_epi8(r, g);
+		__m256i b_lo = _mm256_unpacklo_epi8(bl, zero);
+		__m256i b_hi = _mm256_unpackhi_epi8(bl, zero);
+
+		__m256i p0 = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg_lo, b_lo), pack_rgb); // pixels 0-3, 8-11
+		__m256i p1 = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg_lo, b_lo), pack_rgb); // 4-7, 12-15
+		__m256i p2 = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg_hi, b_hi), pack_rgb); // 16-19, 24-27
+		__m256i p3 = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg_hi, b_hi), pack_rgb); // 20-23, 28-31
+
+		_mm_storeu_si128((__m128i*)dst,        _mm256_castsi256_si128(p0));
+		_mm_storeu_si128((__m128i*)(dst + 12), _mm256_castsi256_si128(p1));
+		_mm_storeu_si128((__m128i*)(dst + 24), _mm256_extracti128_si256(p0, 1));
+		_mm_storeu_si128((__m128i*)(dst + 36), _mm256_extracti128_si256(p1, 1));
+		_mm_storeu_si128((__m128i*)(dst + 48), _mm256_castsi256_si128(p2));
+		_mm_storeu_si128((__m128i*)(dst + 60), _mm256_castsi256_si128(p3));
+		_mm_storeu_si128((__m128i*)(dst + 72), _mm256_extracti128_si256(p2, 1));
+		_mm_storeu_si128((__m128i*)(dst + 84), _mm256_extracti128_si256(p3, 1));
+	}
+
+	yuv422_to_rgb_sse2(fmt, src, dst, n_pixels - i);
+}
+
+#endif
+
+/*
+ * Converts <n_pixels> pixels of <fmt> to packed RGB (3 bytes per pixel).
+ * A whole frame can be passed at once, since neither side has any padding between lines.
+ * For YUV411, <n_pixels> should be a multiple of 4, otherwise a multiple of 2.
+ */
+static inline void convert_to_rgb(int fmt, const u8 *src, u8 *dst, int n_pixels) {
+	switch (fmt) {
+		case FMT_YUV411:
+			yuv411_to_rgb(src, dst, n_pixels);
+			return;
+		case FMT_RGB565:
+			rgb565_to_rgb(src, dst, n_pixels);
+			return;
+	}
+
+#ifdef YUV_X86
+	int level = get_simd_level();
+	if (level >= SIMD_AVX2) {
+		yuv422_to_rgb_avx2(fmt, src, dst, n_pixels);
+		return;
+	}
+	if (level >= SIMD_SSE2) {
+		yuv422_to_rgb_sse2(fmt, src, dst, n_pixels);
+		return;
+	}
+#endif
+
+	yuv422_to_rgb_scalar(fmt, src, dst, n_pixels);
+}
+
+// Writes an RGB image as a binary PPM, keeping every <step>th pixel of every <step>th line
+static inline int write_ppm(const char *name, const u8 *rgb, int width, int height, int step) {
+	FILE *f = fopen(name, "wb");
+	if (!f)
+		return -1;
+
+	int out_w = (width + step - 1) / step;
+	int out_h = (height + step - 1) / step;
+	fprintf(f, "P6\n%d %d\n255\n", out_w, out_h);
+
+	if (step == 1) {
+		fwrite(rgb, 3, width * height, f);
+	}
+	else {
+		u8 line[out_w * 3];
+		for (int y = 0; y < height; y += step) {
+			const u8 *src = rgb + y * width * 3;
+			for (int x = 0; x < out_w; x++)
+				memcpy(&line[x * 3], &src[x * step * 3], 3);
+
+			fwrite(line, 3, out_w, f);
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+#endif